@@ -26,6 +26,9 @@
 #include <nori/color.h>
 #include <nori/vector.h>
 #include <tbb/mutex.h>
+#include <tbb/spin_mutex.h>
+#include <atomic>
+#include <memory>
 
 #define NORI_BLOCK_SIZE 32 /* Block size used for parallelization */
 
@@ -100,11 +103,65 @@ public:
     /**
      * \brief Merge another image block into this one
      *
-     * During the merge operation, this function locks 
-     * the destination block using a mutex.
+     * Several blocks can be merged concurrently, as long as they come from
+     * different tiles of a \ref BlockGenerator: the pixels that only the
+     * given block can touch are added without locking, while the border
+     * regions shared with neighboring tiles are protected by per-row locks.
+     * The block-wide mutex (see \ref lock()) is not taken, so readers may
+     * observe a partially merged block.
      */
     void put(ImageBlock &b);
 
+    /// Return the total time in seconds that merges spent waiting for row locks
+    double getContentionTime() const { return m_contentionTime * 1e-9; }
+
+    /// Return the number of row lock acquisitions that had to wait
+    uint64_t getContentionCount() const { return m_contentionCount; }
+
+    /// Reset the contention counters
+    void resetContention() { m_contentionTime = 0; m_contentionCount = 0; }
+
+    /**
+     * \brief Allocate per-pixel statistics of the values of independent
+     * rendering passes (see \ref putMoments())
+     */
+    void initMoments();
+
+    /**
+     * \brief Add the pixel values of a rendered block as one pass of
+     * \c sampleCount samples per pixel to the per-pixel statistics
+     *
+     * Uses the weighted version of Welford's algorithm (weighted by the
+     * sample count of the pass) to track the running mean and the sum of
+     * squared deviations, so that a shorter last pass doesn't count like a
+     * full one. Only the interior pixels of \c b are considered, so blocks
+     * that don't overlap can be added concurrently without locking.
+     */
+    void putMoments(const ImageBlock &b, uint32_t sampleCount);
+
+    /// Return the number of passes recorded for the given pixel
+    uint32_t getMomentCount(const Point2i &pixel) const {
+        return m_momentCount[pixel.y() * m_size.x() + pixel.x()];
+    }
+
+    /**
+     * \brief Estimate the RMS relative error of the pixel means in the
+     * given region (based on the luminance)
+     */
+    float getRelativeError(const Point2i &offset, const Vector2i &size) const;
+
+    /// Return the variance of each pixel's mean as a bitmap
+    Bitmap *toVarianceBitmap() const;
+
+    /**
+     * \brief Add the contents of a splat buffer (times \c scale) to the
+     * normalized pixel values
+     *
+     * The block must cover the entire image. Pixels without samples
+     * receive the splatted value only.
+     */
+    void putSplats(const SplatBuffer &splats, float scale);
+
     /// Lock the image block (using an internal mutex)
     inline void lock() const { m_mutex.lock(); }
     
@@ -114,6 +171,10 @@ public:
     /// Return a human-readable string summary
     std::string toString() const;
 protected:
+    /// Acquire the lock of the given row, recording the time spent waiting
+    void lockRow(int row);
+    void unlockRow(int row) { m_rowLocks[row].unlock(); }
+
     Point2i m_offset;
     Vector2i m_size;
     int m_borderSize = 0;
@@ -123,7 +184,54 @@ protected:
     float *m_weightsY = nullptr;
     float m_lookupFactor = 0;
     uint32_t m_blockId; // id given by the block generator
+    std::vector<uint32_t> m_momentCount;  // number of passes per pixel
+    std::vector<uint32_t> m_momentWeight; // number of samples of these passes
+    std::vector<Color3f> m_momentMean;    // running mean per pixel
+    std::vector<Color3f> m_momentM2;      // weighted sum of squared deviations per pixel
     mutable tbb::mutex m_mutex;
+    std::unique_ptr<tbb::spin_mutex[]> m_rowLocks; // used by put(ImageBlock&)
+    std::atomic<uint64_t> m_contentionTime;       // in nanoseconds
+    std::atomic<uint64_t> m_contentionCount;
+};
+
+/**
+ * \brief Unfiltered radiance storage for the entire image that can be
+ * written by many threads at once
+ *
+ * Samples that are computed for one pixel sometimes contribute to another,
+ * arbitrary one, e.g. when a light path is connected to the camera. Such
+ * "splats" can't be recorded in the image block that is being rendered,
+ * they are instead added to the pixel they land in using atomic operations.
+ * The sum is not normalized, see \ref ImageBlock::putSplats().
+ */
+class SplatBuffer {
+public:
+    /// Create an empty buffer (see \ref init())
+    SplatBuffer() { }
+
+    /// Allocate and clear storage for an image of the given size
+    void init(const Vector2i &size);
+
+    /// Return the size of the image
+    const Vector2i &getSize() const { return m_size; }
+
+    /// Clear all contents
+    void clear();
+
+    /// Add a value to the pixel containing the given position (thread-safe)
+    void splat(const Point2f &pos, const Color3f &value);
+
+    /// Return the sum of the values added to the given pixel
+    Color3f get(const Point2i &pixel) const {
+        const std::atomic<float> *v = &m_data[3 * ((size_t) pixel.y() * m_size.x() + pixel.x())];
+        return Color3f(v[0].load(std::memory_order_relaxed),
+                       v[1].load(std::memory_order_relaxed),
+                       v[2].load(std::memory_order_relaxed));
+    }
+
+protected:
+    Vector2i m_size = Vector2i(0, 0);
+    std::unique_ptr<std::atomic<float>[]> m_data;  // RGB per pixel
 };
 
 /**
@@ -133,6 +241,9 @@ protected:
  * rectangular blocks suitable for parallel rendering. The blocks
  * are ordered in spiraling pattern so that the center is
  * rendered first.
+ *
+ * The spiral order is computed once in the constructor; handing
+ * out blocks only increments an atomic counter.
  */
 class BlockGenerator {
 public:
@@ -157,24 +268,22 @@ public:
     /**
      * \brief Reset to the first block
      *
-     * This function is thread-safe
+     * This must not be called while other threads request blocks
      */
-    void reset();
+    void reset() { m_next = 0; }
 
-    /// Return the total number of blocks
-    int getBlockCount() const { return m_blocksLeft; }
+    /// Return the number of blocks that are left
+    int getBlockCount() const {
+        return (int) m_order.size() - std::min(m_next.load(), (int) m_order.size());
+    }
 protected:
     enum EDirection { ERight = 0, EDown, ELeft, EUp };
 
-    Point2i m_block;
     Vector2i m_numBlocks;
     Vector2i m_size;
     int m_blockSize;
-    int m_numSteps;
-    int m_blocksLeft;
-    int m_stepsLeft;
-    int m_direction;
-    tbb::mutex m_mutex;
+    std::vector<Point2i> m_order; ///< Block coordinates in spiral order
+    std::atomic<int> m_next;      ///< Index of the next block in m_order
 };
 
 NORI_NAMESPACE_END
@@ -19,7 +19,9 @@
 #if !defined(__NORI_BVH_H)
 #define __NORI_BVH_H
 
-#include <nori/shape.h>
+#include <nori/packet.h>
+#include <nori/cache.h>
+#include <memory>
 
 NORI_NAMESPACE_BEGIN
 
@@ -38,11 +40,40 @@ NORI_NAMESPACE_BEGIN
  * "Fast and Parallel Construction of SAH-based Bounding Volume Hierarchies"
  * by Ingo Wald (Proc. IEEE/EG Symposium on Interactive Ray Tracing, 2007)
  *
+ * Alternatively, the much faster but less thorough HLBVH builder can be
+ * used (see \ref setBuilder()), which is useful for very large meshes.
+ * The SBVH builder additionally splits primitives that straddle a split
+ * plane, which gives tighter trees for long or diagonal triangles at the
+ * cost of duplicated leaf references (see \ref setSplitBudget()).
+ *
+ * Optionally, the binary tree can afterwards be collapsed into a 4- or
+ * 8-wide BVH (see \ref setWidth()), whose nodes store the bounds of all
+ * children in SoA form so that they can be tested against a ray at once.
+ * Their bounds can be quantized to 8 bits per plane (see \ref
+ * setCompressed()), which halves the size of the wide nodes.
+ *
+ * The leaves don't reference shapes directly: after the build, the
+ * primitives of each leaf are copied into blocks of 4 (or 8 for the 8-wide
+ * BVH) triangles in SoA form, which are intersected in a single batch.
+ * The owning shape is only looked up for the closest hit.
+ *
  * \author Wenzel Jakob
  */
 class BVH {
     friend class BVHBuildTask;
+    friend class HLBVHBuilder;
+    friend class SBVHBuilder;
 public:
+    /// Available tree builders
+    enum EBuilder {
+        /// Binned SAH build (Wald 2007), see \ref BVHBuildTask
+        ESAH = 0,
+        /// Morton code based hierarchical LBVH build, see \ref HLBVHBuilder
+        EHLBVH,
+        /// SAH build with spatial splits (Stich et al. 2009), see \ref SBVHBuilder
+        ESBVH
+    };
+
     /// Create a new and empty BVH
     BVH() { m_shapeOffset.push_back(0u); }
 
@@ -59,9 +90,84 @@ public:
      */
     void addShape(Shape *shape);
 
-    /// Build the BVH
+    /**
+     * \brief Set the branching factor of the BVH (2, 4 or 8)
+     *
+     * This function can only be used before \ref build() is called
+     */
+    void setWidth(int width);
+
+    /// Return the branching factor of the BVH
+    int getWidth() const { return m_width; }
+
+    /**
+     * \brief Store the wide nodes with quantized child bounds (see
+     * \ref BVHCompressedNode, requires a width of 4 or 8)
+     *
+     * This function can only be used before \ref build() is called
+     */
+    void setCompressed(bool compressed) { m_compressed = compressed; }
+
+    /// Are the wide nodes stored with quantized child bounds?
+    bool isCompressed() const { return m_compressed; }
+
+    /**
+     * \brief Select the tree builder (\c "sah", \c "hlbvh" or \c "sbvh")
+     *
+     * This function can only be used before \ref build() is called
+     */
+    void setBuilder(const std::string &builder);
+
+    /// Return the selected tree builder
+    EBuilder getBuilder() const { return m_builder; }
+
+    /**
+     * \brief Set the memory budget of the SBVH builder: the maximum number
+     * of duplicated references as a fraction of the primitive count
+     */
+    void setSplitBudget(float budget);
+
+    /**
+     * \brief Additionally run the other builder in \ref build() and
+     * report its build time and SAH cost (for comparisons)
+     */
+    void setCompareBuilders(bool compare) { m_compareBuilders = compare; }
+
+    /**
+     * \brief Let \ref occluded() first test the triangle block that blocked
+     * the previous shadow ray of the same thread (default: enabled)
+     */
+    void setOccluderCache(bool enabled) { m_occluderCache = enabled; }
+
+    /**
+     * \brief Build the BVH
+     *
+     * Can be called again to rebuild the tree after shapes have moved
+     * (e.g. instances, see \ref Instance::setTransform())
+     */
     void build();
 
+    /**
+     * \brief Update the tree after the shapes were modified (e.g. deformed
+     * meshes or moved instances) without changing its topology
+     *
+     * Recomputes the triangle blocks and the bounds of all nodes bottom-up
+     * and in parallel, which is much cheaper than \ref build(). The tree was
+     * optimized for the old geometry though, so its quality degrades as the
+     * shapes move. Once its SAH cost exceeds the cost after the last build
+     * by more than the rebuild threshold, or if the number of primitives of
+     * a shape has changed, the tree is rebuilt instead.
+     *
+     * \return \c true if the tree was rebuilt
+     */
+    bool refit();
+
+    /**
+     * \brief Set the factor by which the SAH cost may grow in \ref refit()
+     * before the tree is rebuilt (default: 1.5)
+     */
+    void setRebuildThreshold(float threshold);
+
     /**
      * \brief Intersect a ray against all shapes registered
      * with the BVH
@@ -73,13 +179,83 @@ public:
      * information is really needed. When set to \c true, the 
      * function just checks whether or not there is occlusion, but without
      * providing any more detail (i.e. \c its will not be filled with
-     * contents). This is usually much faster.
+     * contents). This is the same as calling \ref occluded().
      *
      * \return \c true If an intersection was found
      */
     bool rayIntersect(const Ray3f &ray, Intersection &its, 
         bool shadowRay = false) const;
 
+    /**
+     * \brief Shadow ray query: determine whether there is any intersection
+     * within the segment of the ray
+     *
+     * The traversal stops at the first intersection and doesn't order the
+     * children by distance. Shadow rays that are traced one after another
+     * (e.g. from the pixels of a block towards the same light) tend to be
+     * blocked by the same geometry, hence the triangle block that occluded
+     * the previous shadow ray of the calling thread is tested first.
+     *
+     * \return \c true If an intersection was found
+     */
+    bool occluded(const Ray3f &ray) const;
+
+    /**
+     * \brief Shadow ray query against the BVH of a \ref ShapeGroup (used by
+     * \ref Instance)
+     *
+     * Same as \ref occluded(), but counted as an instance ray in the
+     * traversal statistics.
+     */
+    bool occludedInstance(const Ray3f &ray) const;
+
+    /**
+     * \brief Find the closest intersection without filling in an
+     * intersection record (used by \ref Instance)
+     *
+     * \c f receives the primitive that was hit, and \c u and \c v its
+     * barycentric coordinates. Pass them to \ref setHitInformation() to
+     * fill in the intersection record later on.
+     *
+     * \return \c true If an intersection was found
+     */
+    bool rayIntersect(const Ray3f &ray, float &t, uint32_t &f, float &u, float &v) const;
+
+    /**
+     * \brief Fill in the intersection record of a hit found by
+     * \ref rayIntersect(const Ray3f &, float &, uint32_t &, float &, float &)
+     *
+     * \c ray.maxt must be the distance to the hit. Throws a
+     * \ref NoriException if \c f isn't a primitive of the BVH.
+     */
+    void setHitInformation(uint32_t f, float u, float v, const Ray3f &ray, Intersection &its) const;
+
+    /**
+     * \brief Compute the key of the tree in the persistent cache
+     *
+     * Hashes the build parameters, the layout of the node types and the
+     * geometry of all primitives (i.e. after the transformation of the
+     * shapes), so that editing the scene invalidates the cached tree.
+     */
+    uint64_t computeCacheKey() const;
+
+    /**
+     * \brief Intersect a packet of rays against all shapes registered
+     * with the BVH
+     *
+     * Produces the same results as calling \ref rayIntersect() for every
+     * ray of the packet, but traverses the tree only once for all rays.
+     * The bits of \c hits.hitMask are set for the rays that hit something.
+     */
+    void rayIntersect(const RayPacket &packet, HitPacket &hits) const;
+
+    /**
+     * \brief Shadow ray version of the packet intersection query
+     *
+     * \return A bit mask of the rays for which an intersection was found
+     */
+    RayPacket::Mask occluded(const RayPacket &packet) const;
+
     /// Return the total number of shapes registered with the BVH
     uint32_t getShapeCount() const { return (uint32_t) m_shapes.size(); }
 
@@ -108,22 +284,54 @@ protected:
         return (uint32_t) (it - m_shapeOffset.begin());
     }
 
-    //// Return an axis-aligned bounding box containing the given primitive
-    BoundingBox3f getBoundingBox(uint32_t index) const {
-        uint32_t shapeIdx = findShape(index);
-        return m_shapes[shapeIdx]->getBoundingBox(index);
-    }
-    
-    //// Return the centroid of the given primitive
-    Point3f getCentroid(uint32_t index) const {
-        uint32_t shapeIdx = findShape(index);
-        return m_shapes[shapeIdx]->getCentroid(index);
-    }
+    /**
+     * \brief Centroids and bounds of all primitives in SoA form
+     *
+     * Gathered once at the beginning of \ref build(), so that the builders
+     * don't have to look up the shape of a primitive and read its vertices
+     * over and over again. Released once the tree has been built.
+     */
+    struct BVHPrimitiveData {
+        std::vector<float> centroid[3]; ///< Centroid coordinates per axis
+        std::vector<float> min[3];      ///< Lower bounds per axis
+        std::vector<float> max[3];      ///< Upper bounds per axis
+        BoundingBox3f centroidBbox;     ///< Bounding box of all centroids
+
+        Point3f getCentroid(uint32_t f) const {
+            return Point3f(centroid[0][f], centroid[1][f], centroid[2][f]);
+        }
+
+        BoundingBox3f getBoundingBox(uint32_t f) const {
+            return BoundingBox3f(Point3f(min[0][f], min[1][f], min[2][f]),
+                                 Point3f(max[0][f], max[1][f], max[2][f]));
+        }
+
+        size_t getMemoryUsage() const {
+            return sizeof(float) * 9 * centroid[0].size();
+        }
+    };
+
+    /// Fill \ref m_primitives (in parallel)
+    void computePrimitiveData();
+
+    /// Build the binary tree with \ref BVHBuildTask
+    void buildSAH();
+
+    /// Build the binary tree with \ref HLBVHBuilder
+    void buildHLBVH();
+
+    /// Build the binary tree with \ref SBVHBuilder
+    void buildSBVH();
 
     /// Compute internal tree statistics
     std::pair<float, uint32_t> statistics(uint32_t index = 0) const;
 
-    /* BVH node in 32 bytes */
+    /// Compute the SAH cost of a wide subtree (recursively, leaf costs in blocks)
+    template <int Width, typename Node> static float wideCost(const Node *nodes, uint32_t node_idx);
+
+    /* BVH node in 32 bytes. During the build, leaves reference a range of
+       m_indices; afterwards they reference a range of triangle blocks.
+       Value-initialized nodes (BVHNode()) have all flags and indices zeroed */
     struct BVHNode {
         union {
             struct {
@@ -150,10 +358,6 @@ protected:
             return leaf.flag == 0;
         }
 
-        bool isUnused() const {
-            return data == 0;
-        }
-
         uint32_t start() const {
             return leaf.start;
         }
@@ -162,12 +366,239 @@ protected:
             return leaf.start + leaf.size;
         }
     };
+
+    /**
+     * \brief Wide BVH node with \c Width children
+     *
+     * The child bounds are stored as six SoA arrays (min x/y/z followed by
+     * max x/y/z). A child with <tt>count > 0</tt> is a leaf referencing
+     * the triangle blocks <tt>[child .. child+count)</tt>, otherwise \c child is the
+     * index of another wide node. Unused slots have an empty bounding box
+     * and can never be hit.
+     */
+    template <int Width> struct BVHWideNode {
+        float bounds[6][Width];
+        uint32_t child[Width];
+        uint32_t count[Width];
+
+        /// Return one of the six bounding planes of all children
+        Eigen::Array<float, Width, 1> getPlane(int plane) const {
+            return Eigen::Map<const Eigen::Array<float, Width, 1> >(bounds[plane]);
+        }
+    };
+
+    /**
+     * \brief Wide BVH node with quantized child bounds
+     *
+     * Same as \ref BVHWideNode, but each bounding plane of a child is
+     * stored as an 8-bit offset on a grid that spans the node: the plane
+     * is at <tt>origin + q * 2^exponent</tt> along its axis. This sum is
+     * rounded when the origin is large compared to the node, so \ref quantize()
+     * evaluates the same float expression to move lower bounds down and
+     * upper bounds up until the children are contained, and they are never
+     * missed. Unused slots have <tt>child == count == 0</tt>.
+     *
+     * A 4-wide node takes 64 bytes (one cache line) instead of 128.
+     */
+    template <int Width> struct BVHCompressedNode {
+        float origin[3];
+        int8_t exponent[3];
+        uint8_t bounds[6][Width];
+        uint32_t child[Width];
+        uint16_t count[Width];
+
+        /**
+         * \brief Return one of the six bounding planes of all children
+         *
+         * Must compute exactly <tt>origin + q * scale</tt> (no FMA or
+         * reassociation) like \ref quantize(), otherwise the planes may
+         * round differently and the boxes may not contain the children.
+         */
+        Eigen::Array<float, Width, 1> getPlane(int plane) const {
+            int axis = plane % 3;
+            /* Assemble 2^exponent from its bits (the exponent is always in the normal range) */
+            uint32_t bits = (uint32_t) (exponent[axis] + 127) << 23;
+            float scale;
+            memcpy(&scale, &bits, sizeof(float));
+            return Eigen::Map<const Eigen::Array<uint8_t, Width, 1> >(bounds[plane])
+                .template cast<float>() * scale + origin[axis];
+        }
+    };
+
+    /**
+     * \brief Block of \c Width triangles in SoA form
+     *
+     * Stores the first vertex and the two edges sharing it as required by
+     * the Moeller-Trumbore test. The type of the other primitives is
+     * tagged by a bit mask: lanes in \c sphereMask hold a sphere (center
+     * in \c p0, radius in \c e1[0]), which is intersected inline as well,
+     * and lanes in \c otherMask hold any other shape (e.g. an instance),
+     * which is intersected using \ref Shape::rayIntersect(). These lanes
+     * as well as unused ones have zero edges \c e2, so the triangle test
+     * never reports a hit for them.
+     */
+    template <int Width> struct BVHTriangleBlock {
+        float p0[3][Width];   ///< First vertex
+        float e1[3][Width];   ///< Edge p1 - p0
+        float e2[3][Width];   ///< Edge p2 - p0
+        uint32_t prim[Width]; ///< Primitive index (as used by \ref findShape())
+        uint32_t sphereMask;  ///< Bit mask of lanes that hold a sphere
+        uint32_t otherMask;   ///< Bit mask of lanes that hold another shape
+    };
+
+    /// Store a primitive in a lane of a triangle block (returns its bounds)
+    template <int Width> BoundingBox3f packPrimitive(BVHTriangleBlock<Width> &block,
+        int lane, uint32_t idx) const;
+
+    /// Collapse the binary tree into wide nodes (recursively, returns the new node index)
+    template <int Width> uint32_t collapse(uint32_t node_idx);
+
+    /// Return the array of collapsed nodes of the given width
+    template <int Width> std::vector<BVHWideNode<Width> > &getWideNodes();
+    template <int Width> const std::vector<BVHWideNode<Width> > &getWideNodes() const;
+
+    /// Quantize the collapsed nodes into \ref BVHCompressedNode instances and release them
+    template <int Width> void compress();
+
+    /// Return the array of compressed nodes of the given width
+    template <int Width> std::vector<BVHCompressedNode<Width> > &getCompressedNodes();
+
+    /// Copy the primitives of all leaves into triangle blocks and make the leaves reference them
+    template <int Width> void packTriangles();
+
+    /// Return the array of triangle blocks of the given width
+    template <int Width> std::vector<BVHTriangleBlock<Width> > &getTriangleBlocks();
+    template <int Width> const std::vector<BVHTriangleBlock<Width> > &getTriangleBlocks() const;
+
+    /// Return the wide nodes (of type \ref BVHWideNode or \ref BVHCompressedNode) used by the traversal
+    template <typename Node> const Node *getWideNodeData() const {
+        return static_cast<const Node *>(m_wideNodeData);
+    }
+
+    /// Return the number and size of the wide nodes used by the traversal
+    std::pair<size_t, size_t> getWideNodeStorage() const;
+
+    /// Return the triangle blocks of the given width as used by the traversal
+    template <int Width> const BVHTriangleBlock<Width> *getTriangleBlockData() const {
+        return static_cast<const BVHTriangleBlock<Width> *>(m_blockData);
+    }
+
+    /// Point the traversal to the arrays that were just built
+    void updateTraversalData();
+
+    /// Map a cached tree and point the traversal to it (returns \c false if it isn't cached)
+    bool loadFromCache(uint64_t key);
+
+    /// Write the tree that was just built to the cache
+    void storeToCache(uint64_t key) const;
+
+    /// Copy a tree that was loaded from the cache into the arrays above, so that it can be modified
+    void detachFromCache();
+
+    /// Quantize the child bounds of a wide node
+    template <int Width> static void quantize(const BVHWideNode<Width> &node,
+        BVHCompressedNode<Width> &result);
+
+    /// Store the refitted bounds of a wide node
+    template <int Width> static void storeNode(BVHWideNode<Width> &node, const BVHWideNode<Width> &bounds) {
+        node = bounds;
+    }
+
+    /// Store the refitted bounds of a compressed wide node
+    template <int Width> static void storeNode(BVHCompressedNode<Width> &node, const BVHWideNode<Width> &bounds) {
+        quantize<Width>(bounds, node);
+    }
+
+    /// Recompute the triangles of a block from the shapes and return their bounds
+    template <int Width> BoundingBox3f refitBlock(BVHTriangleBlock<Width> &block) const;
+
+    /// Refit the binary subtree stored in <tt>[node_idx, end)</tt> (recursively, returns its SAH cost)
+    float refitBinary(uint32_t node_idx, uint32_t end, const std::vector<BoundingBox3f> &blockBounds);
+
+    /// Refit a wide node (recursively, returns its bounds)
+    template <int Width, typename Node> BoundingBox3f refitWide(Node *nodes,
+        uint32_t node_idx, int depth, const std::vector<BoundingBox3f> &blockBounds);
+
+    /**
+     * \brief Intersect a ray against the triangle blocks of a leaf
+     *
+     * For shadow rays, \c f receives the index of the occluding block
+     * instead of the primitive. \c inner receives the primitive hit inside
+     * of an \ref Instance (see \ref Shape::rayIntersect()).
+     */
+    template <int Width> bool intersectLeaf(uint32_t start, uint32_t count, Ray3f &ray,
+        uint32_t &f, float &u, float &v, uint32_t &inner, bool shadowRay) const;
+
+    /**
+     * \brief Shadow ray query shared by \ref occluded() and
+     * \ref occludedInstance()
+     *
+     * \c cacheHit is set when the cached occluder of the thread blocked the ray.
+     */
+    bool anyHit(const Ray3f &ray, bool &cacheHit) const;
+
+    /// Closest-hit or shadow ray traversal of the tree (updates \c ray.maxt)
+    bool traverse(Ray3f &ray, uint32_t &f, float &u, float &v, uint32_t &inner, bool shadowRay) const;
+
+    /// Closest-hit or shadow ray traversal of the binary tree
+    bool traverseBinary(Ray3f &ray, uint32_t &f, float &u, float &v, uint32_t &inner, bool shadowRay) const;
+
+    /**
+     * \brief Closest-hit or shadow ray traversal of the binary tree for a packet
+     *
+     * Compressed trees are traversed with \ref traversePacketWide() instead.
+     *
+     * Writes the primitive index, barycentric coordinates and inner
+     * primitive of the rays that hit something to \c f, \c u, \c v,
+     * \c inner and updates their \c maxt
+     * value. Returns the mask of these rays.
+     */
+    RayPacket::Mask traversePacket(RayPacket &packet, uint32_t *f,
+        float *u, float *v, uint32_t *inner, bool shadowRay) const;
+
+    /// Closest-hit or shadow ray traversal of the collapsed wide tree
+    template <int Width, typename Node> bool traverseWide(Ray3f &ray, uint32_t &f,
+        float &u, float &v, uint32_t &inner, bool shadowRay) const;
+
+    /**
+     * \brief Packet traversal of the collapsed wide tree for the rays in \c active
+     *
+     * Used for compressed trees, which don't keep the binary nodes.
+     * Same interface as \ref traversePacket().
+     */
+    template <int Width, typename Node> RayPacket::Mask traversePacketWide(RayPacket &packet,
+        RayPacket::Mask active, uint32_t *f, float *u, float *v, uint32_t *inner, bool shadowRay) const;
+
 private:
     std::vector<Shape *> m_shapes;       ///< List of meshes registered with the BVH
     std::vector<uint32_t> m_shapeOffset; ///< Index of the first triangle for each shape
-    std::vector<BVHNode> m_nodes;       ///< BVH nodes
-    std::vector<uint32_t> m_indices;    ///< Index references by BVH nodes
+    std::vector<BVHNode> m_nodes;       ///< Binary BVH nodes (released after compressing the wide tree)
+    std::vector<BVHWideNode<4> > m_nodes4; ///< Collapsed 4-wide nodes (if m_width == 4)
+    std::vector<BVHWideNode<8> > m_nodes8; ///< Collapsed 8-wide nodes (if m_width == 8)
+    std::vector<BVHCompressedNode<4> > m_compressed4; ///< Quantized 4-wide nodes (if m_compressed)
+    std::vector<BVHCompressedNode<8> > m_compressed8; ///< Quantized 8-wide nodes (if m_compressed)
+    std::vector<BVHTriangleBlock<4> > m_blocks4; ///< Leaf primitives (if m_width < 8)
+    std::vector<BVHTriangleBlock<8> > m_blocks8; ///< Leaf primitives (if m_width == 8)
+    int m_width = 2;                    ///< Branching factor of the traversed tree
+    EBuilder m_builder = ESAH;          ///< Tree builder
+    bool m_compareBuilders = false;     ///< Also run the other builder for comparison?
+    bool m_compressed = false;          ///< Quantize the bounds of the wide nodes?
+    bool m_occluderCache = true;        ///< Test the last occluder of each thread first in occluded()?
+    float m_rebuildThreshold = 1.5f;    ///< Relative SAH cost increase that triggers a rebuild in refit()
+    float m_sahCost = 0;                ///< SAH cost after the last build
+    float m_splitBudget = 0.3f;         ///< Duplicated references allowed by the SBVH builder
+    std::vector<uint32_t> m_indices;    ///< Index references by BVH nodes (only during the build)
+    std::unique_ptr<BVHPrimitiveData> m_primitives; ///< Primitive centroids and bounds (only during the build)
     BoundingBox3f m_bbox;               ///< Bounding box of the entire BVH
+
+    /* Arrays used by the traversal. They point into the arrays above or,
+       if the tree was loaded from the cache, into the memory-mapped file.
+       m_nodeData is null for compressed trees */
+    const BVHNode *m_nodeData = nullptr;
+    const void *m_wideNodeData = nullptr;
+    const void *m_blockData = nullptr;
+    uint32_t m_blockCount = 0;
+    std::unique_ptr<Cache::Entry> m_cacheEntry; ///< Mapped cache entry (if any)
 };
 
 NORI_NAMESPACE_END
@@ -0,0 +1,154 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__NORI_CACHE_H)
+#define __NORI_CACHE_H
+
+#include <nori/common.h>
+#include <memory>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief 64-bit hash of a stream of data
+ *
+ * Processes the data in 8-byte words. Every word and the state are mixed
+ * with the finalizer of SplitMix64, so that a change of any bit affects
+ * all bits of the state and changes of different words don't cancel out.
+ * It isn't cryptographic, but it is fast enough to hash large meshes.
+ */
+class Hasher {
+public:
+    /// Add a block of memory to the hash
+    Hasher &add(const void *data, size_t size);
+
+    /// Add a string (including its length) to the hash
+    Hasher &add(const std::string &str) {
+        add((uint64_t) str.size());
+        return add(str.data(), str.size());
+    }
+
+    /// Add a plain value to the hash
+    template <typename T> Hasher &add(const T &value) {
+        return add(&value, sizeof(T));
+    }
+
+    /// Return the hash of the data added so far
+    uint64_t get() const;
+
+private:
+    uint64_t m_state = 0xcbf29ce484222325ull;
+};
+
+/// Read-only memory mapping of an entire file
+class MappedFile {
+public:
+    /// Map the given file (throws an exception on failure)
+    MappedFile(const std::string &filename);
+
+    /// Unmap the file
+    ~MappedFile();
+
+    /// Return a pointer to the contents of the file
+    const uint8_t *getData() const { return m_data; }
+
+    /// Return the size of the file in bytes
+    size_t getSize() const { return m_size; }
+
+private:
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    const uint8_t *m_data = nullptr;
+    size_t m_size = 0;
+#if defined(_WIN32)
+    void *m_file = nullptr, *m_mapping = nullptr;
+#endif
+};
+
+/**
+ * \brief Persistent on-disk cache for parsed meshes and BVHs
+ *
+ * Each entry is a file in the cache directory that is named after its
+ * kind (e.g. \c "mesh") and a 64-bit key, which must hash everything the
+ * data depends on. An entry consists of several sections (arrays), which
+ * are aligned to 64 bytes so that they can be used directly from the
+ * memory-mapped file.
+ *
+ * The cache is disabled unless a directory is set with \ref setDirectory()
+ * or the \c NORI_CACHE_DIR environment variable. Entries are written to a
+ * temporary file and then renamed, so several processes (e.g. the nodes
+ * of a render farm) can safely share a directory.
+ */
+class Cache {
+public:
+    /// Version of the file format, part of every key
+    static const uint32_t Version = 4;
+
+    /// Section of an entry that is about to be stored
+    struct Section {
+        const void *data;
+        size_t size;
+    };
+
+    /// Open cache entry
+    class Entry {
+    public:
+        Entry(std::unique_ptr<MappedFile> file, uint32_t sectionCount);
+
+        /// Return the number of sections
+        uint32_t getSectionCount() const { return m_sectionCount; }
+
+        /// Return a pointer to the contents of a section
+        const void *getSection(uint32_t index) const;
+
+        /// Return the size of a section in bytes
+        size_t getSectionSize(uint32_t index) const;
+
+        /// Return the size of the entire entry in bytes
+        size_t getSize() const { return m_file->getSize(); }
+
+    private:
+        std::unique_ptr<MappedFile> m_file;
+        uint32_t m_sectionCount;
+    };
+
+    /// Set the cache directory (an empty string disables the cache)
+    static void setDirectory(const std::string &directory);
+
+    /// Is the cache enabled?
+    static bool isEnabled();
+
+    /**
+     * \brief Look up an entry
+     *
+     * \return The memory-mapped entry, or \c nullptr if the cache is disabled,
+     * the entry doesn't exist or it is invalid
+     */
+    static std::unique_ptr<Entry> load(const std::string &kind, uint64_t key);
+
+    /// Store an entry (failures are reported on the console, but not fatal)
+    static void store(const std::string &kind, uint64_t key, const std::vector<Section> &sections);
+
+private:
+    static std::string getFilename(const std::string &kind, uint64_t key);
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __NORI_CACHE_H */
@@ -58,6 +58,51 @@ public:
         const Point2f &samplePosition,
         const Point2f &apertureSample) const = 0;
 
+    /**
+     * \brief Sample a point on the aperture from which the point \c ref is
+     * seen (used to connect light paths to the camera)
+     *
+     * \param ref
+     *    A point in the scene
+     *
+     * \param apertureSample
+     *    A uniformly distributed 2D vector that is used to sample
+     *    a position on the aperture of the sensor if necessary.
+     *
+     * \param p
+     *    Set to the sampled point on the aperture
+     *
+     * \param samplePosition
+     *    Set to the position on the film at which \c ref appears,
+     *    expressed in fractional pixel coordinates
+     *
+     * \param pdf
+     *    Set to the density of \c p with respect to solid angles at \c ref
+     *
+     * \return
+     *    The importance emitted from \c p towards \c ref, normalized over
+     *    the entire film (zero if \c ref is not visible)
+     */
+    virtual Color3f sampleImportance(const Point3f &ref, const Point2f &apertureSample,
+        Point3f &p, Point2f &samplePosition, float &pdf) const {
+        throw NoriException("Camera::sampleImportance(): not implemented!");
+    }
+
+    /**
+     * \brief Return the densities with which \ref sampleRay() generates
+     * \c ray when the film position is chosen uniformly
+     *
+     * \param pdfPos
+     *    Set to the density of the origin per unit area of the aperture
+     *    (1 for pinhole cameras)
+     *
+     * \param pdfDir
+     *    Set to the density of the direction per solid angle
+     */
+    virtual void pdfRay(const Ray3f &ray, float &pdfPos, float &pdfDir) const {
+        throw NoriException("Camera::pdfRay(): not implemented!");
+    }
+
     /// Return the size of the output image in pixels
     const Vector2i &getOutputSize() const { return m_outputSize; }
 
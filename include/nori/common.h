@@ -125,9 +125,13 @@ class Camera;
 class ImageBlock;
 class Integrator;
 class KDTree;
+struct LightBounds;
+class LightSampler;
 class Emitter;
 struct EmitterQueryRecord;
+struct Intersection;
 class Shape;
+class SplatBuffer;
 class NoriObject;
 class NoriObjectFactory;
 class NoriScreen;
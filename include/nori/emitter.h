@@ -102,11 +102,45 @@ public:
     virtual float pdf(const EmitterQueryRecord &lRec) const = 0;
 
 
-    /// Sample a photon
-    virtual Color3f samplePhoton(Ray3f &ray, const Point2f &sample1, const Point2f &sample2) const {
+    /**
+     * \brief Bound the position, orientation and power of the emitted light
+     * (used to choose among many emitters, see \ref LightSampler)
+     *
+     * \return \c false for emitters without spatial bounds (e.g. environment maps)
+     */
+    virtual bool getLightBounds(LightBounds &bounds) const { return false; }
+
+    /**
+     * \brief Sample a photon
+     *
+     * \param ray      Set to the ray along which the photon leaves the emitter
+     * \param sample1  A uniformly distributed sample used for the position
+     * \param sample2  A uniformly distributed sample used for the direction
+     * \param n        If given, set to the surface normal at the origin
+     *                 of the photon (zero for emitters at a single point)
+     *
+     * \return The power carried by the photon, i.e. the emitted radiance
+     *         times the cosine at the emitter divided by the densities of
+     *         the position and the direction (see \ref pdfPhoton())
+     */
+    virtual Color3f samplePhoton(Ray3f &ray, const Point2f &sample1, const Point2f &sample2,
+                                 Normal3f *n = nullptr) const {
         throw NoriException("Emitter::samplePhoton(): not implemented!");
     }
 
+    /**
+     * \brief Return the densities with which \ref samplePhoton() generates a
+     * photon leaving the point \c p (surface normal \c n) in direction \c d
+     *
+     * \param pdfPos  Set to the density of the position per unit area
+     *                (1 for emitters at a single point)
+     * \param pdfDir  Set to the density of the direction per solid angle
+     */
+    virtual void pdfPhoton(const Point3f &p, const Normal3f &n, const Vector3f &d,
+                           float &pdfPos, float &pdfDir) const {
+        throw NoriException("Emitter::pdfPhoton(): not implemented!");
+    }
+
 
     /**
      * \brief Virtual destructor
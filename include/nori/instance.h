@@ -0,0 +1,156 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__NORI_INSTANCE_H)
+#define __NORI_INSTANCE_H
+
+#include <nori/bvh.h>
+#include <nori/transform.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Geometry that is shared by several instances
+ *
+ * The shapes of a group are stored once, in object space, together with
+ * their own (bottom-level) BVH. A group is not rendered by itself: every
+ * \ref Instance that references it places a transformed copy of it in the
+ * scene, so that memory scales with the amount of unique geometry.
+ *
+ * In the scene description, a group is declared with an \c id and
+ * referenced from the instances:
+ * \code
+ * <shapegroup id="tree">
+ *     <mesh type="obj"> ... </mesh>
+ * </shapegroup>
+ * <instance>
+ *     <ref id="tree"/>
+ *     <transform name="toWorld"> ... </transform>
+ * </instance>
+ * \endcode
+ */
+class ShapeGroup : public NoriObject {
+public:
+    ShapeGroup(const PropertyList &props);
+
+    /// Release the shapes of the group
+    virtual ~ShapeGroup();
+
+    /// Register a shape of the group
+    virtual void addChild(NoriObject *obj) override;
+
+    /// Build the bottom-level BVH
+    virtual void activate() override;
+
+    /**
+     * \brief Refit the BVH after shapes of the group were deformed (see
+     * \ref BVH::refit())
+     *
+     * Call \ref Scene::updateGeometry() afterwards to update the instances.
+     */
+    void refit() { m_bvh->refit(); }
+
+    /// Return the BVH over the shapes of the group (in object space)
+    const BVH *getBVH() const { return m_bvh; }
+
+    /// Return the shapes of the group
+    const std::vector<Shape *> &getShapes() const { return m_shapes; }
+
+    /// Return the bounding box of the group in object space
+    const BoundingBox3f &getBoundingBox() const { return m_bvh->getBoundingBox(); }
+
+    virtual std::string toString() const override;
+
+    virtual EClassType getClassType() const override { return EShapeGroup; }
+
+private:
+    BVH *m_bvh;
+    std::vector<Shape *> m_shapes;
+};
+
+/**
+ * \brief Transformed copy of a \ref ShapeGroup
+ *
+ * An instance is a single primitive of the scene's (top-level) BVH. Rays
+ * that reach it are transformed into object space and traced against the
+ * shared BVH of the group. Since the transformation is affine and the ray
+ * direction isn't normalized, distances along the ray are the same in both
+ * spaces.
+ *
+ * Moving an instance with \ref setTransform() only requires updating the
+ * top-level BVH (see \ref Scene::updateGeometry()).
+ */
+class Instance : public Shape {
+public:
+    Instance(const PropertyList &props);
+
+    /// Set the shape group (instances don't accept BSDFs or emitters)
+    virtual void addChild(NoriObject *obj) override;
+
+    virtual void activate() override;
+
+    /// Move the instance (the top-level BVH must be rebuilt afterwards)
+    void setTransform(const Transform &toWorld);
+
+    /// Return the object-to-world transformation
+    const Transform &getTransform() const { return m_toWorld; }
+
+    /// Return the referenced shape group
+    const ShapeGroup *getShapeGroup() const { return m_group; }
+
+    virtual BoundingBox3f getBoundingBox(uint32_t index) const override { return m_bbox; }
+
+    virtual Point3f getCentroid(uint32_t index) const override { return m_bbox.getCenter(); }
+
+    /**
+     * \brief Trace the ray against the BVH of the group
+     *
+     * \c inner, \c u and \c v receive the primitive of the group that was
+     * hit and its barycentric coordinates.
+     */
+    virtual bool rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t, uint32_t &inner) const override;
+
+    /// Any-hit query against the BVH of the group (see \ref BVH::occluded())
+    virtual bool rayOccluded(uint32_t index, const Ray3f &ray) const override;
+
+    /**
+     * \brief Fill in the intersection record from the primitive of the
+     * group found by \ref rayIntersect()
+     *
+     * \c its.mesh is set to the shape of the group that was hit.
+     */
+    virtual void setHitInformation(uint32_t index, uint32_t inner, const Ray3f &ray, Intersection &its) const override;
+
+    /// Instances can't be emitters, hence sampling them isn't supported
+    virtual void sampleSurface(ShapeQueryRecord &sRec, const Point2f &sample) const override;
+    virtual float pdfSurface(const ShapeQueryRecord &sRec) const override;
+
+    virtual std::string toString() const override;
+
+private:
+    /// Transform a shading frame of the group into world space
+    Frame transformFrame(const Frame &frame) const;
+
+    const ShapeGroup *m_group = nullptr;
+    Transform m_toWorld;
+    Transform m_worldToLocal;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __NORI_INSTANCE_H */
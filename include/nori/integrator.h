@@ -20,6 +20,7 @@
 #define __NORI_INTEGRATOR_H
 
 #include <nori/object.h>
+#include <nori/sampler.h>
 
 NORI_NAMESPACE_BEGIN
 
@@ -54,6 +55,74 @@ public:
      */
     virtual Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const = 0;
 
+    /**
+     * \brief Sample the incident radiance along a ray whose first
+     * intersection has already been computed
+     *
+     * This is used for camera rays, which are traced in packets (see
+     * \ref RayPacket). Only called if \ref usesPrimaryHits() returns
+     * \c true; the default implementation ignores the intersection.
+     *
+     * \param its
+     *    The first intersection along the ray, or \c nullptr if the
+     *    ray doesn't hit anything
+     */
+    virtual Color3f LiFromHit(const Scene *scene, Sampler *sampler, const Ray3f &ray,
+                              const Intersection *its) const {
+        return Li(scene, sampler, ray);
+    }
+
+    /// Can this integrator use camera ray intersections computed in packets?
+    virtual bool usesPrimaryHits() const { return false; }
+
+    /**
+     * \brief Sample the incident radiance along a batch of rays
+     *
+     * Wavefront integrators override this to advance all paths of an
+     * image block together, one stage at a time. Only called if
+     * \ref isWavefront() returns \c true; the default implementation
+     * calls \ref Li() for each ray.
+     *
+     * \param rays
+     *    The rays in question
+     * \param pixels
+     *    The pixel of each ray. It is used to resume the sample of that pixel
+     *    (see \ref Sampler::generate()); if empty, the sampler is not repositioned.
+     * \param result
+     *    Receives the radiance estimate for each ray
+     */
+    virtual void LiBatch(const Scene *scene, Sampler *sampler,
+                         const std::vector<Ray3f> &rays, const std::vector<Point2i> &pixels,
+                         std::vector<Color3f> &result) const {
+        result.resize(rays.size());
+        for (size_t i = 0; i < rays.size(); ++i) {
+            if (!pixels.empty())
+                sampler->generate(pixels[i], NORI_CAMERA_DIMENSIONS);
+            result[i] = Li(scene, sampler, rays[i]);
+        }
+    }
+
+    /// Should the renderer hand entire image blocks to \ref LiBatch()?
+    virtual bool isWavefront() const { return false; }
+
+    /**
+     * \brief Sample the incident radiance along a ray, and add the
+     * contributions of the sample to other pixels to \c splats
+     *
+     * This is used by integrators that connect light paths to the camera.
+     * Only called if \ref usesSplats() returns \c true; the renderer adds
+     * the splats to the image after rendering, divided by the average
+     * number of samples per pixel. The default implementation calls
+     * \ref Li().
+     */
+    virtual Color3f LiSplat(const Scene *scene, Sampler *sampler, const Ray3f &ray,
+                            SplatBuffer &splats) const {
+        return Li(scene, sampler, ray);
+    }
+
+    /// Should the renderer call \ref LiSplat() instead of \ref Li()?
+    virtual bool usesSplats() const { return false; }
+
     /**
      * \brief Return the type of object (i.e. Mesh/BSDF/etc.) 
      * provided by this instance
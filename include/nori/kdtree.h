@@ -20,6 +20,11 @@
 #define __NORI_KDTREE_H
 
 #include <nori/bbox.h>
+#include <nori/timer.h>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_reduce.h>
+#include <tbb/parallel_invoke.h>
+#include <tbb/blocked_range.h>
 
 NORI_NAMESPACE_BEGIN
 
@@ -228,11 +233,19 @@ public:
              << m_nodes.size() << " data points ("
              << memString(m_nodes.size() * sizeof(NodeType)).c_str() << ") .. ";
         cout.flush();
+        Timer timer;
 
         if (recomputeBoundingBox) {
-            m_bbox.reset();
-            for (size_t i=0; i<m_nodes.size(); ++i)
-                m_bbox.expandBy(m_nodes[i].getPosition());
+            m_bbox = tbb::parallel_reduce(
+                tbb::blocked_range<size_t>(0, m_nodes.size(), PARALLEL_GRAIN_SIZE),
+                BoundingBoxType(),
+                [&](const tbb::blocked_range<size_t> &range, BoundingBoxType bbox) {
+                    for (size_t i = range.begin(); i != range.end(); ++i)
+                        bbox.expandBy(m_nodes[i].getPosition());
+                    return bbox;
+                },
+                [](BoundingBoxType a, const BoundingBoxType &b) { a.expandBy(b); return a; }
+            );
         }
 
         /* Instead of shuffling around the node data itself, only modify
@@ -243,11 +256,16 @@ public:
         for (size_t i=0; i<m_nodes.size(); ++i)
             indirection[i] = (IndexType) i;
 
-        m_depth = 0;
-        build(1, indirection.begin(), indirection.begin(), indirection.end());
+        /* The top levels are partitioned in parallel through this buffer */
+        std::vector<IndexType> scratch;
+        if (m_nodes.size() >= PARALLEL_THRESHOLD)
+            scratch.resize(m_nodes.size());
+
+        m_depth = build(1, indirection.begin(), indirection.begin(), indirection.end(),
+                        m_bbox, scratch);
         permute_inplace(&m_nodes[0], indirection);
 
-        cout << "done." << endl;
+        cout << "done (took " << timer.elapsedString() << ")." << endl;
     }
 
     /**
@@ -439,47 +457,71 @@ protected:
         return m_nodes[index].getRightIndex(index) != 0;
     }
 
-    /// Tree construction routine
-    void build(size_t depth,
+    /// Subtrees with at least this many points are built in parallel
+    static const size_t PARALLEL_THRESHOLD = 1u << 16;
+
+    /// Number of points per task of the parallel loops
+    static const size_t PARALLEL_GRAIN_SIZE = 1u << 12;
+
+    /**
+     * \brief Tree construction routine
+     *
+     * Subtrees cover disjoint ranges of the indirection table, so the two
+     * children of large nodes are built concurrently. The work is split at
+     * fixed sizes, which makes the tree independent of the number of threads.
+     *
+     * \param bbox     Bounds of the cell of the node
+     * \param scratch  Temporary storage for the parallel partitioning (same
+     *                 indices as the indirection table)
+     * \return The depth of the subtree
+     */
+    size_t build(size_t depth,
               typename std::vector<IndexType>::iterator base,
               typename std::vector<IndexType>::iterator rangeStart,
-              typename std::vector<IndexType>::iterator rangeEnd) {
+              typename std::vector<IndexType>::iterator rangeEnd,
+              BoundingBoxType bbox, std::vector<IndexType> &scratch) {
         if (rangeEnd <= rangeStart)
             throw NoriException("Internal error!");
 
-        m_depth = std::max(depth, m_depth);
-
         IndexType count = (IndexType) (rangeEnd-rangeStart);
+        bool parallel = count >= PARALLEL_THRESHOLD;
 
         if (count == 1) {
             /* Create a leaf node */
             m_nodes[*rangeStart].setLeaf(true);
-            return;
+            return depth;
         }
 
         int axis = 0;
         typename std::vector<IndexType>::iterator split;
+        bool partitioned = false;
 
         switch (m_heuristic) {
             case Balanced: {
                     /* Build a balanced tree */
                     split = rangeStart + count/2;
-                    axis = m_bbox.getLargestAxis();
+                    axis = bbox.getLargestAxis();
                 };
                 break;
 
             case SlidingMidpoint: {
                     /* Sliding midpoint rule: find a split that is close to the spatial median */
-                    axis = m_bbox.getLargestAxis();
+                    axis = bbox.getLargestAxis();
 
                     Scalar midpoint = (Scalar) 0.5f
-                        * (m_bbox.max[axis]+m_bbox.min[axis]);
+                        * (bbox.max[axis]+bbox.min[axis]);
 
-                    size_t nLT = std::count_if(rangeStart, rangeEnd,
-                        [&](IndexType i) {
-                            return m_nodes[i].getPosition()[axis] <= midpoint;
-                        }
-                    );
+                    auto isLeft = [&](IndexType i) {
+                        return m_nodes[i].getPosition()[axis] <= midpoint;
+                    };
+
+                    size_t nLT;
+                    if (parallel) {
+                        nLT = partition(base, rangeStart, rangeEnd, isLeft, scratch);
+                        partitioned = nLT > 0 && nLT < count;
+                    } else {
+                        nLT = std::count_if(rangeStart, rangeEnd, isLeft);
+                    }
 
                     /* Re-adjust the split to pass through a nearby point */
                     split = rangeStart + nLT;
@@ -492,11 +534,31 @@ protected:
                 break;
         }
 
-        std::nth_element(rangeStart, split, rangeEnd,
-            [&](IndexType i1, IndexType i2) {
-                return m_nodes[i1].getPosition()[axis] < m_nodes[i2].getPosition()[axis];
-            }
-        );
+        auto compare = [&](IndexType i1, IndexType i2) {
+            return m_nodes[i1].getPosition()[axis] < m_nodes[i2].getPosition()[axis];
+        };
+
+        if (partitioned) {
+            /* All points left of the split are at most at the midpoint; move
+               the smallest of the others to the split (the first one wins ties) */
+            typedef typename std::vector<IndexType>::iterator Iterator;
+            Iterator minimum = tbb::parallel_reduce(
+                tbb::blocked_range<Iterator>(split, rangeEnd, PARALLEL_GRAIN_SIZE),
+                split,
+                [&](const tbb::blocked_range<Iterator> &range, Iterator result) {
+                    for (Iterator it = range.begin(); it != range.end(); ++it)
+                        if (compare(*it, *result) || (!compare(*result, *it) && it < result))
+                            result = it;
+                    return result;
+                },
+                [&](Iterator a, Iterator b) {
+                    return compare(*b, *a) || (!compare(*a, *b) && b < a) ? b : a;
+                }
+            );
+            std::iter_swap(split, minimum);
+        } else {
+            std::nth_element(rangeStart, split, rangeEnd, compare);
+        }
 
         NodeType &splitNode = m_nodes[*split];
         splitNode.setAxis(axis);
@@ -513,19 +575,69 @@ protected:
         std::iter_swap(rangeStart, split);
 
         /* Recursively build the children */
-        Scalar temp = m_bbox.max[axis],
-            splitPos = splitNode.getPosition()[axis];
-        m_bbox.max[axis] = splitPos;
-        build(depth+1, base, rangeStart+1, split+1);
-        m_bbox.max[axis] = temp;
-
-        if (split+1 != rangeEnd) {
-            temp = m_bbox.min[axis];
-            m_bbox.min[axis] = splitPos;
-            build(depth+1, base, split+1, rangeEnd);
-            m_bbox.min[axis] = temp;
+        Scalar splitPos = splitNode.getPosition()[axis];
+        BoundingBoxType leftBox = bbox, rightBox = bbox;
+        leftBox.max[axis] = splitPos;
+        rightBox.min[axis] = splitPos;
+
+        size_t leftDepth = depth, rightDepth = depth;
+        if (parallel && split+1 != rangeEnd) {
+            tbb::parallel_invoke(
+                [&] { leftDepth = build(depth+1, base, rangeStart+1, split+1, leftBox, scratch); },
+                [&] { rightDepth = build(depth+1, base, split+1, rangeEnd, rightBox, scratch); }
+            );
+        } else {
+            leftDepth = build(depth+1, base, rangeStart+1, split+1, leftBox, scratch);
+            if (split+1 != rangeEnd)
+                rightDepth = build(depth+1, base, split+1, rangeEnd, rightBox, scratch);
         }
+        return std::max(leftDepth, rightDepth);
+    }
+
+    /**
+     * \brief Stable parallel partition of <tt>[rangeStart, rangeEnd)</tt>
+     * into the points that satisfy \c pred and the others
+     *
+     * \return The number of points that satisfy \c pred
+     */
+    template <typename Predicate> size_t partition(
+              typename std::vector<IndexType>::iterator base,
+              typename std::vector<IndexType>::iterator rangeStart,
+              typename std::vector<IndexType>::iterator rangeEnd,
+              const Predicate &pred, std::vector<IndexType> &scratch) {
+        size_t size = (size_t) (rangeEnd - rangeStart);
+        size_t chunkCount = (size + PARALLEL_GRAIN_SIZE - 1) / PARALLEL_GRAIN_SIZE;
+        std::vector<size_t> offsets(chunkCount + 1, 0);
+
+        /* Count the points of every chunk that go to the left */
+        tbb::parallel_for((size_t) 0, chunkCount, [&](size_t chunk) {
+            size_t end = std::min(size, (chunk + 1) * PARALLEL_GRAIN_SIZE);
+            for (size_t i = chunk * PARALLEL_GRAIN_SIZE; i < end; ++i)
+                offsets[chunk + 1] += pred(rangeStart[i]) ? 1 : 0;
+        });
+        for (size_t chunk = 0; chunk < chunkCount; ++chunk)
+            offsets[chunk + 1] += offsets[chunk];
+        size_t nLeft = offsets[chunkCount];
+
+        /* Scatter into the scratch buffer and copy back */
+        IndexType *temp = &scratch[rangeStart - base];
+        tbb::parallel_for((size_t) 0, chunkCount, [&](size_t chunk) {
+            size_t end = std::min(size, (chunk + 1) * PARALLEL_GRAIN_SIZE);
+            size_t left = offsets[chunk], right = nLeft + chunk * PARALLEL_GRAIN_SIZE - offsets[chunk];
+            for (size_t i = chunk * PARALLEL_GRAIN_SIZE; i < end; ++i) {
+                IndexType index = rangeStart[i];
+                temp[pred(index) ? left++ : right++] = index;
+            }
+        });
+        tbb::parallel_for(
+            tbb::blocked_range<size_t>(0, size, PARALLEL_GRAIN_SIZE),
+            [&](const tbb::blocked_range<size_t> &range) {
+                std::copy(temp + range.begin(), temp + range.end(), rangeStart + range.begin());
+            }
+        );
+        return nLeft;
     }
+
 protected:
     std::vector<NodeType> m_nodes;
     BoundingBoxType m_bbox;
@@ -0,0 +1,159 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__NORI_LIGHTSAMPLER_H)
+#define __NORI_LIGHTSAMPLER_H
+
+#include <nori/bbox.h>
+#include <nori/dpdf.h>
+#include <unordered_map>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Conservative bounds of the light emitted by one or several emitters
+ *
+ * All light leaves the box \c bbox. At every point, the emitting surface
+ * normals lie within \c cosThetaO of \c axis, and light is emitted within
+ * \c cosThetaE of these normals (e.g. 0 for one-sided area lights).
+ */
+struct LightBounds {
+    BoundingBox3f bbox;  ///< Spatial bounds
+    Vector3f axis;       ///< Central direction of the normal cone
+    float cosThetaO;     ///< Cosine of the spread of the normal cone
+    float cosThetaE;     ///< Cosine of the spread of the emission around the normals
+    float power;         ///< Total emitted power (luminance)
+
+    /// Create empty bounds that don't emit anything
+    LightBounds() : axis(0.0f, 0.0f, 1.0f), cosThetaO(1.0f), cosThetaE(1.0f), power(0.0f) { }
+
+    /// Grow the bounds so that they also contain \c other
+    void expandBy(const LightBounds &other);
+
+    /**
+     * \brief Return an upper bound-like estimate of the light that
+     * reaches the point \c p with surface normal \c n
+     *
+     * The estimate is zero only if no light of the bounded emitters can
+     * reach \c p. Pass a zero normal for points in participating media.
+     */
+    float importance(const Point3f &p, const Normal3f &n) const;
+};
+
+/**
+ * \brief Chooses the emitter for next event estimation
+ *
+ * Picking emitters uniformly wastes most shadow rays in scenes with many
+ * small lights, since only a few of them are close to (or bright enough
+ * for) a given point. The following strategies are available:
+ *
+ * - \c uniform: every emitter has the same probability
+ * - \c power: emitters are chosen proportionally to their power
+ * - \c bvh: a hierarchy over the bounds and normal cones of the emitters
+ *   is descended by estimating the light of both children at the shading
+ *   point (Conty Estevez and Kulla, "Importance Sampling of Many Lights
+ *   with Adaptive Tree Splitting", 2018)
+ * - \c auto (default): \c bvh in scenes with many emitters, \c power otherwise
+ *
+ * Emitters without bounds (environment maps) are chosen with the same
+ * probability as the group of all other emitters.
+ */
+class LightSampler {
+public:
+    enum EStrategy {
+        EUniform = 0,
+        EPower,
+        EBVH
+    };
+
+    /**
+     * \brief Create a sampler for the given emitters with the strategy of
+     * the given name (see above); builds the light BVH if needed
+     */
+    LightSampler(const std::vector<Emitter *> &emitters, const std::string &strategy);
+
+    /**
+     * \brief Choose an emitter for the point \c p with surface normal \c n
+     * (zero in participating media)
+     *
+     * \param rnd  A uniformly distributed sample on \f$[0,1]\f$
+     * \param pmf  Set to the probability of the chosen emitter
+     * \return     The chosen emitter (\c nullptr if there are none)
+     */
+    const Emitter *sample(const Point3f &p, const Normal3f &n, float rnd, float &pmf) const;
+
+    /// Return the probability that \ref sample() chooses \c emitter at \c p
+    float pmf(const Point3f &p, const Normal3f &n, const Emitter *emitter) const;
+
+    /**
+     * \brief Choose an emitter independently of a shading point (e.g. to
+     * emit photons), proportionally to its power
+     */
+    const Emitter *sample(float rnd, float &pmf) const;
+
+    /// Return the probability that the point-independent \ref sample() chooses \c emitter
+    float pmf(const Emitter *emitter) const;
+
+    /// Return the strategy used for point-dependent queries
+    EStrategy getStrategy() const { return m_strategy; }
+
+    std::string toString() const;
+
+protected:
+    /// Node of the light BVH, children are stored like in \ref BVH
+    struct Node {
+        LightBounds bounds;
+        /// Index of the second child (inner nodes) or of the emitter in \c m_bounded (leaves)
+        uint32_t offset;
+        uint32_t parent;
+        bool leaf;
+    };
+
+    /// Recursively build the light BVH over the bounded emitters <tt>[start, end)</tt>
+    uint32_t build(const std::vector<LightBounds> &bounds, uint32_t *start, uint32_t *end, uint32_t parent);
+
+    /// Return the probability to pick a bounded (vs. an infinite) emitter
+    float getBoundedProbability() const {
+        if (m_bounded.empty())
+            return 0.0f;
+        return 1.0f / (1 + m_infinite.size());
+    }
+
+    /// Choose among the bounded emitters
+    const Emitter *sampleBounded(const Point3f &p, const Normal3f &n, float rnd, float &pmf) const;
+
+    /// Return the probability to choose \c m_bounded[index] among the bounded emitters
+    float pmfBounded(const Point3f &p, const Normal3f &n, uint32_t index) const;
+
+private:
+    EStrategy m_strategy;
+    std::vector<const Emitter *> m_emitters;
+    std::vector<const Emitter *> m_bounded;   ///< Emitters with \ref LightBounds
+    std::vector<const Emitter *> m_infinite;  ///< Emitters at infinity
+
+    /// Index in \c m_bounded (or <tt>m_bounded.size() + index</tt> in \c m_infinite)
+    std::unordered_map<const Emitter *, uint32_t> m_index;
+
+    DiscretePDF m_power;                      ///< Bounded emitters by power
+    std::vector<Node> m_nodes;                ///< Light BVH (\ref EBVH only)
+    std::vector<uint32_t> m_leaves;           ///< Leaf node of every bounded emitter
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __NORI_LIGHTSAMPLER_H */
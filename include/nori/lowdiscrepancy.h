@@ -0,0 +1,130 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__NORI_LOWDISCREPANCY_H)
+#define __NORI_LOWDISCREPANCY_H
+
+#include <nori/common.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Helper functions shared by the low-discrepancy samplers
+ *
+ * All of them are stateless: a sample component is a pure function of the
+ * pixel, the sample index and the dimension, which lets the renderer
+ * interleave the work on several pixels (see \ref Sampler::generate()).
+ */
+struct LowDiscrepancy {
+    /// Integer hash with good avalanche behavior (lowbias32 by C. Wellons)
+    static uint32_t mixBits(uint32_t x) {
+        x ^= x >> 16; x *= 0x7feb352du;
+        x ^= x >> 15; x *= 0x846ca68bu;
+        x ^= x >> 16;
+        return x;
+    }
+
+    /// Seed for the randomization of a (pixel, dimension) pair
+    static uint32_t hash(const Point2i &pixel, uint32_t dimension, uint32_t seed) {
+        return mixBits((uint32_t) pixel.x() ^ mixBits((uint32_t) pixel.y() ^
+            mixBits(dimension ^ mixBits(seed))));
+    }
+
+    /// Convert a 32-bit fixed point number to a float in <tt>[0, 1)</tt>
+    static float toUnitFloat(uint32_t x) {
+        return clampUnit(x * (1.0f / 4294967296.0f));
+    }
+
+    /// Round values that ended up at one down to the largest float below one
+    static float clampUnit(float value) {
+        return std::min(value, 0.99999994f);
+    }
+
+    /// Reverse the order of the bits of \c x
+    static uint32_t reverseBits(uint32_t x) {
+        x = (x << 16) | (x >> 16);
+        x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+        x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+        x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+        x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+        return x;
+    }
+
+    /**
+     * \brief Owen scrambling of a 32-bit fixed point number
+     *
+     * Uses the hash-based formulation of Laine and Karras, "Stratified
+     * sampling for stochastic transparency" (2011), as improved by Burley,
+     * "Practical Hash-based Owen Scrambling" (2020): every bit is flipped
+     * depending only on the more significant bits.
+     */
+    static uint32_t owenScramble(uint32_t x, uint32_t seed) {
+        x = reverseBits(x);
+        x += seed;
+        x ^= x * 0x6c50b47cu;
+        x ^= x * 0xb82f1e52u;
+        x ^= x * 0xc7afe638u;
+        x ^= x * 0x8d22f6e6u;
+        return reverseBits(x);
+    }
+
+    /// The first two dimensions of the Sobol sequence as 32-bit fixed point numbers
+    static uint32_t sobol(uint32_t index, int dimension) {
+        if (dimension == 0)
+            return reverseBits(index);
+
+        /* Direction numbers of the primitive polynomial x + 1 */
+        uint32_t result = 0;
+        for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1)
+            if (index & 1)
+                result ^= v;
+        return result;
+    }
+
+    /**
+     * \brief Owen-scrambled radical inverse of \c index in the given prime base
+     *
+     * Each digit is permuted by an affine permutation that is chosen
+     * by hashing the digits before it, which is a cheap form of nested
+     * uniform scrambling for arbitrary bases.
+     */
+    static float scrambledRadicalInverse(uint32_t base, uint32_t index, uint32_t seed) {
+        const double invBase = 1.0 / base;
+        double factor = invBase, result = 0;
+        uint32_t prefix = seed;
+
+        /* Keep going after the last nonzero digit so that the trailing
+           digits are randomized as well */
+        while (factor > 1e-9) {
+            uint32_t digit = index % base;
+            index /= base;
+
+            uint32_t h = mixBits(prefix);
+            uint32_t scrambled = (uint32_t) ((digit * (uint64_t) (1 + h % (base - 1)) + (h >> 16)) % base);
+
+            result += scrambled * factor;
+            factor *= invBase;
+            prefix = mixBits(prefix ^ (digit + 0x9e3779b9u));
+        }
+        return clampUnit((float) result);
+    }
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __NORI_LOWDISCREPANCY_H */
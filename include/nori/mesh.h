@@ -68,13 +68,18 @@ public:
      * \param v
      *   Upon success, \c v will contain the 'V' component of the intersection
      *   in barycentric coordinates
+     * \param inner
+     *   Unused (meshes don't contain other shapes)
      * \return
      *   \c true if an intersection has been detected
      */
-    virtual bool rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const override;
+    virtual bool rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t, uint32_t &inner) const override;
+
+    /// Return the vertices of the given triangle
+    virtual bool getTriangle(uint32_t index, Point3f &p0, Point3f &p1, Point3f &p2) const override;
 
     /// Set intersection information: hit point, shading frame, UVs
-    virtual void setHitInformation(uint32_t index, const Ray3f &ray, Intersection & its) const override;
+    virtual void setHitInformation(uint32_t index, uint32_t inner, const Ray3f &ray, Intersection & its) const override;
 
     /// Return the total number of vertices in this shape
     uint32_t getVertexCount() const { return (uint32_t) m_V.cols(); }
@@ -104,6 +109,16 @@ public:
     /// Return a pointer to the triangle vertex index list
     const MatrixXu &getIndices() const { return m_F; }
 
+    /**
+     * \brief Replace the vertex positions (and normals) of the mesh, e.g.
+     * for the next frame of an animation
+     *
+     * The topology can't change. Normals are required if the mesh has
+     * them. Afterwards, the BVH must be updated, see \ref
+     * Scene::updateGeometry().
+     */
+    void setVertexPositions(const MatrixXf &positions, const MatrixXf &normals = MatrixXf());
+
 
     /// Return the name of this mesh
     const std::string &getName() const { return m_name; }
@@ -44,6 +44,7 @@ public:
         ESampler,
         ETest,
         EReconstructionFilter,
+        EShapeGroup,
         EClassTypeCount
     };
 
@@ -59,6 +60,7 @@ public:
             case EIntegrator: return "integrator";
             case ESampler:    return "sampler";
             case ETest:       return "test";
+            case EShapeGroup: return "shapegroup";
             default:          return "<unknown>";
         }
     }
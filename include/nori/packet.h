@@ -0,0 +1,82 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob, Romain Prévost
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__NORI_PACKET_H)
+#define __NORI_PACKET_H
+
+#include <nori/shape.h>
+
+#define NORI_PACKET_WIDTH 8 /* Camera rays are traced in packets of 8x8 pixels */
+#define NORI_PACKET_SIZE (NORI_PACKET_WIDTH * NORI_PACKET_WIDTH)
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Packet of up to \ref NORI_PACKET_SIZE rays that are traced together
+ *
+ * The BVH traverses all rays of a packet at once, which amortizes the
+ * node fetches and allows culling entire subtrees for the packet. This
+ * works best for coherent rays with similar origins and directions
+ * (e.g. camera rays of neighboring pixels or shadow rays towards the same
+ * light), but any set of rays is handled correctly.
+ *
+ * Bit \c i of a \ref Mask refers to the ray <tt>rays[i]</tt>.
+ */
+struct RayPacket {
+    typedef uint64_t Mask;
+
+    /// The rays of the packet
+    Ray3f rays[NORI_PACKET_SIZE];
+    /// Number of rays stored in the packet
+    uint32_t size;
+
+    /// Create an empty packet
+    RayPacket() : size(0) { }
+
+    /// Append a ray to the packet
+    void append(const Ray3f &ray) {
+        assert(size < NORI_PACKET_SIZE);
+        rays[size++] = ray;
+    }
+
+    /// Remove all rays from the packet
+    void clear() { size = 0; }
+
+    /// Return a mask with the bits of all rays in the packet set
+    Mask getMask() const {
+        return size == NORI_PACKET_SIZE ? ~Mask(0) : ((Mask(1) << size) - 1);
+    }
+};
+
+/// Intersection records of a \ref RayPacket
+struct HitPacket {
+    /// Intersection records (only valid for the rays in \c hitMask)
+    Intersection its[NORI_PACKET_SIZE];
+    /// Bit mask of the rays that hit something
+    RayPacket::Mask hitMask;
+
+    /// Create an empty record
+    HitPacket() : hitMask(0) { }
+
+    /// Did the i-th ray of the packet hit something?
+    bool hit(uint32_t i) const { return (hitMask >> i) & 1; }
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __NORI_PACKET_H */
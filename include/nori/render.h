@@ -32,16 +32,50 @@ public:
     RenderThread(ImageBlock & block);
     ~RenderThread();
 
-    void renderScene(const std::string & filename);
+    /**
+     * \brief Load the XML scene file and start rendering it asynchronously
+     *
+     * \return \c false if the file did not describe a scene
+     */
+    bool renderScene(const std::string & filename);
 
     bool isBusy();
     void stopRendering();
 
     float getProgress();
 
+    /// Override the sample count of the scene's sampler (0: use the XML value)
+    void setSampleCount(uint32_t sampleCount) { m_sampleCount = sampleCount; }
+
+    /// Replace the scene's sampler by a new instance of the given type (empty: use the XML sampler)
+    void setSamplerType(const std::string &samplerType) { m_samplerType = samplerType; }
+
+    /// Override the number of samples per pixel and pass of the scene (0: use the XML value)
+    void setSamplesPerPass(uint32_t samplesPerPass) { m_samplesPerPass = samplesPerPass; }
+
+    /// Override the adaptive sampling target error of the scene (negative: use the XML value)
+    void setTargetError(float targetError) { m_targetError = targetError; }
+
+    /// Override the time budget of the scene in seconds (negative: use the XML value)
+    void setTimeBudget(float timeBudget) { m_timeBudget = timeBudget; }
+
+    /**
+     * \brief Override the output filename (empty: derive it from the scene)
+     *
+     * A \c .png extension additionally writes a tonemapped LDR image,
+     * the OpenEXR output is always written next to it.
+     */
+    void setOutputName(const std::string & outputName) { m_outputName = outputName; }
+
 protected:
     Scene* m_scene = nullptr;
     ImageBlock & m_block;
+    uint32_t m_sampleCount = 0;
+    std::string m_samplerType;
+    uint32_t m_samplesPerPass = 0;
+    float m_targetError = -1;
+    float m_timeBudget = -1;
+    std::string m_outputName;
     std::thread m_render_thread;
     std::atomic<int> m_render_status; // 0: free, 1: busy, 2: interruption, 3: done
     std::atomic<float> m_progress;
@@ -22,6 +22,9 @@
 #include <nori/object.h>
 #include <memory>
 
+/* Number of sample dimensions consumed by the camera (pixel and aperture position) */
+#define NORI_CAMERA_DIMENSIONS 4
+
 NORI_NAMESPACE_BEGIN
 
 class ImageBlock;
@@ -45,11 +48,16 @@ class ImageBlock;
  *
  * The general interface between a sampler and a rendering algorithm is as 
  * follows: Before beginning to render a pixel, the rendering algorithm calls 
- * \ref generate(). The first pixel sample can now be computed, after which
- * \ref advance() needs to be invoked. This repeats until all pixel samples have
- * been exhausted.  While computing a pixel sample, the rendering 
- * algorithm requests (pseudo-) random numbers using the \ref next1D() and
- * \ref next2D() functions.
+ * \ref generate(). The first pixel sample can now be computed. While computing
+ * a pixel sample, the rendering algorithm requests (pseudo-) random numbers
+ * using the \ref next1D() and \ref next2D() functions. Once a sample has been
+ * computed for every pixel of the image block, \ref advance() needs to be
+ * invoked. This repeats until all pixel samples have been exhausted.
+ *
+ * Since the renderer may interleave the work on several pixels (e.g. when
+ * tracing packets of camera rays), \ref generate() also takes the dimension
+ * at which the sample should be resumed. The camera always consumes the first
+ * \ref NORI_CAMERA_DIMENSIONS dimensions.
  *
  * Conceptually, the right way of thinking of this goes as follows:
  * For each sample in a pixel, a sample generator produces a (hypothetical)
@@ -81,12 +89,18 @@ public:
     /**
      * \brief Prepare to generate new samples
      * 
-     * This function is called initially and every time the 
-     * integrator starts rendering a new pixel.
+     * This function is called every time the renderer starts or resumes
+     * working on the current sample of a pixel.
+     *
+     * \param pixel
+     *    Integer coordinates of the pixel in the image
+     * \param dimension
+     *    Index of the component that the next call to \ref next1D()
+     *    or \ref next2D() should return
      */
-    virtual void generate() = 0;
+    virtual void generate(const Point2i &pixel, uint32_t dimension = 0) = 0;
 
-    /// Advance to the next sample
+    /// Advance to the next sample (of all pixels in the image block)
     virtual void advance() = 0;
 
     /// Retrieve the next component value from the current sample
@@ -98,6 +112,9 @@ public:
     /// Return the number of configured pixel samples
     virtual size_t getSampleCount() const { return m_sampleCount; }
 
+    /// Override the number of pixel samples (e.g. from the command line)
+    virtual void setSampleCount(size_t sampleCount) { m_sampleCount = sampleCount; }
+
     /**
      * \brief Return the type of object (i.e. Mesh/Sampler/etc.) 
      * provided by this instance
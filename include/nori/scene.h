@@ -20,7 +20,9 @@
 #define __NORI_SCENE_H
 
 #include <nori/bvh.h>
+#include <nori/instance.h>
 #include <nori/emitter.h>
+#include <nori/lightsampler.h>
 #include <nori/homogeneous.h>
 
 
@@ -59,35 +61,78 @@ public:
     /// Return a pointer to the scene's sample generator
     Sampler *getSampler() { return m_sampler; }
 
+    /// Replace the scene's sample generator (the scene takes ownership)
+    void setSampler(Sampler *sampler);
+
     /// Return a reference to an array containing all shapes
     const std::vector<Shape *> &getShapes() const { return m_shapes; }
 
+    /// Return the groups of shared geometry referenced by \ref Instance shapes
+    const std::vector<ShapeGroup *> &getShapeGroups() const { return m_groups; }
+
     /// Return a reference to an array containing all lights
     const std::vector<Emitter *> &getLights() const { return m_emitters; }
 
-    /// Return a random emitter
-    const Emitter * getRandomEmitter(float rnd) const {
-        auto const & n = m_emitters.size();
-        size_t index = std::min(
-                static_cast<size_t>(std::floor(n*rnd)),
-                n-1);
-        return m_emitters[index];
+    /**
+     * \brief Choose an emitter for next event estimation at the point \c p
+     * with surface normal \c n (zero in participating media)
+     *
+     * \param rnd  A uniformly distributed sample on \f$[0,1]\f$
+     * \param pmf  Set to the probability of the chosen emitter, which
+     *             the sampled contribution must be divided by
+     */
+    const Emitter *sampleEmitter(const Point3f &p, const Normal3f &n, float rnd, float &pmf) const {
+        return m_lightSampler->sample(p, n, rnd, pmf);
     }
 
-    const Emitter * getEnvLight() const {
-    	for (int i = 0; i < m_emitters.size(); ++i) {
-    		std::string s1 = m_emitters[i]->toString();
-    		std::string s2 = "EnvironmentLight";
-    		if (s1.find(s2) != std::string::npos) {
-    			return m_emitters[i];
-    		}
-    	}
-    	return nullptr;
+    /// Return the probability that \ref sampleEmitter() chooses \c emitter at \c p (for MIS)
+    float pmfEmitter(const Point3f &p, const Normal3f &n, const Emitter *emitter) const {
+        return m_lightSampler->pmf(p, n, emitter);
     }
 
+    /// Choose an emitter proportionally to its power (e.g. to emit photons)
+    const Emitter *sampleEmitter(float rnd, float &pmf) const {
+        return m_lightSampler->sample(rnd, pmf);
+    }
+
+    /// Return the probability that the point-independent \ref sampleEmitter() chooses \c emitter
+    float pmfEmitter(const Emitter *emitter) const {
+        return m_lightSampler->pmf(emitter);
+    }
+
+    /// Return the data structure that chooses among the emitters
+    const LightSampler *getLightSampler() const { return m_lightSampler; }
+
+    /// Return the environment emitter (\c nullptr if there is none)
+    const Emitter * getEnvLight() const { return m_envLight; }
+
     /// Return a pointer to the scene's camera
     const HomogeneousMedium *getMedium() const { return m_medium; }
 
+    /**
+     * \brief Return the target relative error for adaptive sampling
+     *
+     * When nonzero, image blocks stop receiving samples once their
+     * estimated relative error drops below this value, and the sample
+     * budget is spent on the remaining blocks instead.
+     */
+    float getTargetError() const { return m_targetError; }
+
+    /// Set the target relative error for adaptive sampling (0: disabled)
+    void setTargetError(float targetError) { m_targetError = targetError; }
+
+    /// Return the number of samples per pixel that a block receives before the next block is rendered
+    uint32_t getSamplesPerPass() const { return m_samplesPerPass; }
+
+    /// Set the number of samples per pixel that a block receives before the next block is rendered
+    void setSamplesPerPass(uint32_t samplesPerPass) { m_samplesPerPass = samplesPerPass; }
+
+    /// Return the render time budget in seconds (0: unlimited)
+    float getTimeBudget() const { return m_timeBudget; }
+
+    /// Set the render time budget in seconds (0: unlimited)
+    void setTimeBudget(float timeBudget) { m_timeBudget = timeBudget; }
+
     /// Return envlight
 
     /**
@@ -124,8 +169,49 @@ public:
      * \return \c true if an intersection was found
      */
     bool rayIntersect(const Ray3f &ray) const {
-        Intersection its; /* Unused */
-        return m_bvh->rayIntersect(ray, its, true);
+        return m_bvh->occluded(ray);
+    }
+
+    /**
+     * \brief Shadow ray query: determine whether anything blocks the
+     * segment of the ray (see \ref BVH::occluded())
+     *
+     * Use this instead of the full intersection query whenever the
+     * intersection record would be discarded anyway.
+     *
+     * \return \c true if an intersection was found
+     */
+    bool occluded(const Ray3f &ray) const {
+        return m_bvh->occluded(ray);
+    }
+
+    /**
+     * \brief Intersect a packet of rays against all triangles stored in
+     * the scene and return detailed intersection information
+     *
+     * This is equivalent to calling \ref rayIntersect() for each ray,
+     * but much faster for coherent rays (e.g. camera rays of neighboring
+     * pixels), since the BVH is traversed once for the entire packet.
+     *
+     * \param packet
+     *    The rays to be traced
+     *
+     * \param hits
+     *    Intersection records for the rays of the packet. The bits of
+     *    \c hits.hitMask are set for the rays that hit something.
+     */
+    void rayIntersect(const RayPacket &packet, HitPacket &hits) const {
+        m_bvh->rayIntersect(packet, hits);
+    }
+
+    /**
+     * \brief Shadow ray query for a packet of rays: only determine
+     * which rays are occluded
+     *
+     * \return A bit mask of the rays for which an intersection was found
+     */
+    RayPacket::Mask occluded(const RayPacket &packet) const {
+        return m_bvh->occluded(packet);
     }
 
     /**
@@ -135,6 +221,18 @@ public:
         return m_bvh->getBoundingBox();
     }
 
+    /**
+     * \brief Update the BVH after shapes were deformed (see \ref
+     * Mesh::setVertexPositions()) or instances moved (see \ref
+     * Instance::setTransform())
+     *
+     * The tree is refitted, and only rebuilt once its quality has degraded
+     * too much (see \ref BVH::refit()). The BVHs of shape groups are left
+     * untouched; refit them with \ref ShapeGroup::refit() before calling
+     * this function if their shapes have changed.
+     */
+    void updateGeometry();
+
     /**
      * \brief Inherited from \ref NoriObject::activate()
      *
@@ -152,15 +250,23 @@ public:
     virtual EClassType getClassType() const override { return EScene; }
 private:
     std::vector<Shape *> m_shapes;
+    std::vector<ShapeGroup *> m_groups;
     Integrator *m_integrator = nullptr;
     Sampler *m_sampler = nullptr;
     Camera *m_camera = nullptr;
     BVH *m_bvh = nullptr;
 
     std::vector<Emitter *> m_emitters;
+    LightSampler *m_lightSampler = nullptr;
+    const Emitter *m_envLight = nullptr;
+    std::string m_lightSamplerStrategy;
 
     HomogeneousMedium *m_medium;
 
+    uint32_t m_samplesPerPass = 1;
+    float m_targetError = 0;
+    float m_timeBudget = 0;
+
 };
 
 NORI_NAMESPACE_END
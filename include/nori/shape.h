@@ -129,11 +129,54 @@ public:
     //// Return the centroid of the given triangle
     virtual Point3f getCentroid(uint32_t index) const = 0;
 
-    //// Ray-Shape intersection test
-    virtual bool rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const = 0;
+    /**
+     * \brief Ray-Shape intersection test
+     *
+     * Shapes that contain other shapes (i.e. \ref Instance) store the
+     * primitive that was hit inside of them in \c inner, which is passed
+     * on to \ref setHitInformation() if the hit turns out to be the
+     * closest one. Other shapes leave it untouched.
+     */
+    virtual bool rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t, uint32_t &inner) const = 0;
 
-    /// Set the intersection information: hit point, shading frame, UVs, etc.
-    virtual void setHitInformation(uint32_t index, const Ray3f &ray, Intersection & its) const = 0;
+    /**
+     * \brief Shadow ray test: is there any intersection with the given
+     * primitive within the segment of the ray?
+     *
+     * Shapes that contain other shapes (i.e. \ref Instance) override this
+     * to stop at the first intersection they find.
+     */
+    virtual bool rayOccluded(uint32_t index, const Ray3f &ray) const {
+        float u, v, t;
+        uint32_t inner = 0;
+        return rayIntersect(index, ray, u, v, t, inner);
+    }
+
+    /**
+     * \brief Return the vertices of the given primitive if it is a triangle
+     *
+     * The BVH uses this to store triangles in a packed form that can be
+     * intersected several at a time. Other primitives return \c false and
+     * are intersected using \ref rayIntersect().
+     */
+    virtual bool getTriangle(uint32_t index, Point3f &p0, Point3f &p1, Point3f &p2) const { return false; }
+
+    /**
+     * \brief Return the center and radius of the given primitive if it is
+     * a sphere
+     *
+     * Like triangles, spheres are stored in packed form by the BVH and
+     * intersected without going through \ref rayIntersect().
+     */
+    virtual bool getSphere(uint32_t index, Point3f &center, float &radius) const { return false; }
+
+    /**
+     * \brief Set the intersection information: hit point, shading frame, UVs, etc.
+     *
+     * \c its.uv holds the barycentric coordinates and \c inner the inner
+     * primitive reported by \ref rayIntersect().
+     */
+    virtual void setHitInformation(uint32_t index, uint32_t inner, const Ray3f &ray, Intersection & its) const = 0;
 
     /**
      * \brief Sample a point on the surface (potentially using the point sRec.ref to importance sample)
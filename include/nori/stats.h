@@ -0,0 +1,93 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__NORI_STATS_H)
+#define __NORI_STATS_H
+
+#include <nori/common.h>
+
+/**
+ * Evaluate the given statement only if the renderer was compiled with
+ * traversal statistics (CMake option \c NORI_STATISTICS). Otherwise, the
+ * counters cost nothing.
+ */
+#if defined(NORI_STATISTICS)
+#  define NORI_STAT(statement) statement
+#else
+#  define NORI_STAT(statement) do { } while (0)
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Ray traversal counters of one thread
+ *
+ * Every thread increments its own set of counters without any
+ * synchronization. \ref aggregate() sums them up, which is only
+ * meaningful while no rays are being traced (e.g. after a render).
+ */
+struct TraversalStatistics {
+    /// Kinds of ray queries
+    enum ERayKind {
+        EClosestHit = 0,  ///< Single ray, closest intersection
+        EShadow,          ///< Single ray, any intersection
+        EPacket,          ///< Ray of a packet, closest intersection
+        EPacketShadow,    ///< Ray of a packet, any intersection
+        EInstance,        ///< Ray traced against the BVH of a \ref ShapeGroup
+        ERayKindCount
+    };
+
+    uint64_t rays[ERayKindCount]; ///< Traced rays by kind
+    uint64_t nodes;               ///< Visited BVH nodes (including leaves)
+    uint64_t primitives;          ///< Ray-primitive tests (SIMD lanes count individually)
+    uint64_t hits;                ///< Rays that found an intersection
+    uint64_t occluderHits;        ///< Shadow rays that were blocked by the cached last occluder
+
+    TraversalStatistics() { clear(); }
+
+    /// Reset all counters to zero
+    void clear();
+
+    /// Return the number of top-level rays (all kinds except \ref EInstance)
+    uint64_t getRayCount() const;
+
+    /// Return the counters that were accumulated since \c other was taken
+    TraversalStatistics operator-(const TraversalStatistics &other) const;
+
+    /// Add the counters of another set
+    TraversalStatistics &operator+=(const TraversalStatistics &other);
+
+    /// Return the counters of the calling thread
+    static TraversalStatistics &local();
+
+    /// Sum up the counters of all threads
+    static TraversalStatistics aggregate();
+
+    /// Reset the counters of all threads
+    static void reset();
+
+    /**
+     * \brief Return a summary (Mrays/s etc.) of a render that took \c time
+     * milliseconds to take \c sampleCount samples (summed over all pixels)
+     */
+    std::string toString(double time, uint64_t sampleCount) const;
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __NORI_STATS_H */
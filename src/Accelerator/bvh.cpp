@@ -18,10 +18,15 @@
 
 #include <nori/bvh.h>
 #include <nori/timer.h>
+#include <nori/stats.h>
 #include <tbb/tbb.h>
 #include <Eigen/Geometry>
 #include <atomic>
 
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
 /*
  * =======================================================================
  *   WARNING    WARNING    WARNING    WARNING    WARNING    WARNING
@@ -33,12 +38,28 @@
 
 NORI_NAMESPACE_BEGIN
 
-/* Bin data structure for counting triangles and computing their bounding box */
+/* Bin data structure for counting triangles and computing their bounding
+   box (as well as the bounding box of their centroids) along all three axes */
 struct Bins {
     static const int BIN_COUNT = 16;
-    Bins() { memset(counts, 0, sizeof(uint32_t) * BIN_COUNT); }
-    uint32_t counts[BIN_COUNT];
-    BoundingBox3f bbox[BIN_COUNT];
+    Bins() { memset(counts, 0, sizeof(uint32_t) * 3 * BIN_COUNT); }
+    uint32_t counts[3][BIN_COUNT];
+    BoundingBox3f bbox[3][BIN_COUNT];
+    BoundingBox3f centroidBbox[3][BIN_COUNT];
+
+    /// Combine two 'Bins' data structures
+    static Bins merge(const Bins &b1, const Bins &b2) {
+        Bins result;
+        for (int axis=0; axis < 3; ++axis) {
+            for (int i=0; i < BIN_COUNT; ++i) {
+                result.counts[axis][i] = b1.counts[axis][i] + b2.counts[axis][i];
+                result.bbox[axis][i] = BoundingBox3f::merge(b1.bbox[axis][i], b2.bbox[axis][i]);
+                result.centroidBbox[axis][i] = BoundingBox3f::merge(
+                    b1.centroidBbox[axis][i], b2.centroidBbox[axis][i]);
+            }
+        }
+        return result;
+    }
 };
 
 /**
@@ -50,18 +71,34 @@ struct Bins {
  * The used methodology is roughly that described in
  * "Fast and Parallel Construction of SAH-based Bounding Volume Hierarchies"
  * by Ingo Wald (Proc. IEEE/EG Symposium on Interactive Ray Tracing, 2007)
+ *
+ * All nodes are split using binned SAH on all three axes, where the bins
+ * span the bounding box of the centroids of the node. Large nodes bin and
+ * partition their primitives in parallel, small ones serially. The
+ * primitive centroids and bounds are read from the precomputed arrays in
+ * \ref BVH::BVHPrimitiveData.
+ *
+ * Nodes are appended to a node array in depth-first order, so no space
+ * is reserved for nodes that are never created. The right subtree of a
+ * split that is built in parallel goes into a separate array, which is
+ * appended by a \ref BVHAppendTask once both subtrees are done.
  */
 class BVHBuildTask : public tbb::task {
 private:
     BVH &bvh;
-    uint32_t node_idx;
+    std::vector<BVH::BVHNode> *nodes;
+    BoundingBox3f bbox;
     uint32_t *start, *end, *temp;
+    BoundingBox3f centroidBbox;
 
 public:
     /// Build-related parameters
     enum {
-        /// Switch to a serial build when less than 32 triangles are left
-        SERIAL_THRESHOLD = 32,
+        /// Switch to a serial build when less than 4K triangles are left
+        SERIAL_THRESHOLD = 4096,
+
+        /// Nodes with more triangles are split even if the binned SAH finds no split
+        MAX_LEAF_SIZE = 8,
 
         /// Process triangles in batches of 1K for the purpose of parallelization
         GRAIN_SIZE = 1000,
@@ -73,6 +110,14 @@ public:
         INTERSECTION_COST = 1
     };
 
+    /// Best split plane found by \ref findSplit()
+    struct Split {
+        int axis = -1, index = -1;
+        uint32_t leftCount = 0;
+        BoundingBox3f leftBbox, rightBbox;
+        BoundingBox3f leftCentroidBbox, rightCentroidBbox;
+    };
+
 public:
     /**
      * Create a new build task
@@ -80,8 +125,11 @@ public:
      * \param bvh
      *    Reference to the underlying BVH
      *
-     * \param node_idx
-     *    Index of the BVH node that should be built
+     * \param nodes
+     *    Node array that the subtree should be appended to
+     *
+     * \param bbox
+     *    Bounding box of the triangles to be processed
      *
      * \param start
      *    Start pointer into a list of triangle indices to be processed
@@ -93,24 +141,28 @@ public:
      *    Pointer into a temporary memory region that can be used for
      *    construction purposes. The usable length is <tt>end-start</tt>
      *    unsigned integers.
+     *
+     * \param centroidBbox
+     *    Bounding box of the centroids of the triangles to be processed
      */
-    BVHBuildTask(BVH &bvh, uint32_t node_idx, uint32_t *start, uint32_t *end, uint32_t *temp)
-        : bvh(bvh), node_idx(node_idx), start(start), end(end), temp(temp) { }
+    BVHBuildTask(BVH &bvh, std::vector<BVH::BVHNode> *nodes, const BoundingBox3f &bbox,
+                 uint32_t *start, uint32_t *end, uint32_t *temp, const BoundingBox3f &centroidBbox)
+        : bvh(bvh), nodes(nodes), bbox(bbox), start(start), end(end), temp(temp),
+          centroidBbox(centroidBbox) { }
 
     task *execute() {
         uint32_t size = (uint32_t) (end-start);
-        BVH::BVHNode &node = bvh.m_nodes[node_idx];
 
         /* Switch to a serial build when less than SERIAL_THRESHOLD triangles are left */
         if (size < SERIAL_THRESHOLD) {
-            execute_serially(bvh, node_idx, start, end, temp);
+            execute_serially(bvh, *nodes, bbox, start, end, centroidBbox);
             return nullptr;
         }
 
-        /* Always split along the largest axis */
-        int axis = node.bbox.getLargestAxis();
-        float min = node.bbox.min[axis], max = node.bbox.max[axis],
-              inv_bin_size = Bins::BIN_COUNT / (max-min);
+        uint32_t node_idx = appendNode(*nodes, bbox);
+
+        const BVH::BVHPrimitiveData &data = *bvh.m_primitives;
+        BinMapping mapping(centroidBbox);
 
         /* Accumulate all triangles into bins */
         Bins bins = tbb::parallel_reduce(
@@ -118,334 +170,2163 @@ public:
             Bins(),
             /* MAP: Bin a number of triangles and return the resulting 'Bins' data structure */
             [&](const tbb::blocked_range<uint32_t> &range, Bins result) {
-                for (uint32_t i = range.begin(); i != range.end(); ++i) {
-                    uint32_t f = start[i];
-                    float centroid = bvh.getCentroid(f)[axis];
-
-                    int index = std::min(std::max(
-                        (int) ((centroid - min) * inv_bin_size), 0),
-                        (Bins::BIN_COUNT - 1));
-
-                    result.counts[index]++;
-                    result.bbox[index].expandBy(bvh.getBoundingBox(f));
-                }
+                for (uint32_t i = range.begin(); i != range.end(); ++i)
+                    addToBins(data, mapping, start[i], result);
                 return result;
             },
             /* REDUCE: Combine two 'Bins' data structures */
-            [](const Bins &b1, const Bins &b2) {
-                Bins result;
-                for (int i=0; i < Bins::BIN_COUNT; ++i) {
-                    result.counts[i] = b1.counts[i] + b2.counts[i];
-                    result.bbox[i] = BoundingBox3f::merge(b1.bbox[i], b2.bbox[i]);
+            &Bins::merge
+        );
+
+        Split split = findSplit(bins, bbox, size);
+        if (split.axis == -1) {
+            /* The bins can't separate the triangles (e.g. clustered centroids),
+               fall back to a median split, which also partitions them */
+            medianSplit(data, start, end, centroidBbox, split);
+        } else {
+            std::atomic<uint32_t> offset_left(0),
+                                  offset_right(split.leftCount);
+
+            tbb::parallel_for(
+                tbb::blocked_range<uint32_t>(0u, size, GRAIN_SIZE),
+                [&](const tbb::blocked_range<uint32_t> &range) {
+                    uint32_t count_left = 0, count_right = 0;
+                    for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                        uint32_t f = start[i];
+                        bool left = mapping.bin(data, f, split.axis) <= split.index;
+                        (left ? count_left : count_right)++;
+                    }
+                    uint32_t idx_l = offset_left.fetch_add(count_left);
+                    uint32_t idx_r = offset_right.fetch_add(count_right);
+                    for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                        uint32_t f = start[i];
+                        if (mapping.bin(data, f, split.axis) <= split.index)
+                            temp[idx_l++] = f;
+                        else
+                            temp[idx_r++] = f;
+                    }
                 }
-                return result;
+            );
+            memcpy(start, temp, size * sizeof(uint32_t));
+            assert(offset_left == split.leftCount && offset_right == size);
+        }
+
+        uint32_t left_count = split.leftCount;
+        BVH::BVHNode &node = (*nodes)[node_idx];
+        node.inner.axis = split.axis;
+        node.inner.flag = 0;
+
+        /* Create a parent task that joins the two subtrees */
+        BVHAppendTask &c = *new (allocate_continuation()) BVHAppendTask(*nodes, node_idx);
+        c.set_ref_count(2);
+
+        /* Post right subtree to scheduler */
+        BVHBuildTask &b = *new (c.allocate_child())
+            BVHBuildTask(bvh, &c.right, split.rightBbox, start + left_count,
+                         end, temp + left_count, split.rightCentroidBbox);
+        spawn(b);
+
+        /* Directly start working on left subtree, which directly follows the node */
+        recycle_as_child_of(c);
+        bbox = split.leftBbox;
+        end = start + left_count;
+        centroidBbox = split.leftCentroidBbox;
+
+        return this;
+    }
+
+    /// Single-threaded build function
+    static void execute_serially(BVH &bvh, std::vector<BVH::BVHNode> &nodes, const BoundingBox3f &bbox,
+                                 uint32_t *start, uint32_t *end, const BoundingBox3f &centroidBbox) {
+        uint32_t node_idx = appendNode(nodes, bbox);
+        uint32_t size = (uint32_t) (end - start);
+        const BVH::BVHPrimitiveData &data = *bvh.m_primitives;
+        BinMapping mapping(centroidBbox);
+
+        Bins bins;
+        for (uint32_t i = 0; i < size; ++i)
+            addToBins(data, mapping, start[i], bins);
+
+        Split split = findSplit(bins, bbox, size);
+        if (split.axis == -1) {
+            if (size <= MAX_LEAF_SIZE) {
+                /* Splitting does not reduce the cost, make a leaf */
+                makeLeaf(bvh, nodes[node_idx], start, size);
+                return;
             }
-        );
+            /* Don't create large leaves, fall back to a median split */
+            medianSplit(data, start, end, centroidBbox, split);
+        } else {
+            std::partition(start, end, [&](uint32_t f) {
+                return mapping.bin(data, f, split.axis) <= split.index;
+            });
+        }
+
+        uint32_t left_count = split.leftCount;
+        nodes[node_idx].inner.axis = split.axis;
+        nodes[node_idx].inner.flag = 0;
+
+        /* Note: 'nodes' may be reallocated by the recursive calls */
+        execute_serially(bvh, nodes, split.leftBbox, start, start + left_count, split.leftCentroidBbox);
+        nodes[node_idx].inner.rightChild = (uint32_t) nodes.size();
+        execute_serially(bvh, nodes, split.rightBbox, start + left_count, end, split.rightCentroidBbox);
+    }
+
+private:
+    /// Join task: appends the separately built right subtree of a node
+    class BVHAppendTask : public tbb::task {
+    public:
+        BVHAppendTask(std::vector<BVH::BVHNode> &nodes, uint32_t node_idx)
+            : nodes(nodes), node_idx(node_idx) { }
+
+        task *execute() {
+            uint32_t offset = (uint32_t) nodes.size();
+            for (BVH::BVHNode node : right) {
+                if (node.isInner())
+                    node.inner.rightChild += offset;
+                nodes.push_back(node);
+            }
+            nodes[node_idx].inner.rightChild = offset;
+            std::vector<BVH::BVHNode>().swap(right);
+            return nullptr;
+        }
+
+        std::vector<BVH::BVHNode> right; ///< Right subtree (built by a child task)
+
+    private:
+        std::vector<BVH::BVHNode> &nodes;
+        uint32_t node_idx;
+    };
+
+    /// Append an empty node with the given bounds and return its index
+    static uint32_t appendNode(std::vector<BVH::BVHNode> &nodes, const BoundingBox3f &bbox) {
+        uint32_t node_idx = (uint32_t) nodes.size();
+        nodes.push_back(BVH::BVHNode());
+        nodes[node_idx].bbox = bbox;
+        return node_idx;
+    }
+
+    /// Maps centroid positions to bins along each axis
+    struct BinMapping {
+        float min[3], inv_bin_size[3];
 
-        /* Choose the best split plane based on the binned data */
-        BoundingBox3f bbox_left[Bins::BIN_COUNT];
-        bbox_left[0] = bins.bbox[0];
-        for (int i=1; i<Bins::BIN_COUNT; ++i) {
-            bins.counts[i] += bins.counts[i-1];
-            bbox_left[i] = BoundingBox3f::merge(bbox_left[i-1], bins.bbox[i]);
+        BinMapping(const BoundingBox3f &centroidBbox) {
+            for (int axis = 0; axis < 3; ++axis) {
+                float extent = centroidBbox.max[axis] - centroidBbox.min[axis];
+                min[axis] = centroidBbox.min[axis];
+                /* Degenerate axes put everything into the first bin */
+                inv_bin_size[axis] = extent > 0 ? Bins::BIN_COUNT / extent : 0.0f;
+            }
+        }
+
+        int bin(const BVH::BVHPrimitiveData &data, uint32_t f, int axis) const {
+            return std::min(std::max(
+                (int) ((data.centroid[axis][f] - min[axis]) * inv_bin_size[axis]), 0),
+                (Bins::BIN_COUNT - 1));
+        }
+    };
+
+    static void addToBins(const BVH::BVHPrimitiveData &data, const BinMapping &mapping,
+                          uint32_t f, Bins &bins) {
+        BoundingBox3f bbox = data.getBoundingBox(f);
+        Point3f centroid = data.getCentroid(f);
+        for (int axis = 0; axis < 3; ++axis) {
+            int index = mapping.bin(data, f, axis);
+            bins.counts[axis][index]++;
+            bins.bbox[axis][index].expandBy(bbox);
+            bins.centroidBbox[axis][index].expandBy(centroid);
         }
+    }
 
-        BoundingBox3f bbox_right = bins.bbox[Bins::BIN_COUNT-1], best_bbox_right;
-        int64_t best_index = -1;
+    /// Choose the best split plane based on the binned data
+    static Split findSplit(const Bins &bins, const BoundingBox3f &bbox, uint32_t size) {
+        Split best;
         float best_cost = (float) INTERSECTION_COST * size;
-        float tri_factor = (float) INTERSECTION_COST / node.bbox.getSurfaceArea();
+        float tri_factor = (float) INTERSECTION_COST / bbox.getSurfaceArea();
+
+        for (int axis = 0; axis < 3; ++axis) {
+            uint32_t counts_left[Bins::BIN_COUNT];
+            BoundingBox3f bbox_left[Bins::BIN_COUNT];
+            counts_left[0] = bins.counts[axis][0];
+            bbox_left[0] = bins.bbox[axis][0];
+            for (int i=1; i<Bins::BIN_COUNT; ++i) {
+                counts_left[i] = counts_left[i-1] + bins.counts[axis][i];
+                bbox_left[i] = BoundingBox3f::merge(bbox_left[i-1], bins.bbox[axis][i]);
+            }
 
-        for (int i=Bins::BIN_COUNT - 2; i >= 0; --i) {
-            uint32_t prims_left = bins.counts[i], prims_right = (uint32_t) (end - start) - bins.counts[i];
-            float sah_cost = 2.0f * TRAVERSAL_COST +
-                tri_factor * (prims_left * bbox_left[i].getSurfaceArea() +
-                              prims_right * bbox_right.getSurfaceArea());
-            if (sah_cost < best_cost) {
-                best_cost = sah_cost;
-                best_index = i;
-                best_bbox_right = bbox_right;
+            BoundingBox3f bbox_right = bins.bbox[axis][Bins::BIN_COUNT-1];
+            for (int i=Bins::BIN_COUNT - 2; i >= 0; --i) {
+                uint32_t prims_left = counts_left[i], prims_right = size - counts_left[i];
+                if (prims_left > 0 && prims_right > 0) {
+                    float sah_cost = 2.0f * TRAVERSAL_COST +
+                        tri_factor * (prims_left * bbox_left[i].getSurfaceArea() +
+                                      prims_right * bbox_right.getSurfaceArea());
+                    if (sah_cost < best_cost) {
+                        best_cost = sah_cost;
+                        best.axis = axis;
+                        best.index = i;
+                        best.leftCount = prims_left;
+                        best.leftBbox = bbox_left[i];
+                        best.rightBbox = bbox_right;
+                    }
+                }
+                bbox_right = BoundingBox3f::merge(bbox_right, bins.bbox[axis][i]);
             }
-            bbox_right = BoundingBox3f::merge(bbox_right, bins.bbox[i]);
         }
 
-        if (best_index == -1) {
-            /* Could not find a good split plane -- retry with
-               more careful serial code just to be sure.. */
-            execute_serially(bvh, node_idx, start, end, temp);
-            return nullptr;
+        if (best.axis != -1) {
+            for (int i=0; i<Bins::BIN_COUNT; ++i)
+                (i <= best.index ? best.leftCentroidBbox : best.rightCentroidBbox)
+                    .expandBy(bins.centroidBbox[best.axis][i]);
         }
+        return best;
+    }
 
-        uint32_t left_count = bins.counts[best_index];
-        int node_idx_left = node_idx+1;
-        int node_idx_right = node_idx+2*left_count;
+    /**
+     * \brief Split at the median centroid along the longest axis of the centroid bounds
+     *
+     * Used when no binned split beats the leaf cost. Reorders the triangles
+     * so that the left child comes first. Triangles with identical centroids are simply divided in half.
+     */
+    static void medianSplit(const BVH::BVHPrimitiveData &data, uint32_t *start, uint32_t *end,
+                            const BoundingBox3f &centroidBbox, Split &split) {
+        int axis = centroidBbox.getMajorAxis();
+        uint32_t size = (uint32_t) (end - start), left_count = size / 2;
+        const float *centroid = data.centroid[axis].data();
+
+        std::nth_element(start, start + left_count, end, [&](uint32_t f1, uint32_t f2) {
+            return centroid[f1] < centroid[f2];
+        });
 
-        bvh.m_nodes[node_idx_left ].bbox = bbox_left[best_index];
-        bvh.m_nodes[node_idx_right].bbox = best_bbox_right;
-        node.inner.rightChild = node_idx_right;
-        node.inner.axis = axis;
-        node.inner.flag = 0;
+        split = Split();
+        split.axis = axis;
+        split.leftCount = left_count;
+        for (uint32_t i = 0; i < size; ++i) {
+            uint32_t f = start[i];
+            bool left = i < left_count;
+            (left ? split.leftBbox : split.rightBbox).expandBy(data.getBoundingBox(f));
+            (left ? split.leftCentroidBbox : split.rightCentroidBbox).expandBy(data.getCentroid(f));
+        }
+    }
+
+    static void makeLeaf(BVH &bvh, BVH::BVHNode &node, uint32_t *start, uint32_t size) {
+        node.leaf.flag = 1;
+        node.leaf.start = (uint32_t) (start - bvh.m_indices.data());
+        node.leaf.size  = size;
+    }
+};
+
+/**
+ * \brief Morton code based BVH builder (HLBVH)
+ *
+ * Builds a BVH much faster than \ref BVHBuildTask, at the price of a
+ * somewhat higher SAH cost. The primitives are sorted along a Morton
+ * curve through their centroids using a parallel radix sort. Primitives
+ * whose codes share the top \c CLUSTER_BITS bits form a cluster; the
+ * hierarchy within each cluster follows directly from the bits of the
+ * sorted codes and is emitted in parallel. Finally, the clusters are
+ * joined by a few top levels chosen with the SAH.
+ *
+ * The method is described in
+ *
+ * "HLBVH: Hierarchical LBVH Construction for Real-Time Ray Tracing of
+ * Dynamic Geometry" by Jacopo Pantaleoni and David Luebke (Proc. High
+ * Performance Graphics 2010)
+ */
+class HLBVHBuilder {
+public:
+    /// Build-related parameters
+    enum {
+        /// Bits per axis of the Morton codes
+        MORTON_BITS = 10,
+
+        /// Number of leading Morton code bits that determine the cluster of a primitive
+        CLUSTER_BITS = 12,
 
-        std::atomic<uint32_t> offset_left(0),
-                              offset_right(bins.counts[best_index]);
+        /// Bits sorted per radix sort pass
+        RADIX_BITS = 10,
 
+        /// Maximum number of primitives in a leaf
+        MAX_LEAF_SIZE = 4,
+
+        /// Number of buckets used to find SAH splits between clusters
+        SAH_BUCKETS = 12,
+
+        /// Process primitives in batches of 1K for the purpose of parallelization
+        GRAIN_SIZE = 1000
+    };
+
+    HLBVHBuilder(BVH &bvh) : bvh(bvh) { }
+
+    /// Build the node and index arrays of the BVH and return the peak memory usage
+    size_t build() {
+        uint32_t size = bvh.getPrimitiveCount();
+
+        const BVH::BVHPrimitiveData &data = *bvh.m_primitives;
+        const BoundingBox3f &centroidBounds = data.centroidBbox;
+
+        /* Quantize the centroids and sort them along a Morton curve */
+        std::vector<MortonPrimitive> prims(size);
+        Vector3f scale = Vector3f::Constant((float) (1 << MORTON_BITS)).cwiseQuotient(
+            centroidBounds.getExtents().cwiseMax(Vector3f::Constant(1e-20f)));
         tbb::parallel_for(
             tbb::blocked_range<uint32_t>(0u, size, GRAIN_SIZE),
             [&](const tbb::blocked_range<uint32_t> &range) {
-                uint32_t count_left = 0, count_right = 0;
                 for (uint32_t i = range.begin(); i != range.end(); ++i) {
-                    uint32_t f = start[i];
-                    float centroid = bvh.getCentroid(f)[axis];
-                    int index = (int) ((centroid - min) * inv_bin_size);
-                    (index <= best_index ? count_left : count_right)++;
+                    uint32_t code = 0;
+                    for (int axis = 0; axis < 3; ++axis) {
+                        float pos = (data.centroid[axis][i] - centroidBounds.min[axis]) * scale[axis];
+                        uint32_t cell = (uint32_t) std::min(std::max(pos, 0.f),
+                            (float) ((1 << MORTON_BITS) - 1));
+                        code |= expandBits(cell) << (2 - axis);
+                    }
+                    prims[i].code = code;
+                    prims[i].index = i;
                 }
-                uint32_t idx_l = offset_left.fetch_add(count_left);
-                uint32_t idx_r = offset_right.fetch_add(count_right);
-                for (uint32_t i = range.begin(); i != range.end(); ++i) {
-                    uint32_t f = start[i];
-                    float centroid = bvh.getCentroid(f)[axis];
-                    int index = (int) ((centroid - min) * inv_bin_size);
-                    if (index <= best_index)
-                        temp[idx_l++] = f;
-                    else
-                        temp[idx_r++] = f;
+            }
+        );
+        size_t memory = radixSort(prims);
+
+        /* The primitives are referenced in Morton order */
+        bvh.m_indices.resize(size);
+        for (uint32_t i = 0; i < size; ++i)
+            bvh.m_indices[i] = prims[i].index;
+
+        /* Find the clusters (runs of equal leading bits) */
+        const int clusterShift = 3 * MORTON_BITS - CLUSTER_BITS;
+        std::vector<Cluster> clusters;
+        for (uint32_t start = 0, end = 1; end <= size; ++end) {
+            if (end == size || (prims[end].code >> clusterShift) != (prims[start].code >> clusterShift)) {
+                clusters.push_back(Cluster());
+                clusters.back().start = start;
+                clusters.back().end = end;
+                start = end;
+            }
+        }
+
+        /* Emit the hierarchy within each cluster */
+        tbb::parallel_for(
+            tbb::blocked_range<size_t>(0u, clusters.size()),
+            [&](const tbb::blocked_range<size_t> &range) {
+                for (size_t i = range.begin(); i != range.end(); ++i) {
+                    Cluster &cluster = clusters[i];
+                    emitLBVH(cluster.nodes, prims.data(), cluster.start, cluster.end, clusterShift - 1);
                 }
             }
         );
-        memcpy(start, temp, size * sizeof(uint32_t));
-        assert(offset_left == left_count && offset_right == size);
+        for (const Cluster &cluster : clusters)
+            memory += sizeof(BVH::BVHNode) * cluster.nodes.size();
+
+        /* Join the clusters using the SAH */
+        std::vector<uint32_t> clusterIds(clusters.size());
+        for (uint32_t i = 0; i < (uint32_t) clusters.size(); ++i)
+            clusterIds[i] = i;
+        std::vector<UpperNode> upper;
+        buildUpper(upper, clusters, clusterIds.data(), (uint32_t) clusters.size());
+
+        /* Lay out the final node array: the top levels are emitted in
+           depth-first order, leaving gaps for the clusters, which are
+           then copied in parallel */
+        std::vector<BVH::BVHNode> &nodes = bvh.m_nodes;
+        nodes.clear();
+        flattenUpper(upper, 0u, clusters, nodes);
 
-        /* Create an empty parent task */
-        tbb::task& c = *new (allocate_continuation()) tbb::empty_task;
-        c.set_ref_count(2);
+        tbb::parallel_for(
+            tbb::blocked_range<size_t>(0u, clusters.size()),
+            [&](const tbb::blocked_range<size_t> &range) {
+                for (size_t i = range.begin(); i != range.end(); ++i) {
+                    Cluster &cluster = clusters[i];
+                    for (size_t j = 0; j < cluster.nodes.size(); ++j) {
+                        BVH::BVHNode node = cluster.nodes[j];
+                        if (node.isInner())
+                            node.inner.rightChild += cluster.offset;
+                        nodes[cluster.offset + j] = node;
+                    }
+                    std::vector<BVH::BVHNode>().swap(cluster.nodes);
+                }
+            }
+        );
 
-        /* Post right subtree to scheduler */
-        BVHBuildTask &b = *new (c.allocate_child())
-            BVHBuildTask(bvh, node_idx_right, start + left_count,
-                         end, temp + left_count);
-        spawn(b);
+        return memory + sizeof(BVH::BVHNode) * nodes.size() + sizeof(uint32_t) * size;
+    }
 
-        /* Directly start working on left subtree */
-        recycle_as_child_of(c);
-        node_idx = node_idx_left;
-        end = start + left_count;
+private:
+    struct MortonPrimitive {
+        uint32_t code;  ///< 30-bit Morton code of the centroid
+        uint32_t index; ///< Primitive index
+    };
 
-        return this;
+    struct Cluster {
+        uint32_t start, end;              ///< Range in the sorted primitive array
+        uint32_t offset;                  ///< Index of the cluster root in the final node array
+        std::vector<BVH::BVHNode> nodes;  ///< Nodes of the cluster in depth-first order
+    };
+
+    /// Node of the top levels; leaves reference a cluster
+    struct UpperNode {
+        BoundingBox3f bbox;
+        uint32_t left, right, axis;
+        int32_t cluster;
+    };
+
+    /// Spread the lower 10 bits of \c x so that there are two zero bits between each
+    static uint32_t expandBits(uint32_t x) {
+        x = (x | (x << 16)) & 0x030000FF;
+        x = (x | (x <<  8)) & 0x0300F00F;
+        x = (x | (x <<  4)) & 0x030C30C3;
+        x = (x | (x <<  2)) & 0x09249249;
+        return x;
     }
 
-    /// Single-threaded build function
-    static void execute_serially(BVH &bvh, uint32_t node_idx, uint32_t *start, uint32_t *end, uint32_t *temp) {
-        BVH::BVHNode &node = bvh.m_nodes[node_idx];
-        uint32_t size = (uint32_t) (end - start);
-        float best_cost = (float) INTERSECTION_COST * size;
-        int64_t best_index = -1, best_axis = -1;
-        float *left_areas = (float *) temp;
-
-        /* Try splitting along every axis */
-        for (int axis=0; axis<3; ++axis) {
-            /* Sort all triangles based on their centroid positions projected on the axis */
-            std::sort(start, end, [&](uint32_t f1, uint32_t f2) {
-                return bvh.getCentroid(f1)[axis] < bvh.getCentroid(f2)[axis];
+    /// Stable parallel LSD radix sort by Morton code (returns the size of the temporary buffers)
+    static size_t radixSort(std::vector<MortonPrimitive> &prims) {
+        const uint32_t bucketCount = 1u << RADIX_BITS, size = (uint32_t) prims.size();
+        const uint32_t chunkSize = std::max((uint32_t) GRAIN_SIZE * 16, size / 64 + 1);
+        const uint32_t chunkCount = (size + chunkSize - 1) / chunkSize;
+
+        std::vector<MortonPrimitive> temp(size);
+        std::vector<uint32_t> offsets((size_t) chunkCount * bucketCount);
+
+        for (int shift = 0; shift < 3 * MORTON_BITS; shift += RADIX_BITS) {
+            /* Count the digits of every chunk */
+            std::fill(offsets.begin(), offsets.end(), 0u);
+            tbb::parallel_for(0u, chunkCount, [&](uint32_t chunk) {
+                uint32_t *counts = &offsets[(size_t) chunk * bucketCount];
+                for (uint32_t i = chunk * chunkSize; i < std::min(size, (chunk + 1) * chunkSize); ++i)
+                    counts[(prims[i].code >> shift) & (bucketCount - 1)]++;
             });
 
-            BoundingBox3f bbox;
-            for (uint32_t i = 0; i<size; ++i) {
-                uint32_t f = *(start + i);
-                bbox.expandBy(bvh.getBoundingBox(f));
-                left_areas[i] = (float) bbox.getSurfaceArea();
-            }
-            if (axis == 0)
-                node.bbox = bbox;
-
-            bbox.reset();
-
-            /* Choose the best split plane */
-            float tri_factor = INTERSECTION_COST / node.bbox.getSurfaceArea();
-            for (uint32_t i = size-1; i>=1; --i) {
-                uint32_t f = *(start + i);
-                bbox.expandBy(bvh.getBoundingBox(f));
-
-                float left_area = left_areas[i-1];
-                float right_area = bbox.getSurfaceArea();
-                uint32_t prims_left = i;
-                uint32_t prims_right = size-i;
-
-                float sah_cost = 2.0f * TRAVERSAL_COST +
-                    tri_factor * (prims_left * left_area +
-                                  prims_right * right_area);
-
-                if (sah_cost < best_cost) {
-                    best_cost = sah_cost;
-                    best_index = i;
-                    best_axis = axis;
+            /* Turn the counts into output offsets (bucket-major, so that the sort is stable) */
+            uint32_t sum = 0;
+            for (uint32_t bucket = 0; bucket < bucketCount; ++bucket) {
+                for (uint32_t chunk = 0; chunk < chunkCount; ++chunk) {
+                    uint32_t &offset = offsets[(size_t) chunk * bucketCount + bucket];
+                    uint32_t count = offset;
+                    offset = sum;
+                    sum += count;
                 }
             }
+
+            /* Scatter */
+            tbb::parallel_for(0u, chunkCount, [&](uint32_t chunk) {
+                uint32_t *counts = &offsets[(size_t) chunk * bucketCount];
+                for (uint32_t i = chunk * chunkSize; i < std::min(size, (chunk + 1) * chunkSize); ++i)
+                    temp[counts[(prims[i].code >> shift) & (bucketCount - 1)]++] = prims[i];
+            });
+            prims.swap(temp);
         }
 
-        if (best_index == -1) {
-            /* Splitting does not reduce the cost, make a leaf */
+        return sizeof(MortonPrimitive) * 2 * size + sizeof(uint32_t) * offsets.size();
+    }
+
+    /// Recursively emit the nodes for the sorted primitives <tt>[start, end)</tt>, splitting at Morton code bits
+    void emitLBVH(std::vector<BVH::BVHNode> &nodes, const MortonPrimitive *prims,
+                  uint32_t start, uint32_t end, int bit) const {
+        uint32_t node_idx = (uint32_t) nodes.size();
+        nodes.push_back(BVH::BVHNode());
+
+        if (end - start <= MAX_LEAF_SIZE) {
+            BoundingBox3f bbox;
+            for (uint32_t i = start; i < end; ++i)
+                bbox.expandBy(bvh.m_primitives->getBoundingBox(prims[i].index));
+            BVH::BVHNode &node = nodes[node_idx];
             node.leaf.flag = 1;
-            node.leaf.start = (uint32_t) (start - bvh.m_indices.data());
-            node.leaf.size  = size;
+            node.leaf.start = start;
+            node.leaf.size = end - start;
+            node.bbox = bbox;
             return;
         }
 
-        std::sort(start, end, [&](uint32_t f1, uint32_t f2) {
-            return bvh.getCentroid(f1)[best_axis] < bvh.getCentroid(f2)[best_axis];
-        });
+        /* Skip the bits that all primitives of the range have in common */
+        while (bit >= 0 && ((prims[start].code ^ prims[end - 1].code) & (1u << bit)) == 0)
+            --bit;
+
+        uint32_t split, axis;
+        if (bit >= 0) {
+            /* The codes are sorted: find the first one with the bit set */
+            uint32_t mask = 1u << bit;
+            split = (uint32_t) (std::partition_point(prims + start, prims + end,
+                [mask](const MortonPrimitive &p) { return (p.code & mask) == 0; }) - prims);
+            axis = 2 - bit % 3;
+        } else {
+            /* Identical codes: split in the middle */
+            split = start + (end - start) / 2;
+            axis = 0;
+        }
+
+        emitLBVH(nodes, prims, start, split, bit - 1);
+        uint32_t right_idx = (uint32_t) nodes.size();
+        emitLBVH(nodes, prims, split, end, bit - 1);
 
-        uint32_t left_count = (uint32_t) best_index;
-        uint32_t node_idx_left = node_idx + 1;
-        uint32_t node_idx_right = node_idx + 2 * left_count;
-        node.inner.rightChild = node_idx_right;
-        node.inner.axis = best_axis;
+        BVH::BVHNode &node = nodes[node_idx];
         node.inner.flag = 0;
+        node.inner.axis = axis;
+        node.inner.rightChild = right_idx;
+        node.bbox = BoundingBox3f::merge(nodes[node_idx + 1].bbox, nodes[right_idx].bbox);
+    }
+
+    /// Recursively build the top levels over the given clusters using binned SAH (returns the node index)
+    static uint32_t buildUpper(std::vector<UpperNode> &upper, const std::vector<Cluster> &clusters,
+                               uint32_t *ids, uint32_t count) {
+        uint32_t node_idx = (uint32_t) upper.size();
+        upper.push_back(UpperNode());
+
+        if (count == 1) {
+            const Cluster &cluster = clusters[ids[0]];
+            upper[node_idx].cluster = (int32_t) ids[0];
+            upper[node_idx].bbox = cluster.nodes[0].bbox;
+            return node_idx;
+        }
+
+        BoundingBox3f centroidBounds;
+        for (uint32_t i = 0; i < count; ++i)
+            centroidBounds.expandBy(clusters[ids[i]].nodes[0].bbox.getCenter());
+        int axis = centroidBounds.getLargestAxis();
+        float min = centroidBounds.min[axis], extent = centroidBounds.max[axis] - min;
+
+        uint32_t mid = count / 2;
+        if (extent > 0) {
+            auto bucketOf = [&](uint32_t id) {
+                float pos = (clusters[id].nodes[0].bbox.getCenter()[axis] - min) / extent;
+                return std::min((int) (pos * SAH_BUCKETS), SAH_BUCKETS - 1);
+            };
+
+            /* Weight the buckets by their number of primitives */
+            uint32_t bucketPrims[SAH_BUCKETS] = { 0 };
+            BoundingBox3f bucketBounds[SAH_BUCKETS];
+            for (uint32_t i = 0; i < count; ++i) {
+                const Cluster &cluster = clusters[ids[i]];
+                int bucket = bucketOf(ids[i]);
+                bucketPrims[bucket] += cluster.end - cluster.start;
+                bucketBounds[bucket].expandBy(cluster.nodes[0].bbox);
+            }
+
+            int bestSplit = -1;
+            float bestCost = std::numeric_limits<float>::infinity();
+            for (int split = 0; split < SAH_BUCKETS - 1; ++split) {
+                BoundingBox3f left, right;
+                uint32_t primsLeft = 0, primsRight = 0;
+                for (int i = 0; i <= split; ++i) {
+                    left.expandBy(bucketBounds[i]);
+                    primsLeft += bucketPrims[i];
+                }
+                for (int i = split + 1; i < SAH_BUCKETS; ++i) {
+                    right.expandBy(bucketBounds[i]);
+                    primsRight += bucketPrims[i];
+                }
+                if (primsLeft == 0 || primsRight == 0)
+                    continue;
+                float cost = primsLeft * left.getSurfaceArea() + primsRight * right.getSurfaceArea();
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestSplit = split;
+                }
+            }
+
+            if (bestSplit != -1)
+                mid = (uint32_t) (std::partition(ids, ids + count,
+                    [&](uint32_t id) { return bucketOf(id) <= bestSplit; }) - ids);
+        }
+
+        uint32_t left = buildUpper(upper, clusters, ids, mid);
+        uint32_t right = buildUpper(upper, clusters, ids + mid, count - mid);
 
-        execute_serially(bvh, node_idx_left, start, start + left_count, temp);
-        execute_serially(bvh, node_idx_right, start+left_count, end, temp + left_count);
+        UpperNode &node = upper[node_idx];
+        node.cluster = -1;
+        node.left = left;
+        node.right = right;
+        node.axis = (uint32_t) axis;
+        node.bbox = BoundingBox3f::merge(upper[left].bbox, upper[right].bbox);
+        return node_idx;
     }
-};
 
-void BVH::addShape(Shape *shape) {
-    m_shapes.push_back(shape);
-    m_shapeOffset.push_back(m_shapeOffset.back() + shape->getPrimitiveCount());
-    m_bbox.expandBy(shape->getBoundingBox());
-}
+    /// Emit the top levels in depth-first order and reserve space for the clusters
+    static void flattenUpper(const std::vector<UpperNode> &upper, uint32_t upper_idx,
+                             std::vector<Cluster> &clusters, std::vector<BVH::BVHNode> &nodes) {
+        const UpperNode &node = upper[upper_idx];
+        if (node.cluster >= 0) {
+            Cluster &cluster = clusters[node.cluster];
+            cluster.offset = (uint32_t) nodes.size();
+            nodes.resize(nodes.size() + cluster.nodes.size());
+            return;
+        }
 
-void BVH::clear() {
-    for (auto shape : m_shapes)
-        delete shape;
-    m_shapes.clear();
-    m_shapeOffset.clear();
-    m_shapeOffset.push_back(0u);
-    m_nodes.clear();
-    m_indices.clear();
-    m_bbox.reset();
-    m_nodes.shrink_to_fit();
-    m_shapes.shrink_to_fit();
-    m_shapeOffset.shrink_to_fit();
-    m_indices.shrink_to_fit();
-}
+        uint32_t node_idx = (uint32_t) nodes.size();
+        nodes.push_back(BVH::BVHNode());
 
-void BVH::build() {
-    uint32_t size  = getPrimitiveCount();
-    if (size == 0)
-        return;
-    cout << "Constructing a SAH BVH (" << m_shapes.size()
-        << (m_shapes.size() == 1 ? " shape, " : " shapes, ")
-        << size << " primitives) .. ";
-    cout.flush();
-    Timer timer;
+        flattenUpper(upper, node.left, clusters, nodes);
+        uint32_t right_idx = (uint32_t) nodes.size();
+        flattenUpper(upper, node.right, clusters, nodes);
 
-    /* Conservative estimate for the total number of nodes */
-    m_nodes.resize(2*size);
-    memset(m_nodes.data(), 0, sizeof(BVHNode) * m_nodes.size());
-    m_nodes[0].bbox = m_bbox;
-    m_indices.resize(size);
+        BVH::BVHNode &inner = nodes[node_idx];
+        inner.inner.flag = 0;
+        inner.inner.axis = node.axis;
+        inner.inner.rightChild = right_idx;
+        inner.bbox = node.bbox;
+    }
 
-    if (sizeof(BVHNode) != 32)
-        throw NoriException("BVH Node is not packed! Investigate compiler settings.");
+private:
+    BVH &bvh;
+};
 
-    for (uint32_t i = 0; i < size; ++i)
-        m_indices[i] = i;
+/**
+ * \brief Spatial split BVH builder (SBVH)
+ *
+ * Long, thin or diagonal triangles lead to heavily overlapping nodes when
+ * primitives can only be partitioned as a whole. In addition to the binned
+ * object splits of \ref BVHBuildTask, this builder considers spatial
+ * splits, which cut the node with an axis-aligned plane and send
+ * the straddling primitives to both children with clipped bounds (so
+ * leaves may reference a primitive several times). Spatial splits are
+ * only considered while the children of the best object split overlap
+ * noticeably, and only as long as the budget of duplicated references
+ * is not used up.
+ *
+ * The method is described in
+ *
+ * "Spatial Splits in Bounding Volume Hierarchies" by Martin Stich,
+ * Heiko Friedrich and Andreas Dietrich (Proc. High Performance
+ * Graphics 2009)
+ */
+class SBVHBuilder {
+public:
+    /// Build-related parameters
+    enum {
+        /// Number of bins used to find object splits
+        OBJECT_BINS = 16,
 
-    uint32_t *indices = m_indices.data(), *temp = new uint32_t[size];
-    BVHBuildTask& task = *new(tbb::task::allocate_root())
-        BVHBuildTask(*this, 0u, indices, indices + size , temp);
-    tbb::task::spawn_root_and_wait(task);
-    delete[] temp;
-    std::pair<float, uint32_t> stats = statistics();
+        /// Number of bins used to find spatial splits
+        SPATIAL_BINS = 32,
 
-    /* The node array was allocated conservatively and now contains
-       many unused entries -- do a compactification pass. */
-    std::vector<BVHNode> compactified(stats.second);
-    std::vector<uint32_t> skipped_accum(m_nodes.size());
+        /// Build the two subtrees of larger nodes in parallel
+        PARALLEL_THRESHOLD = 4096,
 
-    for (int64_t i = stats.second-1, j = m_nodes.size(), skipped = 0; i >= 0; --i) {
-        while (m_nodes[--j].isUnused())
-            skipped++;
-        BVHNode &new_node = compactified[i];
-        new_node = m_nodes[j];
-        skipped_accum[j] = (uint32_t) skipped;
+        /// No spatial splits below this depth
+        MAX_SPATIAL_DEPTH = 48
+    };
 
-        if (new_node.isInner()) {
-            new_node.inner.rightChild = (uint32_t)
-                (i + new_node.inner.rightChild - j -
-                (skipped - skipped_accum[new_node.inner.rightChild]));
-        }
+    /**
+     * \param budget
+     *    Maximum number of duplicated references as a fraction
+     *    of the number of primitives
+     */
+    SBVHBuilder(BVH &bvh, float budget) : bvh(bvh) {
+        m_remaining = (int64_t) (budget * bvh.getPrimitiveCount());
     }
-    cout << "done (took " << timer.elapsedString() << " and "
-        << memString(sizeof(BVHNode) * m_nodes.size() + sizeof(uint32_t)*m_indices.size())
-        << ", SAH cost = " << stats.first
-        << ")." << endl;
 
-    m_nodes = std::move(compactified);
-}
+    /// Build the node and index arrays of the BVH and return the peak memory usage
+    size_t build() {
+        uint32_t size = bvh.getPrimitiveCount();
+        const BVH::BVHPrimitiveData &data = *bvh.m_primitives;
 
-std::pair<float, uint32_t> BVH::statistics(uint32_t node_idx) const {
-    const BVHNode &node = m_nodes[node_idx];
-    if (node.isLeaf()) {
-        return std::make_pair((float) BVHBuildTask::INTERSECTION_COST * node.leaf.size, 1u);
-    } else {
-        std::pair<float, uint32_t> stats_left = statistics(node_idx + 1u);
-        std::pair<float, uint32_t> stats_right = statistics(node.inner.rightChild);
-        float saLeft = m_nodes[node_idx + 1u].bbox.getSurfaceArea();
-        float saRight = m_nodes[node.inner.rightChild].bbox.getSurfaceArea();
-        float saCur = node.bbox.getSurfaceArea();
-        float sahCost =
-            2 * BVHBuildTask::TRAVERSAL_COST +
-            (saLeft * stats_left.first + saRight * stats_right.first) / saCur;
-        return std::make_pair(
-            sahCost,
-            stats_left.second + stats_right.second + 1u
+        /* Fetch the vertices of all triangles, which are needed for clipping */
+        m_vertices.resize(3 * (size_t) size);
+        m_isTriangle.resize(size);
+        std::vector<Reference> refs(size);
+        tbb::parallel_for(
+            tbb::blocked_range<uint32_t>(0u, bvh.getShapeCount()),
+            [&](const tbb::blocked_range<uint32_t> &shapes) {
+                for (uint32_t s = shapes.begin(); s != shapes.end(); ++s) {
+                    const Shape *shape = bvh.m_shapes[s];
+                    for (uint32_t f = bvh.m_shapeOffset[s]; f < bvh.m_shapeOffset[s + 1]; ++f) {
+                        m_isTriangle[f] = shape->getTriangle(f - bvh.m_shapeOffset[s],
+                            m_vertices[3 * f], m_vertices[3 * f + 1], m_vertices[3 * f + 2]);
+                        refs[f].prim = f;
+                        refs[f].bbox = data.getBoundingBox(f);
+                    }
+                }
+            }
         );
+
+        m_rootArea = bvh.m_bbox.getSurfaceArea();
+        int64_t budget = m_remaining;
+
+        Subtree tree;
+        buildNode(refs, 0, tree);
+
+        bvh.m_nodes = std::move(tree.nodes);
+        bvh.m_indices = std::move(tree.indices);
+        m_duplicates = (uint32_t) (budget - std::max(m_remaining.load(), (int64_t) 0));
+        m_vertices.clear();
+        m_vertices.shrink_to_fit();
+
+        return sizeof(BVH::BVHNode) * bvh.m_nodes.size() + sizeof(uint32_t) * bvh.m_indices.size()
+            + (sizeof(Reference) + 3 * sizeof(Point3f) + 1) * size;
     }
-}
 
-bool BVH::rayIntersect(const Ray3f &_ray, Intersection &its, bool shadowRay) const {
-    uint32_t node_idx = 0, stack_idx = 0, stack[64];
+    /// Return the number of references that were duplicated by spatial splits
+    uint32_t getDuplicateCount() const { return m_duplicates; }
 
-    its.t = std::numeric_limits<float>::infinity();
+private:
+    /// Reference to a primitive or to the part of it within \c bbox
+    struct Reference {
+        BoundingBox3f bbox;
+        uint32_t prim;
+    };
 
-    /* Use an adaptive ray epsilon */
-    Ray3f ray(_ray);
-    if (ray.mint == Epsilon)
-        ray.mint = std::max(ray.mint, ray.mint * ray.o.array().abs().maxCoeff());
+    /// Nodes and leaf indices of a subtree in depth-first order
+    struct Subtree {
+        std::vector<BVH::BVHNode> nodes;
+        std::vector<uint32_t> indices;
+    };
 
-    if (m_nodes.empty() || ray.maxt < ray.mint)
-        return false;
+    struct Split {
+        float cost = std::numeric_limits<float>::infinity();
+        int axis = -1, bin = -1;
+        float pos = 0;
+        BoundingBox3f leftBbox, rightBbox;
+    };
 
-    bool foundIntersection = false;
-    uint32_t f = 0;
+    /// Recursively build the subtree over the given references and append it to \c out
+    void buildNode(std::vector<Reference> &refs, int depth, Subtree &out) {
+        uint32_t size = (uint32_t) refs.size();
+        uint32_t node_idx = (uint32_t) out.nodes.size();
+        out.nodes.push_back(BVH::BVHNode());
 
-    while (true) {
-        const BVHNode &node = m_nodes[node_idx];
+        BoundingBox3f bbox, centroidBbox;
+        for (const Reference &ref : refs) {
+            bbox.expandBy(ref.bbox);
+            centroidBbox.expandBy(ref.bbox.getCenter());
+        }
+        out.nodes[node_idx].bbox = bbox;
+
+        /* Find the best object split, and a spatial split if the children would overlap */
+        Split objectSplit = findObjectSplit(refs, bbox, centroidBbox);
+        Split spatialSplit;
+        if (depth < MAX_SPATIAL_DEPTH && m_remaining > 0) {
+            BoundingBox3f overlap = objectSplit.leftBbox;
+            overlap.clip(objectSplit.rightBbox);
+            if (objectSplit.axis == -1 || (overlap.isValid() &&
+                    overlap.getSurfaceArea() > SPATIAL_SPLIT_ALPHA * m_rootArea))
+                spatialSplit = findSpatialSplit(refs, bbox);
+        }
 
-        if (!node.bbox.rayIntersect(ray)) {
-            if (stack_idx == 0)
-                break;
-            node_idx = stack[--stack_idx];
-            continue;
+        std::vector<Reference> left, right;
+        float leafCost = (float) BVHBuildTask::INTERSECTION_COST * size;
+        int axis = spatialSplit.axis;
+        if (spatialSplit.cost < objectSplit.cost && spatialSplit.cost < leafCost)
+            performSpatialSplit(refs, spatialSplit, left, right);
+        if (left.empty() && objectSplit.cost < leafCost) {
+            performObjectSplit(refs, objectSplit, centroidBbox, left, right);
+            axis = objectSplit.axis;
         }
 
-        if (node.isInner()) {
-            stack[stack_idx++] = node.inner.rightChild;
-            node_idx++;
-            assert(stack_idx<64);
+        if ((left.empty() || right.empty()) && size > BVHBuildTask::MAX_LEAF_SIZE) {
+            /* Don't create large leaves (e.g. for clustered centroids once the
+               split budget is used up), fall back to a median split */
+            axis = centroidBbox.getMajorAxis();
+            std::nth_element(refs.begin(), refs.begin() + size / 2, refs.end(),
+                [axis](const Reference &r1, const Reference &r2) {
+                    return r1.bbox.getCenter()[axis] < r2.bbox.getCenter()[axis];
+                });
+            left.assign(refs.begin(), refs.begin() + size / 2);
+            right.assign(refs.begin() + size / 2, refs.end());
+        }
+
+        if (left.empty() || right.empty()) {
+            /* Splitting does not reduce the cost, make a leaf */
+            BVH::BVHNode &node = out.nodes[node_idx];
+            node.leaf.flag = 1;
+            node.leaf.start = (uint32_t) out.indices.size();
+            node.leaf.size = size;
+            for (const Reference &ref : refs)
+                out.indices.push_back(ref.prim);
+            return;
+        }
+
+        std::vector<Reference>().swap(refs);
+
+        uint32_t right_idx;
+        if (left.size() + right.size() > PARALLEL_THRESHOLD) {
+            /* Build both subtrees in parallel and append them afterwards */
+            Subtree leftTree, rightTree;
+            tbb::parallel_invoke(
+                [&] { buildNode(left, depth + 1, leftTree); },
+                [&] { buildNode(right, depth + 1, rightTree); }
+            );
+            append(out, leftTree);
+            right_idx = (uint32_t) out.nodes.size();
+            append(out, rightTree);
         } else {
-            for (uint32_t i = node.start(), end = node.end(); i < end; ++i) {
-                uint32_t idx = m_indices[i];
-                const Shape *shape = m_shapes[findShape(idx)];
+            buildNode(left, depth + 1, out);
+            right_idx = (uint32_t) out.nodes.size();
+            buildNode(right, depth + 1, out);
+        }
 
-                float u, v, t;
-                if (shape->rayIntersect(idx, ray, u, v, t)) {
-                    if (shadowRay)
-                        return true;
-                    foundIntersection = true;
-                    ray.maxt = its.t = t;
-                    its.uv = Point2f(u, v);
-                    its.mesh = shape;
-                    f = idx;
+        BVH::BVHNode &node = out.nodes[node_idx];
+        node.inner.flag = 0;
+        node.inner.axis = axis;
+        node.inner.rightChild = right_idx;
+    }
+
+    /// Append a subtree that was built separately
+    static void append(Subtree &out, Subtree &subtree) {
+        uint32_t nodeOffset = (uint32_t) out.nodes.size(), indexOffset = (uint32_t) out.indices.size();
+        for (BVH::BVHNode node : subtree.nodes) {
+            if (node.isInner())
+                node.inner.rightChild += nodeOffset;
+            else
+                node.leaf.start += indexOffset;
+            out.nodes.push_back(node);
+        }
+        out.indices.insert(out.indices.end(), subtree.indices.begin(), subtree.indices.end());
+        std::vector<BVH::BVHNode>().swap(subtree.nodes);
+        std::vector<uint32_t>().swap(subtree.indices);
+    }
+
+    /// SAH cost of a split relative to the leaf cost of the parent
+    static float splitCost(const BoundingBox3f &bbox, uint32_t countLeft, const BoundingBox3f &left,
+                           uint32_t countRight, const BoundingBox3f &right) {
+        return 2.0f * BVHBuildTask::TRAVERSAL_COST + BVHBuildTask::INTERSECTION_COST *
+            (countLeft * left.getSurfaceArea() + countRight * right.getSurfaceArea()) / bbox.getSurfaceArea();
+    }
+
+    static int objectBin(const Reference &ref, int axis, float min, float invBinSize) {
+        return std::min(std::max((int) ((ref.bbox.getCenter()[axis] - min) * invBinSize), 0),
+                        (int) OBJECT_BINS - 1);
+    }
+
+    /// Binned SAH over the reference centroids on all three axes
+    static Split findObjectSplit(const std::vector<Reference> &refs, const BoundingBox3f &bbox,
+                                 const BoundingBox3f &centroidBbox) {
+        Split best;
+        for (int axis = 0; axis < 3; ++axis) {
+            float min = centroidBbox.min[axis], extent = centroidBbox.max[axis] - min;
+            if (!(extent > 0))
+                continue;
+            float invBinSize = OBJECT_BINS / extent;
+
+            uint32_t counts[OBJECT_BINS] = { 0 };
+            BoundingBox3f bounds[OBJECT_BINS];
+            for (const Reference &ref : refs) {
+                int bin = objectBin(ref, axis, min, invBinSize);
+                counts[bin]++;
+                bounds[bin].expandBy(ref.bbox);
+            }
+
+            evaluateSplits(axis, counts, counts, bounds, OBJECT_BINS, bbox, best);
+        }
+        return best;
+    }
+
+    /**
+     * \brief Sweep over the bins and update \c best with the cheapest split plane
+     *
+     * \c enter and \c exit count the references that start and end in each bin
+     * (they are identical for object splits).
+     */
+    static void evaluateSplits(int axis, const uint32_t *enter, const uint32_t *exit,
+                               const BoundingBox3f *bounds, int binCount,
+                               const BoundingBox3f &bbox, Split &best) {
+        std::vector<BoundingBox3f> rightBounds(binCount);
+        std::vector<uint32_t> rightCounts(binCount);
+        BoundingBox3f right;
+        uint32_t countRight = 0;
+        for (int i = binCount - 1; i > 0; --i) {
+            right.expandBy(bounds[i]);
+            countRight += exit[i];
+            rightBounds[i] = right;
+            rightCounts[i] = countRight;
+        }
+
+        BoundingBox3f left;
+        uint32_t countLeft = 0;
+        for (int i = 0; i < binCount - 1; ++i) {
+            left.expandBy(bounds[i]);
+            countLeft += enter[i];
+            if (countLeft == 0 || rightCounts[i + 1] == 0)
+                continue;
+            float cost = splitCost(bbox, countLeft, left, rightCounts[i + 1], rightBounds[i + 1]);
+            if (cost < best.cost) {
+                best.cost = cost;
+                best.axis = axis;
+                best.bin = i;
+                best.leftBbox = left;
+                best.rightBbox = rightBounds[i + 1];
+            }
+        }
+    }
+
+    /// Binned spatial split search: the references are chopped into the bins they overlap
+    Split findSpatialSplit(const std::vector<Reference> &refs, const BoundingBox3f &bbox) const {
+        Split best;
+        for (int axis = 0; axis < 3; ++axis) {
+            float min = bbox.min[axis], extent = bbox.max[axis] - min;
+            if (!(extent > 0))
+                continue;
+            float binSize = extent / SPATIAL_BINS, invBinSize = SPATIAL_BINS / extent;
+            auto binOf = [&](float pos) {
+                return std::min(std::max((int) ((pos - min) * invBinSize), 0), (int) SPATIAL_BINS - 1);
+            };
+
+            uint32_t enter[SPATIAL_BINS] = { 0 }, exit[SPATIAL_BINS] = { 0 };
+            BoundingBox3f bounds[SPATIAL_BINS];
+            for (const Reference &ref : refs) {
+                int first = binOf(ref.bbox.min[axis]), last = binOf(ref.bbox.max[axis]);
+                Reference rest = ref;
+                for (int bin = first; bin < last; ++bin) {
+                    Reference leftPart, rightPart;
+                    splitReference(rest, axis, min + (bin + 1) * binSize, leftPart, rightPart);
+                    bounds[bin].expandBy(leftPart.bbox);
+                    rest = rightPart;
+                }
+                bounds[last].expandBy(rest.bbox);
+                enter[first]++;
+                exit[last]++;
+            }
+
+            Split split;
+            evaluateSplits(axis, enter, exit, bounds, SPATIAL_BINS, bbox, split);
+            if (split.cost < best.cost) {
+                best = split;
+                best.pos = min + (split.bin + 1) * binSize;
+            }
+        }
+        return best;
+    }
+
+    /// Clip a reference against the plane <tt>x[axis] = pos</tt>
+    void splitReference(const Reference &ref, int axis, float pos,
+                        Reference &left, Reference &right) const {
+        left.prim = right.prim = ref.prim;
+        left.bbox.reset();
+        right.bbox.reset();
+
+        if (m_isTriangle[ref.prim]) {
+            /* Clip the edges of the triangle against the plane */
+            const Point3f *v = &m_vertices[3 * (size_t) ref.prim];
+            for (int i = 0; i < 3; ++i) {
+                const Point3f &v0 = v[i], &v1 = v[(i + 1) % 3];
+                if (v0[axis] <= pos)
+                    left.bbox.expandBy(v0);
+                if (v0[axis] >= pos)
+                    right.bbox.expandBy(v0);
+                if ((v0[axis] < pos && v1[axis] > pos) || (v0[axis] > pos && v1[axis] < pos)) {
+                    float t = (pos - v0[axis]) / (v1[axis] - v0[axis]);
+                    Point3f p = v0 + t * (v1 - v0);
+                    p[axis] = pos;
+                    left.bbox.expandBy(p);
+                    right.bbox.expandBy(p);
+                }
+            }
+        } else {
+            /* Other primitives: just split the bounding box */
+            left.bbox = right.bbox = ref.bbox;
+            left.bbox.max[axis] = pos;
+            right.bbox.min[axis] = pos;
+        }
+
+        /* The reference may already have been clipped before */
+        left.bbox.clip(ref.bbox);
+        right.bbox.clip(ref.bbox);
+    }
+
+    void performSpatialSplit(const std::vector<Reference> &refs, const Split &split,
+                             std::vector<Reference> &left, std::vector<Reference> &right) {
+        int axis = split.axis;
+        uint32_t countLeft = 0, countRight = 0, straddling = 0;
+        for (const Reference &ref : refs) {
+            if (ref.bbox.max[axis] <= split.pos)
+                countLeft++;
+            else if (ref.bbox.min[axis] >= split.pos)
+                countRight++;
+            else
+                straddling++;
+        }
+
+        /* Reserve the duplicated references from the budget */
+        if (m_remaining.fetch_sub(straddling) < (int64_t) straddling) {
+            m_remaining.fetch_add(straddling);
+            return;
+        }
+        countLeft += straddling;
+        countRight += straddling;
+
+        BoundingBox3f leftBbox = split.leftBbox, rightBbox = split.rightBbox;
+        uint32_t duplicates = 0;
+        for (const Reference &ref : refs) {
+            if (ref.bbox.max[axis] <= split.pos) {
+                left.push_back(ref);
+                continue;
+            } else if (ref.bbox.min[axis] >= split.pos) {
+                right.push_back(ref);
+                continue;
+            }
+
+            /* Reference unsplitting: put the whole primitive into one child
+               if that is cheaper than referencing it from both */
+            float leftArea = leftBbox.getSurfaceArea(), rightArea = rightBbox.getSurfaceArea();
+            BoundingBox3f leftUnsplit = BoundingBox3f::merge(leftBbox, ref.bbox);
+            BoundingBox3f rightUnsplit = BoundingBox3f::merge(rightBbox, ref.bbox);
+            float splitCost = leftArea * countLeft + rightArea * countRight;
+            float leftCost = leftUnsplit.getSurfaceArea() * countLeft + rightArea * (countRight - 1);
+            float rightCost = leftArea * (countLeft - 1) + rightUnsplit.getSurfaceArea() * countRight;
+
+            Reference leftPart, rightPart;
+            if (splitCost < leftCost && splitCost < rightCost)
+                splitReference(ref, axis, split.pos, leftPart, rightPart);
+
+            if (leftPart.bbox.isValid() && rightPart.bbox.isValid()) {
+                left.push_back(leftPart);
+                right.push_back(rightPart);
+                duplicates++;
+            } else if (leftCost <= rightCost) {
+                left.push_back(ref);
+                leftBbox = leftUnsplit;
+                countRight--;
+            } else {
+                right.push_back(ref);
+                rightBbox = rightUnsplit;
+                countLeft--;
+            }
+        }
+        m_remaining.fetch_add(straddling - duplicates);
+
+        if (left.empty() || right.empty()) {
+            m_remaining.fetch_add(duplicates);
+            left.clear();
+            right.clear();
+        }
+    }
+
+    static void performObjectSplit(const std::vector<Reference> &refs, const Split &split,
+                                   const BoundingBox3f &centroidBbox,
+                                   std::vector<Reference> &left, std::vector<Reference> &right) {
+        float min = centroidBbox.min[split.axis];
+        float invBinSize = OBJECT_BINS / (centroidBbox.max[split.axis] - min);
+        for (const Reference &ref : refs)
+            (objectBin(ref, split.axis, min, invBinSize) <= split.bin ? left : right).push_back(ref);
+    }
+
+private:
+    /// Only try spatial splits if the children of the object split overlap by this fraction of the root area
+    static constexpr float SPATIAL_SPLIT_ALPHA = 1e-5f;
+
+    BVH &bvh;
+    std::vector<Point3f> m_vertices;  ///< Triangle vertices of all primitives
+    std::vector<uint8_t> m_isTriangle;
+    float m_rootArea = 0;
+    std::atomic<int64_t> m_remaining; ///< Remaining budget of duplicated references
+    uint32_t m_duplicates = 0;
+};
+
+void BVH::addShape(Shape *shape) {
+    m_shapes.push_back(shape);
+    m_shapeOffset.push_back(m_shapeOffset.back() + shape->getPrimitiveCount());
+    m_bbox.expandBy(shape->getBoundingBox());
+}
+
+void BVH::setWidth(int width) {
+    if (width != 2 && width != 4 && width != 8)
+        throw NoriException("BVH: unsupported width %i (must be 2, 4 or 8)", width);
+    m_width = width;
+}
+
+void BVH::clear() {
+    for (auto shape : m_shapes)
+        delete shape;
+    m_shapes.clear();
+    m_shapeOffset.clear();
+    m_shapeOffset.push_back(0u);
+    m_nodes.clear();
+    m_nodes4.clear();
+    m_nodes8.clear();
+    m_compressed4.clear();
+    m_compressed8.clear();
+    m_blocks4.clear();
+    m_blocks8.clear();
+    m_indices.clear();
+    m_bbox.reset();
+    m_nodeData = nullptr;
+    m_wideNodeData = m_blockData = nullptr;
+    m_blockCount = 0;
+    m_cacheEntry.reset();
+    m_nodes.shrink_to_fit();
+    m_nodes4.shrink_to_fit();
+    m_nodes8.shrink_to_fit();
+    m_compressed4.shrink_to_fit();
+    m_compressed8.shrink_to_fit();
+    m_blocks4.shrink_to_fit();
+    m_blocks8.shrink_to_fit();
+    m_shapes.shrink_to_fit();
+    m_shapeOffset.shrink_to_fit();
+    m_indices.shrink_to_fit();
+}
+
+void BVH::computePrimitiveData() {
+    uint32_t size = getPrimitiveCount();
+    m_primitives.reset(new BVHPrimitiveData());
+    BVHPrimitiveData &data = *m_primitives;
+    for (int axis = 0; axis < 3; ++axis) {
+        data.centroid[axis].resize(size);
+        data.min[axis].resize(size);
+        data.max[axis].resize(size);
+    }
+
+    /* Process the shapes one after the other, so that no shape has to be looked up per primitive */
+    data.centroidBbox = tbb::parallel_reduce(
+        tbb::blocked_range<uint32_t>(0u, getShapeCount()),
+        BoundingBox3f(),
+        [&](const tbb::blocked_range<uint32_t> &shapes, BoundingBox3f result) {
+            for (uint32_t s = shapes.begin(); s != shapes.end(); ++s) {
+                const Shape *shape = m_shapes[s];
+                result.expandBy(tbb::parallel_reduce(
+                    tbb::blocked_range<uint32_t>(m_shapeOffset[s], m_shapeOffset[s + 1], BVHBuildTask::GRAIN_SIZE),
+                    BoundingBox3f(),
+                    [&](const tbb::blocked_range<uint32_t> &range, BoundingBox3f bounds) {
+                        for (uint32_t f = range.begin(); f != range.end(); ++f) {
+                            uint32_t idx = f - m_shapeOffset[s];
+                            Point3f centroid = shape->getCentroid(idx);
+                            BoundingBox3f bbox = shape->getBoundingBox(idx);
+                            for (int axis = 0; axis < 3; ++axis) {
+                                data.centroid[axis][f] = centroid[axis];
+                                data.min[axis][f] = bbox.min[axis];
+                                data.max[axis][f] = bbox.max[axis];
+                            }
+                            bounds.expandBy(centroid);
+                        }
+                        return bounds;
+                    },
+                    [](const BoundingBox3f &b1, const BoundingBox3f &b2) {
+                        return BoundingBox3f::merge(b1, b2);
+                    }
+                ));
+            }
+            return result;
+        },
+        [](const BoundingBox3f &b1, const BoundingBox3f &b2) {
+            return BoundingBox3f::merge(b1, b2);
+        }
+    );
+}
+
+void BVH::setBuilder(const std::string &builder) {
+    if (builder == "sah")
+        m_builder = ESAH;
+    else if (builder == "hlbvh")
+        m_builder = EHLBVH;
+    else if (builder == "sbvh")
+        m_builder = ESBVH;
+    else
+        throw NoriException("BVH: unknown builder \"%s\" (must be \"sah\", \"hlbvh\" or \"sbvh\")", builder);
+}
+
+void BVH::setSplitBudget(float budget) {
+    if (!(budget >= 0))
+        throw NoriException("BVH: the spatial split budget must be nonnegative!");
+    m_splitBudget = budget;
+}
+
+void BVH::setRebuildThreshold(float threshold) {
+    if (!(threshold >= 1))
+        throw NoriException("BVH: the rebuild threshold must be at least 1!");
+    m_rebuildThreshold = threshold;
+}
+
+void BVH::buildSAH() {
+    uint32_t size = getPrimitiveCount();
+    cout << "Constructing a SAH BVH (" << m_shapes.size()
+        << (m_shapes.size() == 1 ? " shape, " : " shapes, ")
+        << size << " primitives) .. ";
+    cout.flush();
+    Timer timer;
+
+    m_nodes.clear();
+    m_indices.resize(size);
+
+    for (uint32_t i = 0; i < size; ++i)
+        m_indices[i] = i;
+
+    uint32_t *indices = m_indices.data(), *temp = new uint32_t[size];
+    BVHBuildTask& task = *new(tbb::task::allocate_root())
+        BVHBuildTask(*this, &m_nodes, m_bbox, indices, indices + size, temp,
+                     m_primitives->centroidBbox);
+    tbb::task::spawn_root_and_wait(task);
+    delete[] temp;
+    size_t memory = sizeof(BVHNode) * m_nodes.capacity() + 2 * sizeof(uint32_t) * size;
+    m_nodes.shrink_to_fit();
+    std::pair<float, uint32_t> stats = statistics();
+
+    cout << "done (took " << timer.elapsedString() << " and "
+        << memString(memory) << ", SAH cost = " << stats.first
+        << ")." << endl;
+}
+
+void BVH::buildHLBVH() {
+    cout << "Constructing an HLBVH (" << m_shapes.size()
+        << (m_shapes.size() == 1 ? " shape, " : " shapes, ")
+        << getPrimitiveCount() << " primitives) .. ";
+    cout.flush();
+    Timer timer;
+
+    HLBVHBuilder builder(*this);
+    size_t memory = builder.build();
+    std::pair<float, uint32_t> stats = statistics();
+
+    cout << "done (took " << timer.elapsedString() << " and "
+        << memString(memory) << ", SAH cost = " << stats.first
+        << ")." << endl;
+}
+
+void BVH::buildSBVH() {
+    cout << "Constructing an SBVH (" << m_shapes.size()
+        << (m_shapes.size() == 1 ? " shape, " : " shapes, ")
+        << getPrimitiveCount() << " primitives) .. ";
+    cout.flush();
+    Timer timer;
+
+    SBVHBuilder builder(*this, m_splitBudget);
+    size_t memory = builder.build();
+    std::pair<float, uint32_t> stats = statistics();
+
+    cout << "done (took " << timer.elapsedString() << " and "
+        << memString(memory) << ", SAH cost = " << stats.first
+        << ", " << builder.getDuplicateCount() << " duplicated references)." << endl;
+}
+
+void BVH::build() {
+    uint32_t size  = getPrimitiveCount();
+    if (size == 0)
+        return;
+
+    if (sizeof(BVHNode) != 32)
+        throw NoriException("BVH Node is not packed! Investigate compiler settings.");
+    if (m_compressed && m_width == 2)
+        throw NoriException("BVH: compressed nodes require a width of 4 or 8!");
+
+    /* The tree may be rebuilt (e.g. after instances have moved), so start
+       from scratch and recompute the bounds of the shapes */
+    m_nodes.clear();
+    m_nodes4.clear();
+    m_nodes8.clear();
+    m_compressed4.clear();
+    m_compressed8.clear();
+    m_nodeData = nullptr;
+    m_wideNodeData = m_blockData = nullptr;
+    m_blockCount = 0;
+    m_cacheEntry.reset();
+    m_bbox.reset();
+    for (const Shape *shape : m_shapes)
+        m_bbox.expandBy(shape->getBoundingBox());
+
+    /* Use the tree from a previous run if nothing has changed since */
+    Timer timer;
+    uint64_t key = 0;
+    if (Cache::isEnabled()) {
+        key = computeCacheKey();
+        if (loadFromCache(key)) {
+            cout << "Loaded the BVH from the cache (took " << timer.elapsedString()
+                << " and " << memString(m_cacheEntry->getSize()) << ")." << endl;
+            return;
+        }
+    }
+
+    /* Gather the centroids and bounds of all primitives once; the builders
+       only work on these arrays */
+    timer.reset();
+    computePrimitiveData();
+    cout << "Gathered the primitive centroids and bounds (took " << timer.elapsedString()
+        << " and " << memString(m_primitives->getMemoryUsage()) << ")." << endl;
+
+    /* Optionally build with the other builder first, for comparison */
+    if (m_compareBuilders) {
+        if (m_builder == ESAH)
+            buildHLBVH();
+        else
+            buildSAH();
+        m_nodes.clear();
+        m_indices.clear();
+    }
+
+    if (m_builder == EHLBVH)
+        buildHLBVH();
+    else if (m_builder == ESBVH)
+        buildSBVH();
+    else
+        buildSAH();
+    m_primitives.reset();
+
+    /* Copy the leaf primitives into SoA triangle blocks; the index
+       list is not needed anymore afterwards */
+    timer.reset();
+    size_t blockCount, blockSize;
+    if (m_width == 8) {
+        packTriangles<8>();
+        blockCount = m_blocks8.size();
+        blockSize = sizeof(BVHTriangleBlock<8>);
+    } else {
+        packTriangles<4>();
+        blockCount = m_blocks4.size();
+        blockSize = sizeof(BVHTriangleBlock<4>);
+    }
+    m_indices.clear();
+    m_indices.shrink_to_fit();
+
+    /* Reference for the quality of refitted trees (leaf costs in blocks, like refitBinary()) */
+    m_sahCost = statistics().first;
+
+    cout << "Packed the leaves into " << blockCount << " triangle blocks (took "
+        << timer.elapsedString() << " and " << memString(blockCount * blockSize)
+        << ")." << endl;
+
+    if (m_width != 2) {
+        cout << "Collapsing into a " << m_width << "-wide BVH .. ";
+        cout.flush();
+        timer.reset();
+
+        if (m_width == 4) {
+            collapse<4>(0u);
+            if (m_compressed)
+                compress<4>();
+        } else {
+            collapse<8>(0u);
+            if (m_compressed)
+                compress<8>();
+        }
+
+        std::pair<size_t, size_t> storage = getWideNodeStorage();
+        cout << "done (took " << timer.elapsedString() << " and "
+            << memString(storage.first * storage.second)
+            << (m_compressed ? ", compressed" : "") << ")." << endl;
+    }
+
+    if (m_compressed) {
+        /* Packets and refits work on the compressed nodes as well, so the
+           binary tree isn't needed anymore */
+        m_sahCost = m_width == 4 ? wideCost<4>(m_compressed4.data(), 0u)
+                                 : wideCost<8>(m_compressed8.data(), 0u);
+        m_nodes.clear();
+        m_nodes.shrink_to_fit();
+    }
+
+    std::pair<size_t, size_t> storage = getWideNodeStorage();
+    size_t blockMemory = m_width == 8 ? sizeof(BVHTriangleBlock<8>) * m_blocks8.size() :
+                                        sizeof(BVHTriangleBlock<4>) * m_blocks4.size();
+    cout << "The BVH takes " << memString(sizeof(BVHNode) * m_nodes.size()
+            + storage.first * storage.second + blockMemory)
+        << " (binary nodes: " << memString(sizeof(BVHNode) * m_nodes.size())
+        << ", wide nodes: " << memString(storage.first * storage.second)
+        << ", triangle blocks: " << memString(blockMemory) << ")." << endl;
+
+    updateTraversalData();
+    if (Cache::isEnabled())
+        storeToCache(key);
+}
+
+void BVH::updateTraversalData() {
+    m_nodeData = m_nodes.empty() ? nullptr : m_nodes.data();
+    if (m_width == 2)
+        m_wideNodeData = nullptr;
+    else if (m_compressed)
+        m_wideNodeData = m_width == 4 ? (const void *) m_compressed4.data() : (const void *) m_compressed8.data();
+    else
+        m_wideNodeData = m_width == 4 ? (const void *) m_nodes4.data() : (const void *) m_nodes8.data();
+    m_blockData = m_width == 8 ? (const void *) m_blocks8.data() : (const void *) m_blocks4.data();
+    m_blockCount = (uint32_t) (m_width == 8 ? m_blocks8.size() : m_blocks4.size());
+}
+
+std::pair<size_t, size_t> BVH::getWideNodeStorage() const {
+    if (m_width == 4)
+        return m_compressed ? std::make_pair(m_compressed4.size(), sizeof(BVHCompressedNode<4>))
+                            : std::make_pair(m_nodes4.size(), sizeof(BVHWideNode<4>));
+    else if (m_width == 8)
+        return m_compressed ? std::make_pair(m_compressed8.size(), sizeof(BVHCompressedNode<8>))
+                            : std::make_pair(m_nodes8.size(), sizeof(BVHWideNode<8>));
+    else
+        return std::make_pair((size_t) 0, (size_t) 0);
+}
+
+uint64_t BVH::computeCacheKey() const {
+    Hasher hasher;
+    hasher.add(std::string("bvh")).add(Cache::Version)
+        .add(m_width).add((int) m_builder).add(m_splitBudget).add(m_compressed)
+        .add((uint32_t) sizeof(BVHNode))
+        .add((uint32_t) sizeof(BVHWideNode<4>)).add((uint32_t) sizeof(BVHWideNode<8>))
+        .add((uint32_t) sizeof(BVHCompressedNode<4>)).add((uint32_t) sizeof(BVHCompressedNode<8>))
+        .add((uint32_t) sizeof(BVHTriangleBlock<4>)).add((uint32_t) sizeof(BVHTriangleBlock<8>))
+        .add(m_shapeOffset.data(), sizeof(uint32_t) * m_shapeOffset.size());
+
+    /* Hash the primitives in parallel (in chunks of a fixed size, so that
+       the result doesn't depend on the number of threads) */
+    const uint32_t size = getPrimitiveCount(), chunkSize = 16384;
+    std::vector<uint64_t> chunks((size + chunkSize - 1) / chunkSize);
+
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(0u, (uint32_t) chunks.size()),
+        [&](const tbb::blocked_range<uint32_t> &range) {
+            for (uint32_t c = range.begin(); c != range.end(); ++c) {
+                uint32_t end = std::min(size, (c + 1) * chunkSize);
+                Hasher chunk;
+                chunk.add(end - c * chunkSize);
+                for (uint32_t i = c * chunkSize; i < end; ++i) {
+                    uint32_t idx = i;
+                    const Shape *shape = m_shapes[findShape(idx)];
+                    Point3f p0, p1, p2;
+                    if (shape->getTriangle(idx, p0, p1, p2))
+                        chunk.add(p0).add(p1).add(p2);
+                    else
+                        chunk.add(shape->getBoundingBox(idx)).add(shape->getCentroid(idx));
                 }
+                chunks[c] = chunk.get();
+            }
+        }
+    );
+
+    return hasher.add((uint64_t) chunks.size())
+        .add(chunks.data(), sizeof(uint64_t) * chunks.size()).get();
+}
+
+bool BVH::loadFromCache(uint64_t key) {
+    std::unique_ptr<Cache::Entry> entry = Cache::load("bvh", key);
+    if (!entry || entry->getSectionCount() != 4 || entry->getSectionSize(3) != sizeof(float))
+        return false;
+
+    size_t wideSize = m_width == 2 ? 1 : getWideNodeStorage().second;
+    size_t blockSize = m_width == 8 ? sizeof(BVHTriangleBlock<8>) : sizeof(BVHTriangleBlock<4>);
+    if ((entry->getSectionSize(0) == 0) != m_compressed || entry->getSectionSize(0) % sizeof(BVHNode) != 0 ||
+        entry->getSectionSize(1) % wideSize != 0 || (m_width != 2 && entry->getSectionSize(1) == 0) ||
+        entry->getSectionSize(2) == 0 || entry->getSectionSize(2) % blockSize != 0)
+        return false;
+
+    /* No copies: the traversal works directly on the mapped file */
+    m_nodeData = m_compressed ? nullptr : static_cast<const BVHNode *>(entry->getSection(0));
+    m_wideNodeData = m_width == 2 ? nullptr : entry->getSection(1);
+    m_blockData = entry->getSection(2);
+    m_blockCount = (uint32_t) (entry->getSectionSize(2) / blockSize);
+    memcpy(&m_sahCost, entry->getSection(3), sizeof(float));
+    m_cacheEntry = std::move(entry);
+    return true;
+}
+
+void BVH::storeToCache(uint64_t key) const {
+    std::pair<size_t, size_t> wideStorage = getWideNodeStorage();
+    size_t blockSize = m_width == 8 ? sizeof(BVHTriangleBlock<8>) * m_blocks8.size() :
+                                      sizeof(BVHTriangleBlock<4>) * m_blocks4.size();
+
+    Cache::store("bvh", key, {
+        { m_nodeData, sizeof(BVHNode) * m_nodes.size() },
+        { m_wideNodeData, wideStorage.first * wideStorage.second },
+        { m_blockData, blockSize },
+        { &m_sahCost, sizeof(float) }
+    });
+}
+
+/// Refit the subtrees of binary nodes with more descendants than this in parallel
+static const uint32_t PARALLEL_REFIT_THRESHOLD = 4096;
+
+/// Refit the children of the wide nodes in the top levels in parallel
+static const int PARALLEL_REFIT_DEPTH = 3;
+
+/// Copy a section of a cache entry into an array
+template <typename T> static void copySection(const Cache::Entry &entry, uint32_t index, std::vector<T> &result) {
+    const T *data = static_cast<const T *>(entry.getSection(index));
+    result.assign(data, data + entry.getSectionSize(index) / sizeof(T));
+}
+
+void BVH::detachFromCache() {
+    if (!m_cacheEntry)
+        return;
+
+    copySection(*m_cacheEntry, 0, m_nodes);
+    if (m_width == 4 && m_compressed)
+        copySection(*m_cacheEntry, 1, m_compressed4);
+    else if (m_width == 4)
+        copySection(*m_cacheEntry, 1, m_nodes4);
+    else if (m_width == 8 && m_compressed)
+        copySection(*m_cacheEntry, 1, m_compressed8);
+    else if (m_width == 8)
+        copySection(*m_cacheEntry, 1, m_nodes8);
+    if (m_width == 8)
+        copySection(*m_cacheEntry, 2, m_blocks8);
+    else
+        copySection(*m_cacheEntry, 2, m_blocks4);
+
+    m_cacheEntry.reset();
+    updateTraversalData();
+}
+
+bool BVH::refit() {
+    /* Rebuild if the tree doesn't exist or doesn't match the shapes anymore */
+    bool countsChanged = false;
+    for (uint32_t i = 0; i < m_shapes.size(); ++i) {
+        uint32_t offset = m_shapeOffset[i] + m_shapes[i]->getPrimitiveCount();
+        countsChanged |= offset != m_shapeOffset[i + 1];
+        m_shapeOffset[i + 1] = offset;
+    }
+    if (!m_blockData || countsChanged) {
+        build();
+        return true;
+    }
+
+    cout << "Refitting the BVH .. ";
+    cout.flush();
+    Timer timer;
+    detachFromCache();
+
+    /* Leaf primitives first, then the nodes bottom-up */
+    size_t blockCount = m_width == 8 ? m_blocks8.size() : m_blocks4.size();
+    std::vector<BoundingBox3f> blockBounds(blockCount);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, blockCount),
+        [&](const tbb::blocked_range<size_t> &range) {
+            for (size_t i = range.begin(); i != range.end(); ++i)
+                blockBounds[i] = m_width == 8 ? refitBlock<8>(m_blocks8[i]) : refitBlock<4>(m_blocks4[i]);
+        }
+    );
+
+    /* Compressed trees only have the wide nodes */
+    float cost = 0;
+    if (!m_compressed) {
+        cost = refitBinary(0u, (uint32_t) m_nodes.size(), blockBounds);
+        m_bbox = m_nodes[0].bbox;
+    }
+
+    if (m_width == 4 && m_compressed) {
+        m_bbox = refitWide<4>(m_compressed4.data(), 0u, 0, blockBounds);
+        cost = wideCost<4>(m_compressed4.data(), 0u);
+    } else if (m_width == 4) {
+        refitWide<4>(m_nodes4.data(), 0u, 0, blockBounds);
+    } else if (m_width == 8 && m_compressed) {
+        m_bbox = refitWide<8>(m_compressed8.data(), 0u, 0, blockBounds);
+        cost = wideCost<8>(m_compressed8.data(), 0u);
+    } else if (m_width == 8) {
+        refitWide<8>(m_nodes8.data(), 0u, 0, blockBounds);
+    }
+
+    cout << "done (took " << timer.elapsedString() << ", SAH cost = " << cost
+        << " vs. " << m_sahCost << " after the last build)." << endl;
+
+    if (cost > m_rebuildThreshold * m_sahCost) {
+        cout << "The SAH cost has grown by more than a factor of " << m_rebuildThreshold
+            << ", rebuilding." << endl;
+        build();
+        return true;
+    }
+    return false;
+}
+
+template <int Width> BoundingBox3f BVH::refitBlock(BVHTriangleBlock<Width> &block) const {
+    BoundingBox3f bbox;
+    for (int lane = 0; lane < Width; ++lane) {
+        if (block.prim[lane] != (uint32_t) -1)
+            bbox.expandBy(packPrimitive(block, lane, block.prim[lane]));
+    }
+    return bbox;
+}
+
+float BVH::refitBinary(uint32_t node_idx, uint32_t end, const std::vector<BoundingBox3f> &blockBounds) {
+    BVHNode &node = m_nodes[node_idx];
+    if (node.isLeaf()) {
+        node.bbox.reset();
+        for (uint32_t i = node.start(); i < node.end(); ++i)
+            node.bbox.expandBy(blockBounds[i]);
+        return (float) BVHBuildTask::INTERSECTION_COST * node.leaf.size;
+    }
+
+    /* The left child directly follows its parent, the right subtree ends with the parent's */
+    uint32_t left = node_idx + 1, right = node.inner.rightChild;
+    float costLeft, costRight;
+    if (end - node_idx > PARALLEL_REFIT_THRESHOLD) {
+        tbb::parallel_invoke(
+            [&] { costLeft = refitBinary(left, right, blockBounds); },
+            [&] { costRight = refitBinary(right, end, blockBounds); }
+        );
+    } else {
+        costLeft = refitBinary(left, right, blockBounds);
+        costRight = refitBinary(right, end, blockBounds);
+    }
+
+    const BoundingBox3f &bboxLeft = m_nodes[left].bbox, &bboxRight = m_nodes[right].bbox;
+    node.bbox = BoundingBox3f::merge(bboxLeft, bboxRight);
+    return 2 * BVHBuildTask::TRAVERSAL_COST + (bboxLeft.getSurfaceArea() * costLeft +
+        bboxRight.getSurfaceArea() * costRight) / node.bbox.getSurfaceArea();
+}
+
+template <int Width, typename Node>
+BoundingBox3f BVH::refitWide(Node *nodes, uint32_t node_idx, int depth,
+                             const std::vector<BoundingBox3f> &blockBounds) {
+    BVHWideNode<Width> result;
+    BoundingBox3f childBounds[Width];
+
+    auto refitChild = [&](int i) {
+        const Node &node = nodes[node_idx];
+        if (node.count[i] > 0) {
+            for (uint32_t b = node.child[i]; b < node.child[i] + node.count[i]; ++b)
+                childBounds[i].expandBy(blockBounds[b]);
+        } else if (node.child[i] != 0) {
+            childBounds[i] = refitWide<Width>(nodes, node.child[i], depth + 1, blockBounds);
+        }
+    };
+
+    /* The top levels have plenty of independent subtrees */
+    if (depth < PARALLEL_REFIT_DEPTH)
+        tbb::parallel_for(0, Width, refitChild);
+    else
+        for (int i = 0; i < Width; ++i)
+            refitChild(i);
+
+    BoundingBox3f bbox;
+    for (int i = 0; i < Width; ++i) {
+        result.child[i] = nodes[node_idx].child[i];
+        result.count[i] = nodes[node_idx].count[i];
+        for (int axis = 0; axis < 3; ++axis) {
+            /* Unused slots keep an empty box */
+            result.bounds[axis][i] = childBounds[i].min[axis];
+            result.bounds[axis + 3][i] = childBounds[i].max[axis];
+        }
+        bbox.expandBy(childBounds[i]);
+    }
+    storeNode<Width>(nodes[node_idx], result);
+    return bbox;
+}
+
+template <> std::vector<BVH::BVHWideNode<4> > &BVH::getWideNodes<4>() { return m_nodes4; }
+template <> std::vector<BVH::BVHWideNode<8> > &BVH::getWideNodes<8>() { return m_nodes8; }
+template <> const std::vector<BVH::BVHWideNode<4> > &BVH::getWideNodes<4>() const { return m_nodes4; }
+template <> const std::vector<BVH::BVHWideNode<8> > &BVH::getWideNodes<8>() const { return m_nodes8; }
+
+template <> std::vector<BVH::BVHCompressedNode<4> > &BVH::getCompressedNodes<4>() { return m_compressed4; }
+template <> std::vector<BVH::BVHCompressedNode<8> > &BVH::getCompressedNodes<8>() { return m_compressed8; }
+
+template <> std::vector<BVH::BVHTriangleBlock<4> > &BVH::getTriangleBlocks<4>() { return m_blocks4; }
+template <> std::vector<BVH::BVHTriangleBlock<8> > &BVH::getTriangleBlocks<8>() { return m_blocks8; }
+template <> const std::vector<BVH::BVHTriangleBlock<4> > &BVH::getTriangleBlocks<4>() const { return m_blocks4; }
+template <> const std::vector<BVH::BVHTriangleBlock<8> > &BVH::getTriangleBlocks<8>() const { return m_blocks8; }
+
+template <int Width>
+BoundingBox3f BVH::packPrimitive(BVHTriangleBlock<Width> &block, int lane, uint32_t f) const {
+    uint32_t idx = f;
+    const Shape *shape = m_shapes[findShape(idx)];
+    block.prim[lane] = f;
+
+    Point3f p0, p1, p2;
+    float radius;
+    if (shape->getTriangle(idx, p0, p1, p2)) {
+        Vector3f e1 = p1 - p0, e2 = p2 - p0;
+        for (int axis = 0; axis < 3; ++axis) {
+            block.p0[axis][lane] = p0[axis];
+            block.e1[axis][lane] = e1[axis];
+            block.e2[axis][lane] = e2[axis];
+        }
+        BoundingBox3f bbox(p0);
+        bbox.expandBy(p1);
+        bbox.expandBy(p2);
+        return bbox;
+    } else if (shape->getSphere(idx, p0, radius)) {
+        for (int axis = 0; axis < 3; ++axis)
+            block.p0[axis][lane] = p0[axis];
+        block.e1[0][lane] = radius;
+        block.sphereMask |= 1u << lane;
+    } else {
+        block.otherMask |= 1u << lane;
+    }
+    return shape->getBoundingBox(idx);
+}
+
+template <int Width> void BVH::packTriangles() {
+    std::vector<BVHTriangleBlock<Width> > &blocks = getTriangleBlocks<Width>();
+    blocks.clear();
+
+    /* The nodes are stored in depth-first order, hence so are the leaves */
+    for (BVHNode &node : m_nodes) {
+        if (!node.isLeaf())
+            continue;
+
+        uint32_t blockStart = (uint32_t) blocks.size();
+        for (uint32_t i = node.start(); i < node.end(); i += Width) {
+            BVHTriangleBlock<Width> block;
+            memset(&block, 0, sizeof(BVHTriangleBlock<Width>));
+
+            for (uint32_t lane = 0; lane < (uint32_t) Width; ++lane) {
+                if (i + lane < node.end())
+                    packPrimitive(block, (int) lane, m_indices[i + lane]);
+                else
+                    block.prim[lane] = (uint32_t) -1;
+            }
+            blocks.push_back(block);
+        }
+
+        node.leaf.start = blockStart;
+        node.leaf.size = (uint32_t) blocks.size() - blockStart;
+    }
+}
+
+template <int Width> uint32_t BVH::collapse(uint32_t node_idx) {
+    std::vector<BVHWideNode<Width> > &nodes = getWideNodes<Width>();
+
+    /* Gather up to 'Width' descendants by repeatedly opening the
+       inner child with the largest surface area */
+    uint32_t children[Width], childCount = 0;
+    if (m_nodes[node_idx].isLeaf()) {
+        children[childCount++] = node_idx; /* Only happens at the root */
+    } else {
+        children[childCount++] = node_idx + 1;
+        children[childCount++] = m_nodes[node_idx].inner.rightChild;
+    }
+
+    while (childCount < Width) {
+        int best = -1;
+        float bestArea = -1;
+        for (uint32_t i = 0; i < childCount; ++i) {
+            const BVHNode &child = m_nodes[children[i]];
+            if (child.isInner() && child.bbox.getSurfaceArea() > bestArea) {
+                bestArea = child.bbox.getSurfaceArea();
+                best = (int) i;
+            }
+        }
+        if (best == -1)
+            break;
+        uint32_t opened = children[best];
+        children[best] = opened + 1;
+        children[childCount++] = m_nodes[opened].inner.rightChild;
+    }
+
+    uint32_t wide_idx = (uint32_t) nodes.size();
+    nodes.push_back(BVHWideNode<Width>());
+
+    for (int i = 0; i < Width; ++i) {
+        /* Note: 'nodes' may be reallocated by the recursive calls below */
+        BVHWideNode<Width> &node = nodes[wide_idx];
+        if ((uint32_t) i >= childCount) {
+            for (int axis = 0; axis < 3; ++axis) {
+                node.bounds[axis][i] = std::numeric_limits<float>::infinity();
+                node.bounds[axis + 3][i] = -std::numeric_limits<float>::infinity();
+            }
+            node.child[i] = node.count[i] = 0;
+            continue;
+        }
+
+        const BVHNode &child = m_nodes[children[i]];
+        for (int axis = 0; axis < 3; ++axis) {
+            node.bounds[axis][i] = child.bbox.min[axis];
+            node.bounds[axis + 3][i] = child.bbox.max[axis];
+        }
+
+        if (child.isLeaf()) {
+            node.child[i] = child.start();
+            node.count[i] = child.leaf.size;
+        } else {
+            uint32_t child_idx = collapse<Width>(children[i]);
+            nodes[wide_idx].child[i] = child_idx;
+            nodes[wide_idx].count[i] = 0;
+        }
+    }
+
+    return wide_idx;
+}
+
+template <int Width> void BVH::compress() {
+    std::vector<BVHWideNode<Width> > &nodes = getWideNodes<Width>();
+    std::vector<BVHCompressedNode<Width> > &result = getCompressedNodes<Width>();
+    result.resize(nodes.size());
+
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, nodes.size()),
+        [&](const tbb::blocked_range<size_t> &range) {
+            for (size_t n = range.begin(); n != range.end(); ++n)
+                quantize<Width>(nodes[n], result[n]);
+        }
+    );
+
+    nodes.clear();
+    nodes.shrink_to_fit();
+}
+
+template <int Width> void BVH::quantize(const BVHWideNode<Width> &node, BVHCompressedNode<Width> &result) {
+    memset(&result, 0, sizeof(BVHCompressedNode<Width>));
+
+    bool used[Width];
+    for (int i = 0; i < Width; ++i) {
+        used[i] = node.child[i] != 0 || node.count[i] != 0;
+        if (node.count[i] > std::numeric_limits<uint16_t>::max())
+            throw NoriException("BVH: a leaf is too large for compressed nodes!");
+        result.child[i] = node.child[i];
+        result.count[i] = (uint16_t) node.count[i];
+    }
+
+    for (int axis = 0; axis < 3; ++axis) {
+        float lo = std::numeric_limits<float>::infinity(), hi = -lo;
+        for (int i = 0; i < Width; ++i) {
+            if (used[i]) {
+                lo = std::min(lo, node.bounds[axis][i]);
+                hi = std::max(hi, node.bounds[axis + 3][i]);
+            }
+        }
+
+        /* Start with the smallest grid spacing that can span the node
+           and coarsen it until all planes are representable */
+        int exponent;
+        std::frexp((hi - lo) / 255.0f, &exponent);
+        exponent = clamp(exponent, -126, 127);
+        uint8_t qlo[Width], qhi[Width];
+        while (true) {
+            float scale = std::ldexp(1.0f, exponent);
+            bool valid = true;
+            for (int i = 0; i < Width && valid; ++i) {
+                if (!used[i]) {
+                    /* Empty interval, never hit */
+                    qlo[i] = 255;
+                    qhi[i] = 0;
+                    continue;
+                }
+                float min = node.bounds[axis][i], max = node.bounds[axis + 3][i];
+                float l = std::floor((min - lo) / scale), h = std::ceil((max - lo) / scale);
+                /* Compensate for rounding, the boxes must not shrink. This evaluates
+                   origin + q * scale exactly like BVHCompressedNode::getPlane() */
+                while (l > 0 && lo + l * scale > min)
+                    l -= 1;
+                while (h <= 255 && lo + h * scale < max)
+                    h += 1;
+                valid = h <= 255;
+                qlo[i] = (uint8_t) l;
+                qhi[i] = (uint8_t) std::min(h, 255.0f);
+            }
+            if (valid || exponent == 127)
+                break;
+            exponent++;
+        }
+
+        result.origin[axis] = lo;
+        result.exponent[axis] = (int8_t) exponent;
+        for (int i = 0; i < Width; ++i) {
+            result.bounds[axis][i] = qlo[i];
+            result.bounds[axis + 3][i] = qhi[i];
+        }
+    }
+}
+
+std::pair<float, uint32_t> BVH::statistics(uint32_t node_idx) const {
+    const BVHNode &node = m_nodes[node_idx];
+    if (node.isLeaf()) {
+        return std::make_pair((float) BVHBuildTask::INTERSECTION_COST * node.leaf.size, 1u);
+    } else {
+        std::pair<float, uint32_t> stats_left = statistics(node_idx + 1u);
+        std::pair<float, uint32_t> stats_right = statistics(node.inner.rightChild);
+        float saLeft = m_nodes[node_idx + 1u].bbox.getSurfaceArea();
+        float saRight = m_nodes[node.inner.rightChild].bbox.getSurfaceArea();
+        float saCur = node.bbox.getSurfaceArea();
+        float sahCost =
+            2 * BVHBuildTask::TRAVERSAL_COST +
+            (saLeft * stats_left.first + saRight * stats_right.first) / saCur;
+        return std::make_pair(
+            sahCost,
+            stats_left.second + stats_right.second + 1u
+        );
+    }
+}
+
+template <int Width, typename Node> float BVH::wideCost(const Node *nodes, uint32_t node_idx) {
+    const Node &node = nodes[node_idx];
+    Eigen::Array<float, Width, 1> planes[6];
+    for (int plane = 0; plane < 6; ++plane)
+        planes[plane] = node.getPlane(plane);
+
+    BoundingBox3f bbox, childBounds[Width];
+    float childCost[Width];
+    for (int i = 0; i < Width; ++i) {
+        if (node.child[i] == 0 && node.count[i] == 0)
+            continue;
+        childBounds[i] = BoundingBox3f(Point3f(planes[0][i], planes[1][i], planes[2][i]),
+                                       Point3f(planes[3][i], planes[4][i], planes[5][i]));
+        childCost[i] = node.count[i] > 0 ? (float) BVHBuildTask::INTERSECTION_COST * node.count[i]
+                                         : wideCost<Width>(nodes, node.child[i]);
+        bbox.expandBy(childBounds[i]);
+    }
+
+    /* Like statistics(): one traversal step per child */
+    float cost = 0, saCur = bbox.getSurfaceArea();
+    for (int i = 0; i < Width; ++i) {
+        if (node.child[i] != 0 || node.count[i] != 0)
+            cost += BVHBuildTask::TRAVERSAL_COST + childBounds[i].getSurfaceArea() * childCost[i] / saCur;
+    }
+    return cost;
+}
+
+/// Scale the default ray epsilon with the magnitude of the origin
+static inline void adaptEpsilon(Ray3f &ray) {
+    if (ray.mint == Epsilon)
+        ray.mint = std::max(ray.mint, ray.mint * ray.o.array().abs().maxCoeff());
+}
+
+bool BVH::traverse(Ray3f &ray, uint32_t &f, float &u, float &v, uint32_t &inner, bool shadowRay) const {
+    adaptEpsilon(ray);
+
+    if (!m_blockData || ray.maxt < ray.mint)
+        return false;
+
+    switch (m_width) {
+        case 4:
+            return m_compressed ? traverseWide<4, BVHCompressedNode<4> >(ray, f, u, v, inner, shadowRay)
+                                : traverseWide<4, BVHWideNode<4> >(ray, f, u, v, inner, shadowRay);
+        case 8:
+            return m_compressed ? traverseWide<8, BVHCompressedNode<8> >(ray, f, u, v, inner, shadowRay)
+                                : traverseWide<8, BVHWideNode<8> >(ray, f, u, v, inner, shadowRay);
+        default: return traverseBinary(ray, f, u, v, inner, shadowRay);
+    }
+}
+
+bool BVH::rayIntersect(const Ray3f &_ray, float &t, uint32_t &f, float &u, float &v) const {
+    Ray3f ray(_ray);
+    uint32_t inner = 0;
+    NORI_STAT(++TraversalStatistics::local().rays[TraversalStatistics::EInstance]);
+
+    if (!traverse(ray, f, u, v, inner, false))
+        return false;
+    t = ray.maxt;
+    return true;
+}
+
+void BVH::setHitInformation(uint32_t f, float u, float v, const Ray3f &ray, Intersection &its) const {
+    if (f >= getPrimitiveCount())
+        throw NoriException("BVH::setHitInformation(): invalid primitive index %i!", f);
+
+    its.t = ray.maxt;
+    its.uv = Point2f(u, v);
+    its.mesh = m_shapes[findShape(f)];
+    its.mesh->setHitInformation(f, 0, ray, its);
+}
+
+bool BVH::rayIntersect(const Ray3f &_ray, Intersection &its, bool shadowRay) const {
+    its.t = std::numeric_limits<float>::infinity();
+    if (shadowRay)
+        return occluded(_ray);
+
+    Ray3f ray(_ray);
+    uint32_t f = 0, inner = 0;
+    float u = 0, v = 0;
+    bool foundIntersection = traverse(ray, f, u, v, inner, false);
+
+    NORI_STAT(TraversalStatistics &stats = TraversalStatistics::local());
+    NORI_STAT(++stats.rays[TraversalStatistics::EClosestHit]);
+    NORI_STAT(stats.hits += foundIntersection ? 1 : 0);
+
+    if (foundIntersection) {
+        /* Only now look up the shape that was hit */
+        its.t = ray.maxt;
+        its.uv = Point2f(u, v);
+        its.mesh = m_shapes[findShape(f)];
+        its.mesh->setHitInformation(f, inner, ray, its);
+    }
+
+    return foundIntersection;
+}
+
+namespace {
+    /// Triangle block that occluded the last shadow ray of a thread
+    struct LastOccluder {
+        const BVH *bvh;
+        uint32_t block;
+    };
+
+    /* Shadow rays that reach an instance query the BVH of its shape group
+       while the top-level query is still running. One entry per BVH (hashed
+       by address) prevents the two queries from evicting each other */
+    const int OCCLUDER_CACHE_SIZE = 8;
+    thread_local LastOccluder lastOccluders[OCCLUDER_CACHE_SIZE] = { };
+
+    inline LastOccluder &lastOccluder(const BVH *bvh) {
+        uint64_t hash = (uint64_t) (uintptr_t) bvh * 0x9E3779B97F4A7C15ull;
+        return lastOccluders[hash >> 61];
+    }
+}
+
+bool BVH::occluded(const Ray3f &ray) const {
+    NORI_STAT(TraversalStatistics &stats = TraversalStatistics::local());
+    NORI_STAT(++stats.rays[TraversalStatistics::EShadow]);
+    bool cacheHit = false;
+    bool foundIntersection = anyHit(ray, cacheHit);
+    NORI_STAT(stats.hits += foundIntersection ? 1 : 0);
+    NORI_STAT(stats.occluderHits += cacheHit ? 1 : 0);
+    return foundIntersection;
+}
+
+bool BVH::occludedInstance(const Ray3f &ray) const {
+    bool cacheHit = false;
+    NORI_STAT(++TraversalStatistics::local().rays[TraversalStatistics::EInstance]);
+    return anyHit(ray, cacheHit);
+}
+
+bool BVH::anyHit(const Ray3f &_ray, bool &cacheHit) const {
+    Ray3f ray(_ray);
+    uint32_t block = 0, inner = 0;
+    float u = 0, v = 0;
+    NORI_STAT(TraversalStatistics &stats = TraversalStatistics::local());
+
+    /* Any intersection with a primitive of the BVH is a valid answer, so a
+       cached block can never produce a wrong result, only a wasted test */
+    LastOccluder &last = lastOccluder(this);
+    if (m_occluderCache && last.bvh == this && last.block < m_blockCount) {
+        adaptEpsilon(ray);
+        NORI_STAT(stats.primitives += m_width == 8 ? 8 : 4);
+        if (ray.maxt >= ray.mint && (m_width == 8
+                ? intersectLeaf<8>(last.block, 1, ray, block, u, v, inner, true)
+                : intersectLeaf<4>(last.block, 1, ray, block, u, v, inner, true))) {
+            cacheHit = true;
+            return true;
+        }
+    }
+
+    bool foundIntersection = traverse(ray, block, u, v, inner, true);
+    if (foundIntersection && m_occluderCache) {
+        last.bvh = this;
+        last.block = block;
+    }
+    return foundIntersection;
+}
+
+template <int Width>
+bool BVH::intersectLeaf(uint32_t start, uint32_t count, Ray3f &ray,
+                        uint32_t &f, float &hitU, float &hitV, uint32_t &inner, bool shadowRay) const {
+    typedef Eigen::Array<float, Width, 1> FloatN;
+    typedef Eigen::Map<const FloatN> MapN;
+
+    const BVHTriangleBlock<Width> *blocks = getTriangleBlockData<Width>();
+    bool foundIntersection = false;
+
+    for (uint32_t b = start; b < start + count; ++b) {
+        const BVHTriangleBlock<Width> &block = blocks[b];
+
+        /* Moeller-Trumbore test against all triangles of the block (same
+           sequence of operations as in \ref Mesh::rayIntersect()) */
+        MapN e1x(block.e1[0]), e1y(block.e1[1]), e1z(block.e1[2]);
+        MapN e2x(block.e2[0]), e2y(block.e2[1]), e2z(block.e2[2]);
+
+        /* pvec = d x edge2 */
+        FloatN pvx = ray.d.y() * e2z - ray.d.z() * e2y;
+        FloatN pvy = ray.d.z() * e2x - ray.d.x() * e2z;
+        FloatN pvz = ray.d.x() * e2y - ray.d.y() * e2x;
+
+        FloatN det = e1x * pvx + (e1y * pvy + e1z * pvz);
+        FloatN inv_det = det.inverse();
+
+        /* tvec = o - v0 */
+        FloatN tvx = ray.o.x() - MapN(block.p0[0]);
+        FloatN tvy = ray.o.y() - MapN(block.p0[1]);
+        FloatN tvz = ray.o.z() - MapN(block.p0[2]);
+
+        FloatN u = (tvx * pvx + (tvy * pvy + tvz * pvz)) * inv_det;
+
+        /* qvec = tvec x edge1 */
+        FloatN qvx = tvy * e1z - tvz * e1y;
+        FloatN qvy = tvz * e1x - tvx * e1z;
+        FloatN qvz = tvx * e1y - tvy * e1x;
+
+        FloatN v = (ray.d.x() * qvx + (ray.d.y() * qvy + ray.d.z() * qvz)) * inv_det;
+        FloatN t = (e2x * qvx + (e2y * qvy + e2z * qvz)) * inv_det;
+
+        auto valid = (det <= -1e-8f || det >= 1e-8f) &&
+            u >= 0.f && u <= 1.f && v >= 0.f && u + v <= 1.f &&
+            t >= ray.mint && t <= ray.maxt;
+
+        for (int lane = 0; lane < Width; ++lane) {
+            if (!valid[lane] || t[lane] > ray.maxt)
+                continue;
+            if (shadowRay) {
+                f = b;
+                return true;
+            }
+            foundIntersection = true;
+            ray.maxt = t[lane];
+            hitU = u[lane]; hitV = v[lane];
+            f = block.prim[lane];
+        }
+
+        /* Spheres (same sequence of operations as in Sphere::rayIntersect()).
+           The roots are computed per lane, since the vectorized square root
+           of Eigen is only approximate */
+        if (block.sphereMask != 0) {
+            MapN radius(block.e1[0]);
+            FloatN ocx = ray.o.x() - MapN(block.p0[0]);
+            FloatN ocy = ray.o.y() - MapN(block.p0[1]);
+            FloatN ocz = ray.o.z() - MapN(block.p0[2]);
+
+            /* Coefficients of the quadratic qa * t^2 + qb * t + qc = 0 */
+            float qa = ray.d.x() * ray.d.x() + (ray.d.y() * ray.d.y() + ray.d.z() * ray.d.z());
+            FloatN qb = 2.f * (ray.d.x() * ocx + (ray.d.y() * ocy + ray.d.z() * ocz));
+            FloatN qc = ocx * ocx + (ocy * ocy + ocz * ocz) - radius * radius;
+            FloatN delta = qb * qb - 4.f * qa * qc;
+
+            for (uint32_t mask = block.sphereMask; mask != 0; mask &= mask - 1) {
+                int lane = 0;
+                while (!(mask & (1u << lane)))
+                    ++lane;
+                if (!(delta[lane] > 0))
+                    continue;
+
+                /* Use the smaller root unless it lies before the segment */
+                float sqrtDelta = std::sqrt(delta[lane]);
+                float t1 = (-qb[lane] - sqrtDelta) / (2.f * qa);
+                float t2 = (-qb[lane] + sqrtDelta) / (2.f * qa);
+                float tHit = t1 > ray.mint ? t1 : t2;
+                if (!(tHit > ray.mint) || !(tHit < ray.maxt))
+                    continue;
+                if (shadowRay) {
+                    f = b;
+                    return true;
+                }
+                foundIntersection = true;
+                ray.maxt = tHit;
+                hitU = hitV = 0;
+                f = block.prim[lane];
+            }
+        }
+
+        /* Other primitives go through the Shape interface */
+        for (uint32_t mask = block.otherMask; mask != 0; mask &= mask - 1) {
+            int lane = 0;
+            while (!(mask & (1u << lane)))
+                ++lane;
+            uint32_t idx = block.prim[lane];
+            const Shape *shape = m_shapes[findShape(idx)];
+
+            /* Shadow rays only need to know whether there is any hit,
+               which lets instances use the any-hit query of their group */
+            if (shadowRay) {
+                if (shape->rayOccluded(idx, ray)) {
+                    f = b;
+                    return true;
+                }
+                continue;
+            }
+
+            float pu, pv, pt;
+            uint32_t pInner = 0;
+            if (shape->rayIntersect(idx, ray, pu, pv, pt, pInner)) {
+                foundIntersection = true;
+                ray.maxt = pt;
+                hitU = pu; hitV = pv;
+                f = block.prim[lane];
+                inner = pInner;
+            }
+        }
+    }
+
+    return foundIntersection;
+}
+
+bool BVH::traverseBinary(Ray3f &ray, uint32_t &f, float &u, float &v, uint32_t &inner, bool shadowRay) const {
+    uint32_t node_idx = 0, stack_idx = 0, stack[64];
+    bool foundIntersection = false;
+    NORI_STAT(TraversalStatistics &stats = TraversalStatistics::local());
+
+    while (true) {
+        const BVHNode &node = m_nodeData[node_idx];
+        NORI_STAT(++stats.nodes);
+
+        if (!node.bbox.rayIntersect(ray)) {
+            if (stack_idx == 0)
+                break;
+            node_idx = stack[--stack_idx];
+            continue;
+        }
+
+        if (node.isInner()) {
+            stack[stack_idx++] = node.inner.rightChild;
+            node_idx++;
+            assert(stack_idx<64);
+        } else {
+            NORI_STAT(stats.primitives += 4 * node.leaf.size);
+            if (intersectLeaf<4>(node.start(), node.leaf.size, ray, f, u, v, inner, shadowRay)) {
+                if (shadowRay)
+                    return true;
+                foundIntersection = true;
             }
             if (stack_idx == 0)
                 break;
@@ -454,11 +2335,386 @@ bool BVH::rayIntersect(const Ray3f &_ray, Intersection &its, bool shadowRay) con
         }
     }
 
-    if (foundIntersection) {
-        its.mesh->setHitInformation(f,ray,its);
+    return foundIntersection;
+}
+
+template <int Width, typename Node>
+bool BVH::traverseWide(Ray3f &ray, uint32_t &f, float &u, float &v, uint32_t &inner, bool shadowRay) const {
+    typedef Eigen::Array<float, Width, 1> FloatN;
+
+    /* Traversal stack entry: a wide node (count == 0) or a leaf, along
+       with the distance at which the ray enters its bounding box */
+    struct StackEntry {
+        uint32_t child, count;
+        float tNear;
+    };
+
+    const Node *nodes = getWideNodeData<Node>();
+    StackEntry stack[64 * Width];
+    uint32_t stack_idx = 0;
+    bool foundIntersection = false;
+    NORI_STAT(TraversalStatistics &stats = TraversalStatistics::local());
+
+    /* Per-ray precomputation: select the near/far planes of each slab
+       based on the sign of the direction, so that no per-lane swap is needed */
+    int nearX = ray.dRcp.x() < 0 ? 3 : 0, farX = 3 - nearX,
+        nearY = ray.dRcp.y() < 0 ? 4 : 1, farY = 5 - nearY,
+        nearZ = ray.dRcp.z() < 0 ? 5 : 2, farZ = 7 - nearZ;
+
+    stack[stack_idx++] = StackEntry { 0u, 0u, ray.mint };
+
+    while (stack_idx > 0) {
+        const StackEntry entry = stack[--stack_idx];
+
+        /* Skip entries that are farther away than the closest hit so far */
+        if (entry.tNear > ray.maxt)
+            continue;
+        NORI_STAT(++stats.nodes);
+
+        if (entry.count > 0) {
+            NORI_STAT(stats.primitives += Width * entry.count);
+            if (intersectLeaf<Width>(entry.child, entry.count, ray, f, u, v, inner, shadowRay)) {
+                if (shadowRay)
+                    return true;
+                foundIntersection = true;
+            }
+            continue;
+        }
+
+        /* Slab test against all children at once */
+        const Node &node = nodes[entry.child];
+        FloatN tNear = ((node.getPlane(nearX) - ray.o.x()) * ray.dRcp.x())
+            .max((node.getPlane(nearY) - ray.o.y()) * ray.dRcp.y())
+            .max((node.getPlane(nearZ) - ray.o.z()) * ray.dRcp.z())
+            .max(ray.mint);
+        FloatN tFar = ((node.getPlane(farX) - ray.o.x()) * ray.dRcp.x())
+            .min((node.getPlane(farY) - ray.o.y()) * ray.dRcp.y())
+            .min((node.getPlane(farZ) - ray.o.z()) * ray.dRcp.z())
+            .min(ray.maxt);
+
+        /* Gather the children that were hit, sorted by decreasing distance.
+           Unused slots reference the root, which is never a child */
+        int hits[Width], hitCount = 0;
+        for (int i = 0; i < Width; ++i) {
+            if (!(tNear[i] <= tFar[i]) || (node.child[i] == 0 && node.count[i] == 0))
+                continue;
+            int j = hitCount++;
+            if (!shadowRay) {
+                for (; j > 0 && tNear[hits[j - 1]] < tNear[i]; --j)
+                    hits[j] = hits[j - 1];
+            }
+            hits[j] = i;
+        }
+
+        /* Push them so that the closest child is visited first */
+        for (int j = 0; j < hitCount; ++j) {
+            int i = hits[j];
+            stack[stack_idx++] = StackEntry { node.child[i], node.count[i], tNear[i] };
+        }
+        assert(stack_idx <= 64 * Width);
     }
 
     return foundIntersection;
 }
 
+/// Return the index of the lowest set bit of a (nonzero) ray mask
+static inline uint32_t lowestBit(RayPacket::Mask mask) {
+#if defined(_MSC_VER)
+    unsigned long idx;
+    _BitScanForward64(&idx, mask);
+    return (uint32_t) idx;
+#else
+    return (uint32_t) __builtin_ctzll(mask);
+#endif
+}
+
+/// Ray-box test that also takes the ray segment into account
+static inline bool rayIntersectBounds(const BoundingBox3f &bbox, const Ray3f &ray) {
+    float nearT, farT;
+    return bbox.rayIntersect(ray, nearT, farT) && nearT <= ray.maxt && farT >= ray.mint;
+}
+
+void BVH::rayIntersect(const RayPacket &_packet, HitPacket &hits) const {
+    RayPacket packet(_packet);
+    uint32_t f[NORI_PACKET_SIZE], inner[NORI_PACKET_SIZE] = { };
+    float u[NORI_PACKET_SIZE], v[NORI_PACKET_SIZE];
+
+    hits.hitMask = traversePacket(packet, f, u, v, inner, false);
+    NORI_STAT(TraversalStatistics &stats = TraversalStatistics::local());
+    NORI_STAT(stats.rays[TraversalStatistics::EPacket] += packet.size);
+
+    for (RayPacket::Mask mask = hits.hitMask; mask != 0; mask &= mask - 1) {
+        uint32_t i = lowestBit(mask), idx = f[i];
+        NORI_STAT(++stats.hits);
+        Intersection &its = hits.its[i];
+        its.t = packet.rays[i].maxt;
+        its.uv = Point2f(u[i], v[i]);
+        its.mesh = m_shapes[findShape(idx)];
+        its.mesh->setHitInformation(idx, inner[i], packet.rays[i], its);
+    }
+}
+
+RayPacket::Mask BVH::occluded(const RayPacket &_packet) const {
+    RayPacket packet(_packet);
+    uint32_t f[NORI_PACKET_SIZE], inner[NORI_PACKET_SIZE];
+    float u[NORI_PACKET_SIZE], v[NORI_PACKET_SIZE];
+
+    RayPacket::Mask found = traversePacket(packet, f, u, v, inner, true);
+    NORI_STAT(TraversalStatistics &stats = TraversalStatistics::local());
+    NORI_STAT(stats.rays[TraversalStatistics::EPacketShadow] += packet.size);
+    NORI_STAT(for (RayPacket::Mask mask = found; mask != 0; mask &= mask - 1) ++stats.hits);
+    return found;
+}
+
+RayPacket::Mask BVH::traversePacket(RayPacket &packet, uint32_t *f, float *u, float *v,
+                                    uint32_t *inner, bool shadowRay) const {
+    typedef RayPacket::Mask Mask;
+    const float inf = std::numeric_limits<float>::infinity();
+
+    if (!m_blockData)
+        return 0;
+
+    /* Use an adaptive ray epsilon (as in the single ray version) and
+       deactivate rays with an empty segment right away */
+    Mask active = 0, found = 0;
+    for (uint32_t i = 0; i < packet.size; ++i) {
+        Ray3f &ray = packet.rays[i];
+        if (ray.mint == Epsilon)
+            ray.mint = std::max(ray.mint, ray.mint * ray.o.array().abs().maxCoeff());
+        if (ray.maxt >= ray.mint)
+            active |= Mask(1) << i;
+    }
+    if (active == 0)
+        return 0;
+
+    if (m_compressed)
+        return m_width == 4
+            ? traversePacketWide<4, BVHCompressedNode<4> >(packet, active, f, u, v, inner, shadowRay)
+            : traversePacketWide<8, BVHCompressedNode<8> >(packet, active, f, u, v, inner, shadowRay);
+
+    /* Interval arithmetic culling: bound the origins, reciprocal directions
+       and segments of all rays. A node whose box can't be hit by any ray
+       within these intervals is skipped without looking at the individual
+       rays. This requires the direction signs to agree along every axis. */
+    Vector3f oMin = Vector3f::Constant(inf), oMax = Vector3f::Constant(-inf);
+    Vector3f rMin = Vector3f::Constant(inf), rMax = Vector3f::Constant(-inf);
+    float minT = inf, maxT = -inf;
+    for (Mask mask = active; mask != 0; mask &= mask - 1) {
+        const Ray3f &ray = packet.rays[lowestBit(mask)];
+        oMin = oMin.cwiseMin(ray.o); oMax = oMax.cwiseMax(ray.o);
+        rMin = rMin.cwiseMin(ray.dRcp); rMax = rMax.cwiseMax(ray.dRcp);
+        minT = std::min(minT, ray.mint); maxT = std::max(maxT, ray.maxt);
+    }
+
+    bool intervalCulling = true;
+    for (int axis = 0; axis < 3; ++axis) {
+        if (!(rMin[axis] > 0 || rMax[axis] < 0) ||
+            !std::isfinite(rMin[axis]) || !std::isfinite(rMax[axis]))
+            intervalCulling = false;
+    }
+
+    auto intervalTest = [&](const BoundingBox3f &bbox) {
+        float nearT = minT, farT = maxT;
+        for (int axis = 0; axis < 3; ++axis) {
+            bool positive = rMin[axis] > 0;
+            float bNear = positive ? bbox.min[axis] : bbox.max[axis];
+            float bFar  = positive ? bbox.max[axis] : bbox.min[axis];
+
+            /* Earliest entry and latest exit of any ray along this axis */
+            float n0 = (bNear - oMin[axis]) * rMin[axis], n1 = (bNear - oMin[axis]) * rMax[axis],
+                  n2 = (bNear - oMax[axis]) * rMin[axis], n3 = (bNear - oMax[axis]) * rMax[axis];
+            float f0 = (bFar - oMin[axis]) * rMin[axis], f1 = (bFar - oMin[axis]) * rMax[axis],
+                  f2 = (bFar - oMax[axis]) * rMin[axis], f3 = (bFar - oMax[axis]) * rMax[axis];
+
+            nearT = std::max(nearT, std::min(std::min(n0, n1), std::min(n2, n3)));
+            farT = std::min(farT, std::max(std::max(f0, f1), std::max(f2, f3)));
+        }
+        return nearT <= farT;
+    };
+
+    /* Traversal stack entry: a node along with the index of the first
+       ray that hit its parent. Rays before it can't hit the node either. */
+    struct StackEntry {
+        uint32_t node, first;
+    };
+
+    StackEntry stack[64];
+    uint32_t node_idx = 0, stack_idx = 0, first = lowestBit(active);
+    NORI_STAT(TraversalStatistics &stats = TraversalStatistics::local());
+
+    while (true) {
+        const BVHNode &node = m_nodeData[node_idx];
+        NORI_STAT(++stats.nodes);
+
+        /* Find the first active ray that hits the node */
+        bool visit = false;
+        if (!intervalCulling || intervalTest(node.bbox)) {
+            for (Mask mask = active & (~Mask(0) << first); mask != 0; mask &= mask - 1) {
+                uint32_t i = lowestBit(mask);
+                if (rayIntersectBounds(node.bbox, packet.rays[i])) {
+                    first = i;
+                    visit = true;
+                    break;
+                }
+            }
+        }
+
+        if (visit && node.isInner()) {
+            stack[stack_idx++] = StackEntry { node.inner.rightChild, first };
+            node_idx++;
+            assert(stack_idx<64);
+            continue;
+        }
+
+        if (visit) {
+            /* Intersect the leaf against all remaining rays that hit its bounds */
+            bool leafHit = false;
+            for (Mask mask = active & (~Mask(0) << first); mask != 0; mask &= mask - 1) {
+                uint32_t i = lowestBit(mask);
+                Ray3f &ray = packet.rays[i];
+                if (i != first && !rayIntersectBounds(node.bbox, ray))
+                    continue;
+
+                NORI_STAT(stats.primitives += (m_width == 8 ? 8 : 4) * node.leaf.size);
+                bool hit = m_width == 8
+                    ? intersectLeaf<8>(node.start(), node.leaf.size, ray, f[i], u[i], v[i], inner[i], shadowRay)
+                    : intersectLeaf<4>(node.start(), node.leaf.size, ray, f[i], u[i], v[i], inner[i], shadowRay);
+
+                if (hit) {
+                    found |= Mask(1) << i;
+                    leafHit = true;
+                    if (shadowRay)
+                        active &= ~(Mask(1) << i);
+                }
+            }
+
+            if (shadowRay && active == 0)
+                break;
+
+            /* Closer hits were found: tighten the interval bound */
+            if (leafHit && !shadowRay) {
+                maxT = -inf;
+                for (Mask mask = active; mask != 0; mask &= mask - 1)
+                    maxT = std::max(maxT, packet.rays[lowestBit(mask)].maxt);
+            }
+        }
+
+        if (stack_idx == 0)
+            break;
+        --stack_idx;
+        node_idx = stack[stack_idx].node;
+        first = stack[stack_idx].first;
+    }
+
+    return found;
+}
+
+template <int Width, typename Node>
+RayPacket::Mask BVH::traversePacketWide(RayPacket &packet, RayPacket::Mask active, uint32_t *f,
+                                        float *u, float *v, uint32_t *inner, bool shadowRay) const {
+    typedef RayPacket::Mask Mask;
+    typedef Eigen::Array<float, Width, 1> FloatN;
+    const float inf = std::numeric_limits<float>::infinity();
+
+    /* Traversal stack entry: a wide node (count == 0) or a leaf, along with
+       the rays that hit its bounding box and the closest of their entry distances */
+    struct StackEntry {
+        uint32_t child, count;
+        Mask rays;
+        float tNear;
+    };
+
+    const Node *nodes = getWideNodeData<Node>();
+    StackEntry stack[64 * Width];
+    uint32_t stack_idx = 0;
+    Mask found = 0;
+    NORI_STAT(TraversalStatistics &stats = TraversalStatistics::local());
+
+    stack[stack_idx++] = StackEntry { 0u, 0u, active, -inf };
+
+    while (stack_idx > 0) {
+        const StackEntry entry = stack[--stack_idx];
+
+        /* Skip entries that are farther away than the closest hits so far */
+        Mask rays = 0;
+        for (Mask mask = entry.rays & active; mask != 0; mask &= mask - 1) {
+            uint32_t i = lowestBit(mask);
+            if (entry.tNear <= packet.rays[i].maxt)
+                rays |= Mask(1) << i;
+        }
+        if (rays == 0)
+            continue;
+        NORI_STAT(++stats.nodes);
+
+        if (entry.count > 0) {
+            for (Mask mask = rays; mask != 0; mask &= mask - 1) {
+                uint32_t i = lowestBit(mask);
+                NORI_STAT(stats.primitives += Width * entry.count);
+                if (intersectLeaf<Width>(entry.child, entry.count, packet.rays[i], f[i], u[i], v[i], inner[i], shadowRay)) {
+                    found |= Mask(1) << i;
+                    if (shadowRay)
+                        active &= ~(Mask(1) << i);
+                }
+            }
+            if (shadowRay && active == 0)
+                break;
+            continue;
+        }
+
+        /* Slab test of every ray against all children at once */
+        const Node &node = nodes[entry.child];
+        FloatN planes[6];
+        for (int plane = 0; plane < 6; ++plane)
+            planes[plane] = node.getPlane(plane);
+
+        Mask childRays[Width] = { };
+        FloatN childNear = FloatN::Constant(inf);
+        for (Mask mask = rays; mask != 0; mask &= mask - 1) {
+            uint32_t i = lowestBit(mask);
+            const Ray3f &ray = packet.rays[i];
+            int nearX = ray.dRcp.x() < 0 ? 3 : 0, nearY = ray.dRcp.y() < 0 ? 4 : 1,
+                nearZ = ray.dRcp.z() < 0 ? 5 : 2;
+
+            FloatN tNear = ((planes[nearX] - ray.o.x()) * ray.dRcp.x())
+                .max((planes[nearY] - ray.o.y()) * ray.dRcp.y())
+                .max((planes[nearZ] - ray.o.z()) * ray.dRcp.z())
+                .max(ray.mint);
+            FloatN tFar = ((planes[3 - nearX] - ray.o.x()) * ray.dRcp.x())
+                .min((planes[5 - nearY] - ray.o.y()) * ray.dRcp.y())
+                .min((planes[7 - nearZ] - ray.o.z()) * ray.dRcp.z())
+                .min(ray.maxt);
+
+            for (int c = 0; c < Width; ++c) {
+                if (tNear[c] <= tFar[c]) {
+                    childRays[c] |= Mask(1) << i;
+                    childNear[c] = std::min(childNear[c], tNear[c]);
+                }
+            }
+        }
+
+        /* Gather the children that were hit, sorted by decreasing distance.
+           Unused slots reference the root, which is never a child */
+        int hits[Width], hitCount = 0;
+        for (int c = 0; c < Width; ++c) {
+            if (childRays[c] == 0 || (node.child[c] == 0 && node.count[c] == 0))
+                continue;
+            int j = hitCount++;
+            if (!shadowRay) {
+                for (; j > 0 && childNear[hits[j - 1]] < childNear[c]; --j)
+                    hits[j] = hits[j - 1];
+            }
+            hits[j] = c;
+        }
+
+        /* Push them so that the closest child is visited first */
+        for (int j = 0; j < hitCount; ++j) {
+            int c = hits[j];
+            stack[stack_idx++] = StackEntry { node.child[c], node.count[c], childRays[c], childNear[c] };
+        }
+        assert(stack_idx <= 64 * Width);
+    }
+
+    return found;
+}
+
 NORI_NAMESPACE_END
@@ -78,6 +78,17 @@ public:
             Eigen::DiagonalMatrix<float, 3>(Vector3f(0.5f, -0.5f * aspect, 1.0f)) *
             Eigen::Translation<float, 3>(1.0f, -1.0f/aspect, 0.0f) * perspective).inverse();
 
+        m_cameraToSample = m_sampleToCamera.inverse();
+        m_worldToCamera = m_cameraToWorld.inverse();
+
+        /* Area of the film on the plane at z=1 (for the importance) */
+        Point3f pMin = m_sampleToCamera * Point3f(0.0f, 0.0f, 0.0f),
+                pMax = m_sampleToCamera * Point3f(1.0f, 1.0f, 0.0f);
+        pMin /= pMin.z();
+        pMax /= pMax.z();
+        m_filmArea = std::abs((pMax.x() - pMin.x()) * (pMax.y() - pMin.y()));
+        m_lensArea = m_lensRadius > 0 ? (float) M_PI * m_lensRadius * m_lensRadius : 1.0f;
+
         /* If no reconstruction filter was assigned, instantiate a Gaussian filter */
         if (!m_rfilter) {
             m_rfilter = static_cast<ReconstructionFilter *>(
@@ -116,6 +127,36 @@ public:
         return Color3f(1.0f);
     }
 
+    Color3f sampleImportance(const Point3f &ref, const Point2f &apertureSample,
+            Point3f &p, Point2f &samplePosition, float &pdf) const {
+        Point2f lens_sample = m_lensRadius * Warp::squareToUniformDisk(apertureSample);
+        Point3f origin(lens_sample.x(), lens_sample.y(), 0);
+        Vector3f d = m_worldToCamera * ref - origin;
+        if (d.z() <= 0)
+            return Color3f(0.0f);
+
+        /* The film position is the one whose pinhole ray meets d in the focal plane */
+        Point3f pFocus = origin + d * (m_focalDistance / d.z());
+        Point3f sample = m_cameraToSample * pFocus;
+        samplePosition = Point2f(sample.x() * m_outputSize.x(), sample.y() * m_outputSize.y());
+        if (sample.x() < 0 || sample.x() >= 1 || sample.y() < 0 || sample.y() >= 1)
+            return Color3f(0.0f);
+
+        float dist2 = d.squaredNorm();
+        float cosTheta = d.z() / std::sqrt(dist2);
+        p = m_cameraToWorld * origin;
+        pdf = dist2 / (cosTheta * m_lensArea);
+
+        return Color3f(1.0f / (m_filmArea * m_lensArea * cosTheta * cosTheta * cosTheta * cosTheta));
+    }
+
+    void pdfRay(const Ray3f &ray, float &pdfPos, float &pdfDir) const {
+        /* Uniform on the lens and (through the focal plane) on the plane at z=1 */
+        float cosTheta = (m_worldToCamera * ray.d).normalized().z();
+        pdfPos = 1.0f / m_lensArea;
+        pdfDir = cosTheta > 0 ? 1.0f / (m_filmArea * cosTheta * cosTheta * cosTheta) : 0.0f;
+    }
+
     virtual void addChild(NoriObject *obj) override {
         switch (obj->getClassType()) {
             case EReconstructionFilter:
@@ -154,7 +195,11 @@ public:
 private:
     Vector2f m_invOutputSize;
     Transform m_sampleToCamera;
+    Transform m_cameraToSample;
     Transform m_cameraToWorld;
+    Transform m_worldToCamera;
+    float m_filmArea;
+    float m_lensArea;
     float m_fov;
     float m_nearClip;
     float m_farClip;
@@ -21,6 +21,7 @@
 #include <nori/rfilter.h>
 #include <nori/bbox.h>
 #include <tbb/tbb.h>
+#include <chrono>
 
 NORI_NAMESPACE_BEGIN
 
@@ -71,6 +72,9 @@ void ImageBlock::init(const Vector2i &size, const ReconstructionFilter *filter)
 
     /* Allocate space for pixels and border regions */
     resize(size.y() + 2*m_borderSize, size.x() + 2*m_borderSize);
+
+    m_rowLocks.reset(new tbb::spin_mutex[rows()]);
+    resetContention();
 }
 
 Bitmap *ImageBlock::toBitmap() const {
@@ -126,10 +130,127 @@ void ImageBlock::put(ImageBlock &b) {
         Vector2i::Constant(m_borderSize - b.getBorderSize());
     Vector2i size   = b.getSize()   + Vector2i(2*b.getBorderSize());
 
-    tbb::mutex::scoped_lock lock(m_mutex);
+    /* Blocks handed out by a BlockGenerator don't overlap, but their
+       borders reach up to 'borderSize' pixels into the neighboring blocks.
+       Only the ring of width 2*borderSize along the edge of the source
+       footprint can therefore be shared with concurrent merges. */
+    int margin = 2 * b.getBorderSize();
+
+    for (int y=0; y<size.y(); ++y) {
+        int row = offset.y() + y;
+        if (y < margin || y >= size.y() - margin || 2*margin >= size.x()) {
+            lockRow(row);
+            block(row, offset.x(), 1, size.x()) += b.block(y, 0, 1, size.x());
+            unlockRow(row);
+        } else {
+            if (margin > 0) {
+                lockRow(row);
+                block(row, offset.x(), 1, margin) += b.block(y, 0, 1, margin);
+                block(row, offset.x() + size.x() - margin, 1, margin)
+                    += b.block(y, size.x() - margin, 1, margin);
+                unlockRow(row);
+            }
+            block(row, offset.x() + margin, 1, size.x() - 2*margin)
+                += b.block(y, margin, 1, size.x() - 2*margin);
+        }
+    }
+}
+
+void ImageBlock::lockRow(int row) {
+    tbb::spin_mutex &mutex = m_rowLocks[row];
+    if (mutex.try_lock())
+        return;
+
+    auto start = std::chrono::high_resolution_clock::now();
+    mutex.lock();
+    auto end = std::chrono::high_resolution_clock::now();
+
+    m_contentionTime += (uint64_t) std::chrono::duration_cast<
+        std::chrono::nanoseconds>(end - start).count();
+    ++m_contentionCount;
+}
+
+void ImageBlock::initMoments() {
+    size_t count = (size_t) m_size.prod();
+    m_momentCount.assign(count, 0);
+    m_momentWeight.assign(count, 0);
+    m_momentMean.assign(count, Color3f(0.0f));
+    m_momentM2.assign(count, Color3f(0.0f));
+}
+
+void ImageBlock::putMoments(const ImageBlock &b, uint32_t sampleCount) {
+    if (sampleCount == 0)
+        return;
+
+    Vector2i offset = b.getOffset() - m_offset;
+    int border = b.getBorderSize();
+
+    for (int y=0; y<b.getSize().y(); ++y) {
+        for (int x=0; x<b.getSize().x(); ++x) {
+            size_t idx = (size_t) (y + offset.y()) * m_size.x() + (x + offset.x());
+            Color3f value = b.coeff(y + border, x + border).divideByFilterWeight();
+
+            /* A pass of w samples has 1/w times the variance of a single sample */
+            ++m_momentCount[idx];
+            float w = (float) sampleCount;
+            float weight = (float) (m_momentWeight[idx] += sampleCount);
+            Color3f delta = value - m_momentMean[idx];
+            m_momentMean[idx] += delta * (w / weight);
+            m_momentM2[idx] += delta * (value - m_momentMean[idx]) * w;
+        }
+    }
+}
+
+float ImageBlock::getRelativeError(const Point2i &offset, const Vector2i &size) const {
+    float errorSum = 0;
+    for (int y=offset.y(); y<offset.y() + size.y(); ++y) {
+        for (int x=offset.x(); x<offset.x() + size.x(); ++x) {
+            size_t idx = (size_t) y * m_size.x() + x;
+            float n = (float) m_momentCount[idx];
+            if (n < 2)
+                return std::numeric_limits<float>::infinity();
+
+            /* Squared relative error of the pixel mean: the weighted sum of
+               squared deviations over n - 1 estimates the variance of a
+               single sample, and the mean averages all of its samples */
+            float var = m_momentM2[idx].getLuminance() / ((n - 1) * m_momentWeight[idx]);
+            float lum = m_momentMean[idx].getLuminance();
+            errorSum += std::max(var, 0.f) / std::max(lum * lum, 1e-4f);
+        }
+    }
+    return std::sqrt(errorSum / size.prod());
+}
 
-    block(offset.y(), offset.x(), size.y(), size.x()) 
-        += b.topLeftCorner(size.y(), size.x());
+Bitmap *ImageBlock::toVarianceBitmap() const {
+    Bitmap *result = new Bitmap(m_size);
+    for (int y=0; y<m_size.y(); ++y) {
+        for (int x=0; x<m_size.x(); ++x) {
+            size_t idx = (size_t) y * m_size.x() + x;
+            float n = (float) m_momentCount[idx];
+            /* Variance of the mean, i.e. the sample variance divided by the sample count */
+            result->coeffRef(y, x) = n < 2 ? Color3f(0.0f)
+                : Color3f(m_momentM2[idx] / ((n - 1) * m_momentWeight[idx]));
+        }
+    }
+    return result;
+}
+
+void ImageBlock::putSplats(const SplatBuffer &splats, float scale) {
+    if (splats.getSize() != m_size)
+        throw NoriException("ImageBlock::putSplats(): size mismatch!");
+
+    for (int y=0; y<m_size.y(); ++y) {
+        for (int x=0; x<m_size.x(); ++x) {
+            Color4f &pixel = coeffRef(y + m_borderSize, x + m_borderSize);
+            Color3f value = splats.get(Point2i(x, y)) * scale;
+            /* Scale by the filter weight, so that the value survives the normalization */
+            float w = pixel.w();
+            if (w != 0)
+                pixel += Color4f(value.r() * w, value.g() * w, value.b() * w, 0.0f);
+            else
+                pixel = Color4f(value);
+        }
+    }
 }
 
 std::string ImageBlock::toString() const {
@@ -137,53 +258,86 @@ std::string ImageBlock::toString() const {
         m_offset.toString(), m_size.toString());
 }
 
+void SplatBuffer::init(const Vector2i &size) {
+    m_size = size;
+    m_data.reset(new std::atomic<float>[3 * (size_t) size.prod()]);
+    clear();
+}
+
+void SplatBuffer::clear() {
+    for (size_t i = 0; i < 3 * (size_t) m_size.prod(); ++i)
+        m_data[i].store(0.0f, std::memory_order_relaxed);
+}
+
+void SplatBuffer::splat(const Point2f &pos, const Color3f &value) {
+    if (!value.isValid()) {
+        cerr << "Integrator: computed an invalid splat value: " << value.toString() << endl;
+        return;
+    }
+
+    int x = (int) std::floor(pos.x()), y = (int) std::floor(pos.y());
+    if (x < 0 || y < 0 || x >= m_size.x() || y >= m_size.y())
+        return;
+
+    /* There is no atomic floating point addition, use compare-and-swap */
+    std::atomic<float> *v = &m_data[3 * ((size_t) y * m_size.x() + x)];
+    for (int i = 0; i < 3; ++i) {
+        if (value[i] == 0)
+            continue;
+        float old = v[i].load(std::memory_order_relaxed);
+        while (!v[i].compare_exchange_weak(old, old + value[i], std::memory_order_relaxed))
+            ;
+    }
+}
+
 BlockGenerator::BlockGenerator(const Vector2i &size, int blockSize)
         : m_size(size), m_blockSize(blockSize) {
     m_numBlocks = Vector2i(
         (int) std::ceil(size.x() / (float) blockSize),
         (int) std::ceil(size.y() / (float) blockSize));
-    reset();
-}
 
-void BlockGenerator::reset() {
-    m_blocksLeft = m_numBlocks.x() * m_numBlocks.y();
-    m_direction = ERight;
-    m_block = Point2i(m_numBlocks / 2);
-    m_stepsLeft = 1;
-    m_numSteps = 1;
+    /* Walk the spiral once and remember the order of the blocks */
+    int blocksLeft = m_numBlocks.x() * m_numBlocks.y();
+    int direction = ERight, numSteps = 1, stepsLeft = 1;
+    Point2i block(m_numBlocks / 2);
+    m_order.reserve(blocksLeft);
+
+    while (blocksLeft > 0) {
+        m_order.push_back(block);
+        if (--blocksLeft == 0)
+            break;
+
+        do {
+            switch (direction) {
+                case ERight: ++block.x(); break;
+                case EDown:  ++block.y(); break;
+                case ELeft:  --block.x(); break;
+                case EUp:    --block.y(); break;
+            }
+
+            if (--stepsLeft == 0) {
+                direction = (direction + 1) % 4;
+                if (direction == ELeft || direction == ERight) 
+                    ++numSteps;
+                stepsLeft = numSteps;
+            }
+        } while ((block.array() < 0).any() ||
+                 (block.array() >= m_numBlocks.array()).any());
+    }
+
+    reset();
 }
 
 bool BlockGenerator::next(ImageBlock &block) {
-    tbb::mutex::scoped_lock lock(m_mutex);
-
-    if (m_blocksLeft == 0)
+    int index = m_next++;
+    if (index >= (int) m_order.size())
         return false;
 
-    Point2i pos = m_block * m_blockSize;
+    const Point2i &b = m_order[index];
+    Point2i pos = b * m_blockSize;
     block.setOffset(pos);
     block.setSize((m_size - pos).cwiseMin(Vector2i::Constant(m_blockSize)));
-    block.setBlockId(m_block.y() * m_numBlocks.x() + m_block.x());
-
-    if (--m_blocksLeft == 0)
-        return true;
-
-    do {
-        switch (m_direction) {
-            case ERight: ++m_block.x(); break;
-            case EDown:  ++m_block.y(); break;
-            case ELeft:  --m_block.x(); break;
-            case EUp:    --m_block.y(); break;
-        }
-
-        if (--m_stepsLeft == 0) {
-            m_direction = (m_direction + 1) % 4;
-            if (m_direction == ELeft || m_direction == ERight) 
-                ++m_numSteps;
-            m_stepsLeft = m_numSteps;
-        }
-    } while ((m_block.array() < 0).any() ||
-             (m_block.array() >= m_numBlocks.array()).any());
-
+    block.setBlockId(b.y() * m_numBlocks.x() + b.x());
     return true;
 }
 
@@ -0,0 +1,303 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/cache.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+
+#if defined(_WIN32)
+#  include <windows.h>
+#  include <direct.h>
+#else
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+/* ===================================================================
+    Hasher
+ * =================================================================== */
+
+/// Finalizer of SplitMix64 (a bijection in which every input bit affects all output bits)
+static inline uint64_t mix64(uint64_t h) {
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+    return h ^ (h >> 31);
+}
+
+Hasher &Hasher::add(const void *data, size_t size) {
+    const uint8_t *ptr = static_cast<const uint8_t *>(data);
+    uint64_t h = m_state;
+
+    for (; size >= 8; size -= 8, ptr += 8) {
+        uint64_t word;
+        memcpy(&word, ptr, 8);
+        h = mix64(h ^ mix64(word));
+    }
+
+    /* Pack the remaining bytes into a word, along with their count */
+    if (size > 0) {
+        uint64_t word = (uint64_t) size << 56;
+        memcpy(&word, ptr, size);
+        h = mix64(h ^ mix64(word));
+    }
+
+    m_state = h;
+    return *this;
+}
+
+uint64_t Hasher::get() const {
+    return mix64(m_state);
+}
+
+/* ===================================================================
+    MappedFile
+ * =================================================================== */
+
+#if defined(_WIN32)
+MappedFile::MappedFile(const std::string &filename) {
+    m_file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                         OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (m_file == INVALID_HANDLE_VALUE) {
+        m_file = nullptr;
+        throw NoriException("Unable to open \"%s\"!", filename);
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(m_file, &size)) {
+        CloseHandle(m_file);
+        throw NoriException("Unable to query the size of \"%s\"!", filename);
+    }
+    m_size = (size_t) size.QuadPart;
+    if (m_size == 0)
+        return;
+
+    m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (m_mapping)
+        m_data = static_cast<const uint8_t *>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+    if (!m_data) {
+        if (m_mapping)
+            CloseHandle(m_mapping);
+        CloseHandle(m_file);
+        throw NoriException("Unable to map \"%s\" into memory!", filename);
+    }
+}
+
+MappedFile::~MappedFile() {
+    if (m_data)
+        UnmapViewOfFile(m_data);
+    if (m_mapping)
+        CloseHandle(m_mapping);
+    if (m_file)
+        CloseHandle(m_file);
+}
+#else
+MappedFile::MappedFile(const std::string &filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1)
+        throw NoriException("Unable to open \"%s\"!", filename);
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        throw NoriException("Unable to query the size of \"%s\"!", filename);
+    }
+    m_size = (size_t) st.st_size;
+
+    if (m_size > 0) {
+        void *data = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            throw NoriException("Unable to map \"%s\" into memory!", filename);
+        }
+        m_data = static_cast<const uint8_t *>(data);
+    }
+
+    /* The mapping stays valid after closing the file */
+    close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if (m_data)
+        munmap(const_cast<uint8_t *>(m_data), m_size);
+}
+#endif
+
+/* ===================================================================
+    Cache
+ * =================================================================== */
+
+namespace {
+    /// Header of a cache file, followed by a table of (offset, size) pairs
+    struct CacheHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t sectionCount;
+        uint64_t key;
+    };
+
+    const char CacheMagic[8] = { 'N', 'O', 'R', 'I', 'C', 'A', 'C', 'H' };
+
+    /// Sections start at multiples of this (for SIMD loads and cache lines)
+    const size_t CacheAlignment = 64;
+
+    std::string &cacheDirectory() {
+        static std::string directory = [] {
+            const char *env = std::getenv("NORI_CACHE_DIR");
+            return std::string(env ? env : "");
+        }();
+        return directory;
+    }
+}
+
+const uint32_t Cache::Version;
+
+Cache::Entry::Entry(std::unique_ptr<MappedFile> file, uint32_t sectionCount)
+    : m_file(std::move(file)), m_sectionCount(sectionCount) { }
+
+const void *Cache::Entry::getSection(uint32_t index) const {
+    const uint64_t *table = reinterpret_cast<const uint64_t *>(m_file->getData() + sizeof(CacheHeader));
+    return m_file->getData() + table[2 * index];
+}
+
+size_t Cache::Entry::getSectionSize(uint32_t index) const {
+    const uint64_t *table = reinterpret_cast<const uint64_t *>(m_file->getData() + sizeof(CacheHeader));
+    return (size_t) table[2 * index + 1];
+}
+
+void Cache::setDirectory(const std::string &directory) {
+    cacheDirectory() = directory;
+}
+
+bool Cache::isEnabled() {
+    return !cacheDirectory().empty();
+}
+
+std::string Cache::getFilename(const std::string &kind, uint64_t key) {
+    std::string dir = cacheDirectory();
+    if (dir.back() != '/' && dir.back() != '\\')
+        dir += '/';
+    return tfm::format("%s%s-%016x.cache", dir, kind, key);
+}
+
+std::unique_ptr<Cache::Entry> Cache::load(const std::string &kind, uint64_t key) {
+    if (!isEnabled())
+        return nullptr;
+
+    std::string filename = getFilename(kind, key);
+    std::unique_ptr<MappedFile> file;
+    try {
+        file.reset(new MappedFile(filename));
+    } catch (const NoriException &) {
+        return nullptr; /* Not cached yet */
+    }
+
+    /* Validate the header and the section table */
+    const uint8_t *data = file->getData();
+    size_t size = file->getSize();
+    if (size < sizeof(CacheHeader))
+        return nullptr;
+    CacheHeader header;
+    memcpy(&header, data, sizeof(CacheHeader));
+    if (memcmp(header.magic, CacheMagic, sizeof(CacheMagic)) != 0 ||
+        header.version != Version || header.key != key ||
+        size < sizeof(CacheHeader) + 2 * sizeof(uint64_t) * (size_t) header.sectionCount) {
+        cerr << "Warning: ignoring the invalid cache file \"" << filename << "\"" << endl;
+        return nullptr;
+    }
+
+    const uint64_t *table = reinterpret_cast<const uint64_t *>(data + sizeof(CacheHeader));
+    for (uint32_t i = 0; i < header.sectionCount; ++i) {
+        if (table[2 * i] > size || table[2 * i + 1] > size - table[2 * i]) {
+            cerr << "Warning: ignoring the truncated cache file \"" << filename << "\"" << endl;
+            return nullptr;
+        }
+    }
+
+    return std::unique_ptr<Entry>(new Entry(std::move(file), header.sectionCount));
+}
+
+void Cache::store(const std::string &kind, uint64_t key, const std::vector<Section> &sections) {
+    if (!isEnabled())
+        return;
+
+#if defined(_WIN32)
+    _mkdir(cacheDirectory().c_str());
+#else
+    mkdir(cacheDirectory().c_str(), 0755);
+#endif
+
+    CacheHeader header;
+    memcpy(header.magic, CacheMagic, sizeof(CacheMagic));
+    header.version = Version;
+    header.sectionCount = (uint32_t) sections.size();
+    header.key = key;
+
+    auto align = [](uint64_t offset) {
+        return (offset + CacheAlignment - 1) / CacheAlignment * CacheAlignment;
+    };
+
+    std::vector<uint64_t> table;
+    uint64_t offset = align(sizeof(CacheHeader) + 2 * sizeof(uint64_t) * sections.size());
+    for (const Section &section : sections) {
+        table.push_back(offset);
+        table.push_back(section.size);
+        offset = align(offset + section.size);
+    }
+
+    /* Write to a temporary file first, then atomically move it into place.
+       The name is unique per process and call, since other processes (or
+       threads) may be writing the same entry at the same time */
+#if defined(_WIN32)
+    uint32_t pid = (uint32_t) GetCurrentProcessId();
+#else
+    uint32_t pid = (uint32_t) getpid();
+#endif
+    static std::atomic<uint32_t> tempCounter(0);
+    std::string filename = getFilename(kind, key);
+    std::string tempName = tfm::format("%s.%i.%i.%x.tmp", filename, pid, tempCounter++,
+        (uint64_t) std::chrono::high_resolution_clock::now().time_since_epoch().count());
+    std::ofstream os(tempName, std::ios::binary);
+    const char padding[CacheAlignment] = { 0 };
+
+    os.write(reinterpret_cast<const char *>(&header), sizeof(CacheHeader));
+    os.write(reinterpret_cast<const char *>(table.data()), sizeof(uint64_t) * table.size());
+    uint64_t position = sizeof(CacheHeader) + sizeof(uint64_t) * table.size();
+    for (size_t i = 0; i < sections.size(); ++i) {
+        os.write(padding, (std::streamsize) (table[2 * i] - position));
+        os.write(static_cast<const char *>(sections[i].data), (std::streamsize) sections[i].size);
+        position = table[2 * i] + sections[i].size;
+    }
+    os.close();
+
+    if (!os.good() || std::rename(tempName.c_str(), filename.c_str()) != 0) {
+        std::remove(tempName.c_str());
+        /* Another process may have been faster */
+        if (!std::ifstream(filename).good())
+            cerr << "Warning: unable to write the cache file \"" << filename << "\"" << endl;
+    }
+}
+
+NORI_NAMESPACE_END
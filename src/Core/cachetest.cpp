@@ -0,0 +1,97 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/bvh.h>
+#include <nori/cache.h>
+#include <nori/mesh.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * Checks that the keys of the persistent cache tell apart inputs that
+ * only differ in a few bits, e.g. a mesh and its mirror image (the signs
+ * of the coordinates are the highest bits of the hashed words).
+ *
+ * Usage: <test type="cachekey"/>
+ */
+class CacheKeyTest : public NoriObject {
+public:
+    CacheKeyTest(const PropertyList &) { }
+
+    virtual void activate() override {
+        int total = 0, passed = 0;
+
+        auto check = [&](bool result, const std::string &name) {
+            cout << (result ? "Passed: " : "Failed: ") << name << endl;
+            ++total;
+            passed += result ? 1 : 0;
+        };
+
+        /* Two words that differ in their highest bit each */
+        uint64_t words[2] = { 1, 2 }, flipped[2] = { 1 | (1ull << 63), 2 | (1ull << 63) };
+        check(Hasher().add(words).get() != Hasher().add(flipped).get(),
+              "flipping the highest bit of two words changes the hash");
+
+        /* A row of triangles and its mirror image in y */
+        MatrixXf V(3, 12);
+        MatrixXu F(3, 4);
+        for (int i = 0; i < 4; ++i) {
+            V.col(3 * i + 0) = Vector3f((float) i, 1.f, 0.f);
+            V.col(3 * i + 1) = Vector3f(i + 1.f, 1.f, 0.f);
+            V.col(3 * i + 2) = Vector3f((float) i, 2.f, 1.f);
+            for (int k = 0; k < 3; ++k)
+                F(k, i) = (uint32_t) (3 * i + k);
+        }
+        MatrixXf mirrored = V;
+        mirrored.row(1) *= -1;
+
+        uint64_t key = computeKey(V, F);
+        check(key == computeKey(V, F), "the BVH key is deterministic");
+        check(key != computeKey(mirrored, F), "a mirrored mesh has a different BVH key");
+
+        cout << "Passed " << passed << "/" << total << " tests." << endl;
+    }
+
+    virtual std::string toString() const override {
+        return "CacheKeyTest[]";
+    }
+
+    virtual EClassType getClassType() const override { return ETest; }
+
+private:
+    /// Mesh with the given vertices and faces
+    class TestMesh : public Mesh {
+    public:
+        TestMesh(const MatrixXf &V, const MatrixXu &F) {
+            m_V = V;
+            m_F = F;
+            for (int i = 0; i < (int) V.cols(); ++i)
+                m_bbox.expandBy(V.col(i));
+        }
+    };
+
+    /// Return the cache key of a BVH over the given mesh
+    static uint64_t computeKey(const MatrixXf &V, const MatrixXu &F) {
+        BVH bvh; /* Deletes the mesh */
+        bvh.addShape(new TestMesh(V, F));
+        return bvh.computeCacheKey();
+    }
+};
+
+NORI_REGISTER_CLASS(CacheKeyTest, "cachekey");
+NORI_NAMESPACE_END
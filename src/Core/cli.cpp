@@ -0,0 +1,127 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob, Romain Prévost
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* =======================================================================
+     Headless batch renderer: same render loop as the GUI, but without
+     nanogui so that it can run on machines that don't have a display.
+ * ======================================================================= */
+
+#include <nori/block.h>
+#include <nori/cache.h>
+#include <nori/render.h>
+#include <nori/timer.h>
+#include <filesystem/path.h>
+#include <tbb/task_scheduler_init.h>
+#include <iomanip>
+
+static void printUsage(const char *name) {
+    std::cerr << "Syntax: " << name << " [options] <scene.xml>" << std::endl
+              << "Options:" << std::endl
+              << "   -t <count>   Number of rendering threads (default: all cores)" << std::endl
+              << "   -s <count>   Override the number of samples per pixel" << std::endl
+              << "   -p <type>    Override the sampler (independent, sobol, halton, cmj)" << std::endl
+              << "   -c <count>   Samples per pixel rendered for a block before moving on" << std::endl
+              << "   -e <error>   Adaptive sampling: target relative error per block (0: off)" << std::endl
+              << "   -b <seconds> Time budget: keep refining the image until it is used up" << std::endl
+              << "   -o <file>    Output filename (.exr, or .png for an additional LDR image)" << std::endl
+              << "   -k <dir>     Cache parsed meshes and BVHs in this directory (default: $NORI_CACHE_DIR)" << std::endl;
+}
+
+int main(int argc, char **argv) {
+    using namespace nori;
+
+    int threadCount = tbb::task_scheduler_init::automatic;
+    uint32_t sampleCount = 0, samplesPerPass = 0;
+    float targetError = -1, timeBudget = -1;
+    std::string outputName, samplerType, filename;
+
+    try {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if ((arg == "-t" || arg == "-s" || arg == "-p" || arg == "-c" || arg == "-e" || arg == "-b" || arg == "-o" || arg == "-k") && i + 1 < argc) {
+                std::string value = argv[++i];
+                if (arg == "-t")
+                    threadCount = toInt(value);
+                else if (arg == "-s")
+                    sampleCount = toUInt(value);
+                else if (arg == "-p")
+                    samplerType = value;
+                else if (arg == "-c")
+                    samplesPerPass = toUInt(value);
+                else if (arg == "-e")
+                    targetError = toFloat(value);
+                else if (arg == "-b")
+                    timeBudget = toFloat(value);
+                else if (arg == "-k")
+                    Cache::setDirectory(value);
+                else
+                    outputName = value;
+            } else if (arg[0] != '-' && filename.empty()) {
+                filename = arg;
+            } else {
+                printUsage(argv[0]);
+                return -1;
+            }
+        }
+
+        if (filename.empty() || filesystem::path(filename).extension() != "xml") {
+            printUsage(argv[0]);
+            return -1;
+        }
+        if (threadCount <= 0 && threadCount != tbb::task_scheduler_init::automatic)
+            throw NoriException("Invalid thread count %i", threadCount);
+        if ((targetError < 0 && targetError != -1) || (timeBudget < 0 && timeBudget != -1))
+            throw NoriException("The target error and time budget must be nonnegative");
+
+        tbb::task_scheduler_init init(threadCount);
+        cout << "Using " << (threadCount > 0 ? threadCount : tbb::task_scheduler_init::default_num_threads())
+             << " threads" << endl;
+
+        Timer timer;
+        ImageBlock block(Vector2i(1, 1), nullptr);
+        RenderThread renderThread(block);
+        renderThread.setSampleCount(sampleCount);
+        renderThread.setSamplerType(samplerType);
+        renderThread.setSamplesPerPass(samplesPerPass);
+        renderThread.setTargetError(targetError);
+        renderThread.setTimeBudget(timeBudget);
+        renderThread.setOutputName(outputName);
+
+        if (!renderThread.renderScene(filename))
+            throw NoriException("\"%s\" does not describe a scene!", filename);
+
+        /* Poll the render thread and report progress on stdout */
+        int lastPercent = -1;
+        while (renderThread.isBusy()) {
+            int percent = (int) (100 * renderThread.getProgress());
+            if (percent != lastPercent) {
+                cout << "Progress: " << std::setw(3) << percent << "% ("
+                     << timer.elapsedString() << " elapsed)" << endl;
+                lastPercent = percent;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(250));
+        }
+
+        cout << "Total time (including scene loading): "
+             << timer.elapsedString(true) << endl;
+    } catch (const std::exception &e) {
+        cerr << "Fatal error: " << e.what() << endl;
+        return -1;
+    }
+    return 0;
+}
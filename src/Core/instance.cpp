@@ -0,0 +1,148 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/instance.h>
+
+NORI_NAMESPACE_BEGIN
+
+ShapeGroup::ShapeGroup(const PropertyList &props) {
+    m_bvh = new BVH();
+    m_bvh->setWidth(props.getInteger("bvhWidth", 2));
+    m_bvh->setCompressed(props.getBoolean("bvhCompressed", false));
+    m_bvh->setRebuildThreshold(props.getFloat("bvhRebuildThreshold", 1.5f));
+    m_bvh->setBuilder(props.getString("bvhBuilder", "sah"));
+}
+
+ShapeGroup::~ShapeGroup() {
+    delete m_bvh; /* Also deletes the shapes */
+}
+
+void ShapeGroup::addChild(NoriObject *obj) {
+    if (obj->getClassType() != EMesh)
+        throw NoriException("ShapeGroup::addChild(<%s>) is not supported!",
+                            classTypeName(obj->getClassType()));
+
+    Shape *shape = static_cast<Shape *>(obj);
+    if (dynamic_cast<Instance *>(shape))
+        throw NoriException("ShapeGroup: nested instances are not supported!");
+    if (shape->isEmitter())
+        throw NoriException("ShapeGroup: instanced area emitters are not supported!");
+    m_bvh->addShape(shape);
+    m_shapes.push_back(shape);
+}
+
+void ShapeGroup::activate() {
+    if (m_shapes.empty())
+        throw NoriException("ShapeGroup \"%s\" is empty!", m_idname);
+    m_bvh->build();
+}
+
+std::string ShapeGroup::toString() const {
+    return tfm::format("ShapeGroup[shapes=%i, primitives=%i]",
+                       m_shapes.size(), m_bvh->getPrimitiveCount());
+}
+
+Instance::Instance(const PropertyList &props) {
+    m_toWorld = props.getTransform("toWorld", Transform());
+    m_worldToLocal = m_toWorld.inverse();
+}
+
+void Instance::addChild(NoriObject *obj) {
+    if (obj->getClassType() != EShapeGroup)
+        throw NoriException("Instance::addChild(<%s>) is not supported!",
+                            classTypeName(obj->getClassType()));
+    if (m_group)
+        throw NoriException("Instance: tried to reference multiple shape groups!");
+    m_group = static_cast<const ShapeGroup *>(obj);
+}
+
+void Instance::activate() {
+    if (!m_group)
+        throw NoriException("Instance: no shape group was referenced!");
+    setTransform(m_toWorld);
+}
+
+void Instance::setTransform(const Transform &toWorld) {
+    m_toWorld = toWorld;
+    m_worldToLocal = toWorld.inverse();
+
+    /* Bound the transformed corners of the group's bounding box */
+    const BoundingBox3f &bbox = m_group->getBoundingBox();
+    m_bbox.reset();
+    for (int i = 0; i < 8; ++i)
+        m_bbox.expandBy(m_toWorld * bbox.getCorner(i));
+}
+
+bool Instance::rayIntersect(uint32_t, const Ray3f &ray, float &u, float &v, float &t, uint32_t &inner) const {
+    return m_group->getBVH()->rayIntersect(m_worldToLocal * ray, t, inner, u, v);
+}
+
+bool Instance::rayOccluded(uint32_t, const Ray3f &ray) const {
+    return m_group->getBVH()->occludedInstance(m_worldToLocal * ray);
+}
+
+void Instance::setHitInformation(uint32_t, uint32_t inner, const Ray3f &ray, Intersection &its) const {
+    /* Distances along the ray are the same in object space */
+    Ray3f localRay = m_worldToLocal * ray;
+    localRay.maxt = its.t;
+
+    Intersection local;
+    m_group->getBVH()->setHitInformation(inner, its.uv.x(), its.uv.y(), localRay, local);
+
+    its.p = m_toWorld * local.p;
+    its.uv = local.uv;
+    its.mesh = local.mesh;
+    its.geoFrame = Frame((m_toWorld * local.geoFrame.n).normalized());
+    its.shFrame = transformFrame(local.shFrame);
+}
+
+Frame Instance::transformFrame(const Frame &frame) const {
+    /* Tangents transform like vectors and stay perpendicular to the normal,
+       which transforms with the inverse transpose. Orthonormalize them again
+       to remove round-off, keeping the handedness of the transformed frame */
+    Normal3f n = (m_toWorld * frame.n).normalized();
+    Vector3f s = m_toWorld * frame.s;
+    s = (s - n * n.dot(s)).normalized();
+    Vector3f t = n.cross(s);
+    if (t.dot(m_toWorld * frame.t) < 0)
+        t = -t;
+    return Frame(s, t, n);
+}
+
+void Instance::sampleSurface(ShapeQueryRecord &, const Point2f &) const {
+    throw NoriException("Instance::sampleSurface(): not supported!");
+}
+
+float Instance::pdfSurface(const ShapeQueryRecord &) const {
+    throw NoriException("Instance::pdfSurface(): not supported!");
+}
+
+std::string Instance::toString() const {
+    return tfm::format(
+        "Instance[\n"
+        "  group = %s,\n"
+        "  toWorld = %s\n"
+        "]",
+        m_group ? m_group->toString() : std::string("null"),
+        indent(m_toWorld.toString(), 12)
+    );
+}
+
+NORI_REGISTER_CLASS(ShapeGroup, "shapegroup");
+NORI_REGISTER_CLASS(Instance, "instance");
+NORI_NAMESPACE_END
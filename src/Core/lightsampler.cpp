@@ -0,0 +1,421 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/lightsampler.h>
+#include <nori/emitter.h>
+#include <nori/timer.h>
+#include <Eigen/Geometry>
+
+NORI_NAMESPACE_BEGIN
+
+namespace {
+    /// With fewer bounded emitters, the \c auto strategy samples by power
+    const size_t MinBVHEmitters = 8;
+
+    /// Number of buckets per axis that are evaluated when splitting a light BVH node
+    const int LightBucketCount = 12;
+
+    /// Largest float below one
+    const float OneMinusEpsilon = 0.99999994f;
+
+    float safeSqrt(float value) { return std::sqrt(std::max(value, 0.0f)); }
+
+    float safeAcos(float value) { return std::acos(clamp(value, -1.0f, 1.0f)); }
+
+    /// Cosine of max(a - b, 0), given the sines and cosines of both angles
+    float cosSubClamped(float sinA, float cosA, float sinB, float cosB) {
+        if (cosA > cosB)
+            return 1.0f;
+        return cosA * cosB + sinA * sinB;
+    }
+
+    /// Sine of max(a - b, 0), given the sines and cosines of both angles
+    float sinSubClamped(float sinA, float cosA, float sinB, float cosB) {
+        if (cosA > cosB)
+            return 0.0f;
+        return sinA * cosB - cosA * sinB;
+    }
+
+    /// Rotate \c v by \c angle around the unit vector \c k (Rodrigues' formula)
+    Vector3f rotate(const Vector3f &v, const Vector3f &k, float angle) {
+        float cosAngle = std::cos(angle), sinAngle = std::sin(angle);
+        return v * cosAngle + k.cross(v) * sinAngle + k * (k.dot(v) * (1 - cosAngle));
+    }
+
+    /**
+     * \brief Surface area orientation heuristic: the cost of a node with
+     * the bounds \c b of a split along \c axis of a node with extents \c extents
+     */
+    float lightCost(const LightBounds &b, const Vector3f &extents, int axis) {
+        float thetaO = safeAcos(b.cosThetaO), thetaE = safeAcos(b.cosThetaE);
+        float thetaW = std::min(thetaO + thetaE, (float) M_PI);
+        float sinThetaO = safeSqrt(1 - b.cosThetaO * b.cosThetaO);
+
+        /* Solid angle measure of the directions the light is emitted to */
+        float omega = 2 * M_PI * (1 - b.cosThetaO) + 0.5f * M_PI *
+            (2 * thetaW * sinThetaO - std::cos(thetaO - 2 * thetaW)
+             - 2 * thetaO * sinThetaO + b.cosThetaO);
+
+        /* Penalize splits that produce thin nodes */
+        float kr = extents[axis] > 0 ? extents.maxCoeff() / extents[axis] : 1.0f;
+
+        return b.power * omega * kr * b.bbox.getSurfaceArea();
+    }
+}
+
+void LightBounds::expandBy(const LightBounds &other) {
+    if (!other.bbox.isValid())
+        return;
+    if (!bbox.isValid()) {
+        *this = other;
+        return;
+    }
+    bbox.expandBy(other.bbox);
+    power += other.power;
+    cosThetaE = std::min(cosThetaE, other.cosThetaE);
+
+    /* Smallest cone that contains both normal cones */
+    float thetaA = safeAcos(cosThetaO), thetaB = safeAcos(other.cosThetaO);
+    float thetaD = safeAcos(axis.dot(other.axis));
+    if (std::min(thetaD + thetaB, (float) M_PI) <= thetaA)
+        return;
+    if (std::min(thetaD + thetaA, (float) M_PI) <= thetaB) {
+        axis = other.axis;
+        cosThetaO = other.cosThetaO;
+        return;
+    }
+
+    float thetaO = 0.5f * (thetaA + thetaD + thetaB);
+    Vector3f k = axis.cross(other.axis);
+    if (thetaO >= M_PI || k.squaredNorm() == 0) {
+        cosThetaO = -1.0f;
+        return;
+    }
+    axis = rotate(axis, k.normalized(), thetaO - thetaA).normalized();
+    cosThetaO = std::cos(thetaO);
+}
+
+float LightBounds::importance(const Point3f &p, const Normal3f &n) const {
+    Point3f center = bbox.getCenter();
+    Vector3f d = p - center;
+    float radius2 = 0.25f * bbox.getExtents().squaredNorm();
+
+    /* Don't let the estimate blow up close to (or inside) the bounds */
+    float dist2 = std::max(d.squaredNorm(), std::max(radius2, 1e-8f));
+    Vector3f wi = d.normalized();
+
+    /* Angle between the cone axis and the direction to p */
+    float cosThetaW = axis.dot(wi);
+    float sinThetaW = safeSqrt(1 - cosThetaW * cosThetaW);
+
+    /* Directions subtended by the bounding sphere of the box */
+    float cosThetaB = -1.0f;
+    if (d.squaredNorm() > radius2)
+        cosThetaB = safeSqrt(1 - radius2 / d.squaredNorm());
+    float sinThetaB = safeSqrt(1 - cosThetaB * cosThetaB);
+
+    /* Smallest angle between an emitting normal and a direction to p */
+    float sinThetaO = safeSqrt(1 - cosThetaO * cosThetaO);
+    float cosThetaX = cosSubClamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO);
+    float sinThetaX = sinSubClamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO);
+    float cosThetaP = cosSubClamped(sinThetaX, cosThetaX, sinThetaB, cosThetaB);
+    if (cosThetaP <= cosThetaE)
+        return 0.0f;
+
+    float result = power * cosThetaP / dist2;
+
+    /* Foreshortening at the receiver (either side, for transmission) */
+    if (!n.isZero()) {
+        float cosThetaI = std::abs(wi.dot(n));
+        float sinThetaI = safeSqrt(1 - cosThetaI * cosThetaI);
+        result *= cosSubClamped(sinThetaI, cosThetaI, sinThetaB, cosThetaB);
+    }
+
+    return std::max(result, 0.0f);
+}
+
+LightSampler::LightSampler(const std::vector<Emitter *> &emitters, const std::string &strategy) {
+    m_emitters.assign(emitters.begin(), emitters.end());
+
+    std::vector<LightBounds> bounds;
+    for (const Emitter *emitter : m_emitters) {
+        LightBounds b;
+        if (emitter->getLightBounds(b)) {
+            m_bounded.push_back(emitter);
+            bounds.push_back(b);
+        } else {
+            m_infinite.push_back(emitter);
+        }
+    }
+    for (uint32_t i = 0; i < (uint32_t) m_bounded.size(); ++i)
+        m_index[m_bounded[i]] = i;
+    for (uint32_t i = 0; i < (uint32_t) m_infinite.size(); ++i)
+        m_index[m_infinite[i]] = (uint32_t) m_bounded.size() + i;
+
+    if (strategy == "uniform")
+        m_strategy = EUniform;
+    else if (strategy == "power")
+        m_strategy = EPower;
+    else if (strategy == "bvh")
+        m_strategy = EBVH;
+    else if (strategy == "auto")
+        m_strategy = m_bounded.size() >= MinBVHEmitters ? EBVH : EPower;
+    else
+        throw NoriException("LightSampler: unknown strategy \"%s\" (must be "
+            "\"auto\", \"uniform\", \"power\" or \"bvh\")!", strategy);
+
+    /* The power distribution is also used for the point-independent queries */
+    float totalPower = 0;
+    for (const LightBounds &b : bounds)
+        totalPower += b.power;
+    m_power.reserve(bounds.size());
+    for (const LightBounds &b : bounds)
+        m_power.append(totalPower > 0 ? b.power : 1.0f);
+    if (!bounds.empty())
+        m_power.normalize();
+
+    if (m_strategy != EBVH || m_bounded.empty())
+        return;
+
+    cout << "Constructing a light BVH (" << m_bounded.size() << " emitters) .. ";
+    cout.flush();
+    Timer timer;
+
+    std::vector<uint32_t> indices(m_bounded.size());
+    for (uint32_t i = 0; i < (uint32_t) indices.size(); ++i)
+        indices[i] = i;
+    m_leaves.resize(m_bounded.size());
+    m_nodes.reserve(2 * m_bounded.size() - 1);
+    build(bounds, indices.data(), indices.data() + indices.size(), 0);
+
+    cout << "done (took " << timer.elapsedString() << " and "
+        << memString(sizeof(Node) * m_nodes.size()) << ")." << endl;
+}
+
+uint32_t LightSampler::build(const std::vector<LightBounds> &bounds, uint32_t *start,
+                             uint32_t *end, uint32_t parent) {
+    uint32_t nodeIndex = (uint32_t) m_nodes.size();
+    m_nodes.push_back(Node());
+    m_nodes[nodeIndex].parent = parent;
+
+    if (end - start == 1) {
+        Node &node = m_nodes[nodeIndex];
+        node.bounds = bounds[*start];
+        node.offset = *start;
+        node.leaf = true;
+        m_leaves[*start] = nodeIndex;
+        return nodeIndex;
+    }
+
+    LightBounds total;
+    BoundingBox3f centroids;
+    for (uint32_t *i = start; i != end; ++i) {
+        total.expandBy(bounds[*i]);
+        centroids.expandBy(bounds[*i].bbox.getCenter());
+    }
+
+    /* Find the bucket split with the lowest cost along any axis */
+    Vector3f extents = total.bbox.getExtents();
+    float bestCost = std::numeric_limits<float>::infinity();
+    int bestAxis = -1, bestSplit = -1;
+    for (int axis = 0; axis < 3; ++axis) {
+        float min = centroids.min[axis], max = centroids.max[axis];
+        if (max <= min)
+            continue;
+
+        LightBounds buckets[LightBucketCount];
+        uint32_t counts[LightBucketCount] = { 0 };
+        for (uint32_t *i = start; i != end; ++i) {
+            int bucket = std::min((int) (LightBucketCount *
+                (bounds[*i].bbox.getCenter()[axis] - min) / (max - min)), LightBucketCount - 1);
+            buckets[bucket].expandBy(bounds[*i]);
+            counts[bucket]++;
+        }
+
+        for (int split = 1; split < LightBucketCount; ++split) {
+            LightBounds below, above;
+            uint32_t countBelow = 0, countAbove = 0;
+            for (int j = 0; j < split; ++j) {
+                below.expandBy(buckets[j]);
+                countBelow += counts[j];
+            }
+            for (int j = split; j < LightBucketCount; ++j) {
+                above.expandBy(buckets[j]);
+                countAbove += counts[j];
+            }
+            if (countBelow == 0 || countAbove == 0)
+                continue;
+
+            float cost = lightCost(below, extents, axis) + lightCost(above, extents, axis);
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = split;
+            }
+        }
+    }
+
+    uint32_t *mid = start + (end - start) / 2;
+    if (bestAxis != -1) {
+        float min = centroids.min[bestAxis], max = centroids.max[bestAxis];
+        mid = std::partition(start, end, [&](uint32_t i) {
+            int bucket = std::min((int) (LightBucketCount *
+                (bounds[i].bbox.getCenter()[bestAxis] - min) / (max - min)), LightBucketCount - 1);
+            return bucket < bestSplit;
+        });
+    }
+
+    build(bounds, start, mid, nodeIndex);
+    uint32_t right = build(bounds, mid, end, nodeIndex);
+
+    Node &node = m_nodes[nodeIndex];
+    node.bounds = total;
+    node.offset = right;
+    node.leaf = false;
+    return nodeIndex;
+}
+
+const Emitter *LightSampler::sample(const Point3f &p, const Normal3f &n, float rnd, float &pmf) const {
+    pmf = 0.0f;
+    if (m_emitters.empty())
+        return nullptr;
+
+    if (m_strategy == EUniform) {
+        size_t count = m_emitters.size();
+        pmf = 1.0f / count;
+        return m_emitters[std::min((size_t) std::floor(count * rnd), count - 1)];
+    }
+
+    float pBounded = getBoundedProbability();
+    if (rnd < pBounded) {
+        const Emitter *emitter = sampleBounded(p, n, std::min(rnd / pBounded, OneMinusEpsilon), pmf);
+        pmf *= pBounded;
+        return emitter;
+    }
+
+    rnd = (rnd - pBounded) / (1 - pBounded);
+    size_t count = m_infinite.size();
+    pmf = (1 - pBounded) / count;
+    return m_infinite[std::min((size_t) std::floor(count * rnd), count - 1)];
+}
+
+float LightSampler::pmf(const Point3f &p, const Normal3f &n, const Emitter *emitter) const {
+    auto it = m_index.find(emitter);
+    if (it == m_index.end())
+        return 0.0f;
+    if (m_strategy == EUniform)
+        return 1.0f / m_emitters.size();
+
+    float pBounded = getBoundedProbability();
+    if (it->second < m_bounded.size())
+        return pBounded * pmfBounded(p, n, it->second);
+    return (1 - pBounded) / m_infinite.size();
+}
+
+const Emitter *LightSampler::sample(float rnd, float &pmf) const {
+    pmf = 0.0f;
+    if (m_emitters.empty())
+        return nullptr;
+
+    if (m_strategy == EUniform)
+        return sample(Point3f(0.0f), Normal3f(0.0f), rnd, pmf);
+
+    float pBounded = getBoundedProbability();
+    if (rnd < pBounded) {
+        size_t index = m_power.sample(std::min(rnd / pBounded, OneMinusEpsilon), pmf);
+        pmf *= pBounded;
+        return m_bounded[index];
+    }
+
+    rnd = (rnd - pBounded) / (1 - pBounded);
+    size_t count = m_infinite.size();
+    pmf = (1 - pBounded) / count;
+    return m_infinite[std::min((size_t) std::floor(count * rnd), count - 1)];
+}
+
+float LightSampler::pmf(const Emitter *emitter) const {
+    auto it = m_index.find(emitter);
+    if (it == m_index.end())
+        return 0.0f;
+    if (m_strategy == EUniform)
+        return 1.0f / m_emitters.size();
+
+    float pBounded = getBoundedProbability();
+    if (it->second < m_bounded.size())
+        return pBounded * m_power[it->second];
+    return (1 - pBounded) / m_infinite.size();
+}
+
+const Emitter *LightSampler::sampleBounded(const Point3f &p, const Normal3f &n,
+                                           float rnd, float &pmf) const {
+    if (m_strategy == EPower)
+        return m_bounded[m_power.sample(rnd, pmf)];
+
+    /* Descend into the children in proportion to their importance. If
+       neither child can contribute, either choice is fine */
+    uint32_t nodeIndex = 0;
+    pmf = 1.0f;
+    while (!m_nodes[nodeIndex].leaf) {
+        uint32_t left = nodeIndex + 1, right = m_nodes[nodeIndex].offset;
+        float importanceLeft = m_nodes[left].bounds.importance(p, n);
+        float importanceRight = m_nodes[right].bounds.importance(p, n);
+        float sum = importanceLeft + importanceRight;
+        float pLeft = sum > 0 ? importanceLeft / sum : 0.5f;
+
+        if (rnd < pLeft) {
+            nodeIndex = left;
+            rnd = std::min(rnd / pLeft, OneMinusEpsilon);
+            pmf *= pLeft;
+        } else {
+            nodeIndex = right;
+            rnd = std::min((rnd - pLeft) / (1 - pLeft), OneMinusEpsilon);
+            pmf *= 1 - pLeft;
+        }
+    }
+    return m_bounded[m_nodes[nodeIndex].offset];
+}
+
+float LightSampler::pmfBounded(const Point3f &p, const Normal3f &n, uint32_t index) const {
+    if (m_strategy == EPower)
+        return m_power[index];
+
+    /* Same probabilities as in sampleBounded(), from the leaf up to the root */
+    float pmf = 1.0f;
+    uint32_t nodeIndex = m_leaves[index];
+    while (nodeIndex != 0) {
+        uint32_t parent = m_nodes[nodeIndex].parent;
+        uint32_t left = parent + 1, right = m_nodes[parent].offset;
+        float importanceLeft = m_nodes[left].bounds.importance(p, n);
+        float importanceRight = m_nodes[right].bounds.importance(p, n);
+        float sum = importanceLeft + importanceRight;
+        float pLeft = sum > 0 ? importanceLeft / sum : 0.5f;
+
+        pmf *= nodeIndex == left ? pLeft : 1 - pLeft;
+        nodeIndex = parent;
+    }
+    return pmf;
+}
+
+std::string LightSampler::toString() const {
+    const char *names[] = { "uniform", "power", "bvh" };
+    return tfm::format(
+        "LightSampler[strategy = %s, emitters = %i, infinite = %i, nodes = %i]",
+        names[m_strategy], m_emitters.size(), m_infinite.size(), m_nodes.size());
+}
+
+NORI_NAMESPACE_END
@@ -37,6 +37,27 @@ void Mesh::activate() {
     m_pdf.normalize();
 }
 
+void Mesh::setVertexPositions(const MatrixXf &positions, const MatrixXf &normals) {
+    if (positions.rows() != 3 || positions.cols() != m_V.cols())
+        throw NoriException("Mesh::setVertexPositions(): expected 3x%i positions!", m_V.cols());
+    if (m_N.size() > 0 && (normals.rows() != 3 || normals.cols() != m_V.cols()))
+        throw NoriException("Mesh::setVertexPositions(): expected 3x%i normals!", m_V.cols());
+
+    m_V = positions;
+    if (m_N.size() > 0)
+        m_N = normals;
+
+    m_bbox.reset();
+    for (uint32_t i = 0; i < getVertexCount(); ++i)
+        m_bbox.expandBy(m_V.col(i));
+
+    /* Triangle areas have changed, update the sampling distribution */
+    m_pdf.clear();
+    for (uint32_t i = 0; i < getPrimitiveCount(); ++i)
+        m_pdf.append(surfaceArea(i));
+    m_pdf.normalize();
+}
+
 void Mesh::sampleSurface(ShapeQueryRecord & sRec, const Point2f & sample) const {
     Point2f s = sample;
     size_t idT = m_pdf.sampleReuse(s.x());
@@ -80,7 +101,7 @@ float Mesh::surfaceArea(uint32_t index) const {
     return 0.5f * Vector3f((p1 - p0).cross(p2 - p0)).norm();
 }
 
-bool Mesh::rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const {
+bool Mesh::rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t, uint32_t &) const {
     uint32_t i0 = m_F(0, index), i1 = m_F(1, index), i2 = m_F(2, index);
     const Point3f p0 = m_V.col(i0), p1 = m_V.col(i1), p2 = m_V.col(i2);
 
@@ -119,7 +140,14 @@ bool Mesh::rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, fl
     return t >= ray.mint && t <= ray.maxt;
 }
 
-void Mesh::setHitInformation(uint32_t index, const Ray3f &ray, Intersection & its) const {
+bool Mesh::getTriangle(uint32_t index, Point3f &p0, Point3f &p1, Point3f &p2) const {
+    p0 = m_V.col(m_F(0, index));
+    p1 = m_V.col(m_F(1, index));
+    p2 = m_V.col(m_F(2, index));
+    return true;
+}
+
+void Mesh::setHitInformation(uint32_t index, uint32_t, const Ray3f &ray, Intersection & its) const {
     /* Find the barycentric coordinates */
     Vector3f bary;
     bary << 1-its.uv.sum(), its.uv;
@@ -18,6 +18,7 @@
 
 #include <nori/mesh.h>
 #include <nori/timer.h>
+#include <nori/cache.h>
 #include <filesystem/resolver.h>
 #include <unordered_map>
 #include <fstream>
@@ -30,8 +31,6 @@ NORI_NAMESPACE_BEGIN
 class WavefrontOBJ : public Mesh {
 public:
     WavefrontOBJ(const PropertyList &propList) {
-        typedef std::unordered_map<OBJVertex, uint32_t, OBJVertexHash> VertexMap;
-
         filesystem::path filename =
             getFileResolver()->resolve(propList.getString("filename"));
 
@@ -44,6 +43,36 @@ public:
         cout.flush();
         Timer timer;
 
+        /* The parsed mesh only depends on the contents of the file and the transformation */
+        uint64_t key = 0;
+        bool cached = false;
+        if (Cache::isEnabled()) {
+            MappedFile source(filename.str());
+            key = Hasher().add(std::string("obj")).add(Cache::Version)
+                .add(source.getData(), source.getSize())
+                .add(trafo.getMatrix()).get();
+            cached = loadFromCache(key);
+        }
+
+        if (!cached) {
+            parse(is, trafo);
+            if (Cache::isEnabled())
+                storeToCache(key);
+        }
+
+        m_name = filename.str();
+        cout << "done. (V=" << m_V.cols() << ", F=" << m_F.cols() << ", took "
+             << timer.elapsedString() << " and "
+             << memString(m_F.size() * sizeof(uint32_t) +
+                          sizeof(float) * (m_V.size() + m_N.size() + m_UV.size()))
+             << (cached ? ", cached" : "") << ")" << endl;
+    }
+
+protected:
+    /// Parse the OBJ file and transform it into world space
+    void parse(std::istream &is, const Transform &trafo) {
+        typedef std::unordered_map<OBJVertex, uint32_t, OBJVertexHash> VertexMap;
+
         std::vector<Vector3f>   positions;
         std::vector<Vector2f>   texcoords;
         std::vector<Vector3f>   normals;
@@ -122,16 +151,66 @@ public:
             for (uint32_t i=0; i<vertices.size(); ++i)
                 m_UV.col(i) = texcoords.at(vertices[i].uv-1);
         }
+    }
 
-        m_name = filename.str();
-        cout << "done. (V=" << m_V.cols() << ", F=" << m_F.cols() << ", took "
-             << timer.elapsedString() << " and "
-             << memString(m_F.size() * sizeof(uint32_t) +
-                          sizeof(float) * (m_V.size() + m_N.size() + m_UV.size()))
-             << ")" << endl;
+    /// Layout of the first section of a cached mesh
+    struct CacheHeader {
+        uint32_t vertexCount, faceCount;
+        uint32_t hasNormals, hasTexCoords;
+        float bboxMin[3], bboxMax[3];
+    };
+
+    /// Copy the arrays of a cached mesh (returns \c false if it isn't cached)
+    bool loadFromCache(uint64_t key) {
+        std::unique_ptr<Cache::Entry> entry = Cache::load("mesh", key);
+        if (!entry || entry->getSectionCount() != 5 ||
+            entry->getSectionSize(0) != sizeof(CacheHeader))
+            return false;
+
+        const CacheHeader &header = *static_cast<const CacheHeader *>(entry->getSection(0));
+        size_t vertexCount = header.vertexCount, faceCount = header.faceCount;
+        if (entry->getSectionSize(1) != sizeof(float) * 3 * vertexCount ||
+            entry->getSectionSize(2) != (header.hasNormals ? sizeof(float) * 3 * vertexCount : 0) ||
+            entry->getSectionSize(3) != (header.hasTexCoords ? sizeof(float) * 2 * vertexCount : 0) ||
+            entry->getSectionSize(4) != sizeof(uint32_t) * 3 * faceCount)
+            return false;
+
+        m_V.resize(3, vertexCount);
+        m_N.resize(header.hasNormals ? 3 : 0, header.hasNormals ? vertexCount : 0);
+        m_UV.resize(header.hasTexCoords ? 2 : 0, header.hasTexCoords ? vertexCount : 0);
+        m_F.resize(3, faceCount);
+        memcpy(m_V.data(), entry->getSection(1), entry->getSectionSize(1));
+        /* Normals and texture coordinates are optional (empty sections) */
+        if (entry->getSectionSize(2) > 0)
+            memcpy(m_N.data(), entry->getSection(2), entry->getSectionSize(2));
+        if (entry->getSectionSize(3) > 0)
+            memcpy(m_UV.data(), entry->getSection(3), entry->getSectionSize(3));
+        memcpy(m_F.data(), entry->getSection(4), entry->getSectionSize(4));
+        m_bbox = BoundingBox3f(Point3f(header.bboxMin[0], header.bboxMin[1], header.bboxMin[2]),
+                               Point3f(header.bboxMax[0], header.bboxMax[1], header.bboxMax[2]));
+        return true;
+    }
+
+    void storeToCache(uint64_t key) const {
+        CacheHeader header;
+        header.vertexCount = (uint32_t) m_V.cols();
+        header.faceCount = (uint32_t) m_F.cols();
+        header.hasNormals = m_N.size() > 0;
+        header.hasTexCoords = m_UV.size() > 0;
+        for (int i = 0; i < 3; ++i) {
+            header.bboxMin[i] = m_bbox.min[i];
+            header.bboxMax[i] = m_bbox.max[i];
+        }
+
+        Cache::store("mesh", key, {
+            { &header, sizeof(CacheHeader) },
+            { m_V.data(), sizeof(float) * m_V.size() },
+            { m_N.data(), sizeof(float) * m_N.size() },
+            { m_UV.data(), sizeof(float) * m_UV.size() },
+            { m_F.data(), sizeof(uint32_t) * m_F.size() }
+        });
     }
 
-protected:
     /// Vertex indices used by the OBJ format
     struct OBJVertex {
         uint32_t p = (uint32_t) -1;
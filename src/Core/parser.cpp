@@ -68,6 +68,7 @@ NoriObject *loadFromXML(const std::string &filename) {
         ESampler              = NoriObject::ESampler,
         ETest                 = NoriObject::ETest,
         EReconstructionFilter = NoriObject::EReconstructionFilter,
+        EShapeGroup           = NoriObject::EShapeGroup,
 
         /* Properties */
         EBoolean = NoriObject::EClassTypeCount,
@@ -84,6 +85,9 @@ NoriObject *loadFromXML(const std::string &filename) {
         EScale,
         ELookAt,
 
+        /* Reference to an object declared before */
+        ERef,
+
         EInvalid
     };
 
@@ -101,6 +105,8 @@ NoriObject *loadFromXML(const std::string &filename) {
     tags["sampler"]    = ESampler;
     tags["rfilter"]    = EReconstructionFilter;
     tags["test"]       = ETest;
+    tags["shapegroup"] = EShapeGroup;
+    tags["instance"]   = EMesh;
     tags["boolean"]    = EBoolean;
     tags["integer"]    = EInteger;
     tags["float"]      = EFloat;
@@ -114,6 +120,7 @@ NoriObject *loadFromXML(const std::string &filename) {
     tags["rotate"]     = ERotate;
     tags["scale"]      = EScale;
     tags["lookat"]     = ELookAt;
+    tags["ref"]        = ERef;
 
     /* Helper function to check if attributes are fully specified */
     auto check_attributes = [&](const pugi::xml_node &node, std::set<std::string> attrs) {
@@ -131,6 +138,10 @@ NoriObject *loadFromXML(const std::string &filename) {
 
     Eigen::Affine3f transform;
 
+    /* Objects declared with an 'id' attribute. Only shape groups can be referenced
+       using <ref id=".."/>, since every other object is owned by its parent */
+    std::map<std::string, NoriObject *> objectsById;
+
     /* Helper function to parse a Nori XML node (recursive) */
     std::function<NoriObject *(pugi::xml_node &, PropertyList &, int)> parseTag = [&](
         pugi::xml_node &node, PropertyList &list, int parentTag) -> NoriObject * {
@@ -170,8 +181,21 @@ NoriObject *loadFromXML(const std::string &filename) {
             throw NoriException("Error while parsing \"%s\": node \"%s\" requires a Nori object as parent (at %s)",
                                 filename, node.name(), offset(node.offset_debug()));
 
+        /* Shape groups are owned by the scene and shared by the instances */
+        if (tag == EShapeGroup && parentTag != EScene)
+            throw NoriException("Error while parsing \"%s\": shape groups must be declared "
+                                "directly in the scene (at %s)", filename, offset(node.offset_debug()));
+
+        if (tag == ERef && std::string(node.parent().name()) != "instance")
+            throw NoriException("Error while parsing \"%s\": shape groups can only be "
+                                "referenced from an instance (at %s)", filename, offset(node.offset_debug()));
+
         if (tag == EScene)
             node.append_attribute("type") = "scene";
+        else if (tag == EShapeGroup)
+            node.append_attribute("type") = "shapegroup";
+        else if (std::string(node.name()) == "instance")
+            node.append_attribute("type") = "instance";
         else if (tag == ETransform)
             transform.setIdentity();
 
@@ -214,6 +238,11 @@ NoriObject *loadFromXML(const std::string &filename) {
 
                 /* Activate / configure the object */
                 result->activate();
+
+                /* Remember it, if it can be referenced */
+                std::string id = node.attribute("id").value();
+                if (!id.empty() && !objectsById.insert(std::make_pair(id, result)).second)
+                    throw NoriException("Duplicate object id \"%s\"", id);
             } else {
                 /* This is a property */
                 switch (tag) {
@@ -322,6 +351,19 @@ NoriObject *loadFromXML(const std::string &filename) {
                         }
                         break;
 
+                    case ERef: {
+                            check_attributes(node, { "id" });
+                            auto it = objectsById.find(node.attribute("id").value());
+                            if (it == objectsById.end())
+                                throw NoriException("Reference to undeclared object \"%s\"",
+                                                    node.attribute("id").value());
+                            if (it->second->getClassType() != NoriObject::EShapeGroup)
+                                throw NoriException("Reference to \"%s\": only shape groups can be referenced",
+                                                    node.attribute("id").value());
+                            result = it->second;
+                        }
+                        break;
+
                     default: throw NoriException("Unhandled element \"%s\"", node.name());
                 };
             }
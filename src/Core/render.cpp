@@ -25,7 +25,8 @@
 #include <nori/bitmap.h>
 #include <nori/sampler.h>
 #include <nori/integrator.h>
-#include <nori/gui.h>
+#include <nori/packet.h>
+#include <nori/stats.h>
 #include <tbb/parallel_for.h>
 #include <tbb/blocked_range.h>
 #include <filesystem/resolver.h>
@@ -69,36 +70,128 @@ float RenderThread::getProgress() {
     else return 1.f;
 }
 
-static void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block) {
+#if defined(NORI_STATISTICS)
+/// Add traversal work to a pixel of the cost image (R: visited nodes, G: primitive tests, B: rays)
+static void addCost(Bitmap *cost, const Point2i &pixel, const TraversalStatistics &work, float weight = 1.f) {
+    cost->coeffRef(pixel.y(), pixel.x()) += Color3f((float) work.nodes,
+        (float) work.primitives, (float) work.getRayCount()) * weight;
+}
+#endif
+
+/**
+ * \brief Render one sample per pixel of the given block (adds to the block's
+ * contents) and advance the sampler
+ *
+ * Integrators that use splats (see \ref Integrator::usesSplats()) also add
+ * to \c splats. With traversal statistics, the work of every pixel is also
+ * added to \c cost. Work shared by several pixels (packets, wavefront
+ * batches) is distributed evenly among them.
+ */
+static void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block,
+                        SplatBuffer *splats, Bitmap *cost) {
     const Camera *camera = scene->getCamera();
     const Integrator *integrator = scene->getIntegrator();
 
     Point2i offset = block.getOffset();
     Vector2i size  = block.getSize();
 
-    /* Clear the block contents */
-    block.clear();
+    /* Wavefront integrators process the camera rays of the entire block at once */
+    if (integrator->isWavefront()) {
+        std::vector<Ray3f> rays;
+        std::vector<Point2i> pixels;
+        std::vector<Point2f> pixelSamples;
+        std::vector<Color3f> values, radiance;
+        rays.reserve(size.prod());
+        pixels.reserve(size.prod());
+        pixelSamples.reserve(size.prod());
+        values.reserve(size.prod());
+
+        for (int y=0; y<size.y(); ++y) {
+            for (int x=0; x<size.x(); ++x) {
+                Point2i pixel(x + offset.x(), y + offset.y());
+                sampler->generate(pixel);
+
+                Point2f pixelSample = Point2f((float) (x + offset.x()), (float) (y + offset.y())) + sampler->next2D();
+                Point2f apertureSample = sampler->next2D();
+
+                Ray3f ray;
+                values.push_back(camera->sampleRay(ray, pixelSample, apertureSample));
+                pixels.push_back(pixel);
+                pixelSamples.push_back(pixelSample);
+                rays.push_back(ray);
+            }
+        }
 
-    /* For each pixel and pixel sample sample */
-    for (int y=0; y<size.y(); ++y) {
-        for (int x=0; x<size.x(); ++x) {
-            Point2f pixelSample = Point2f((float) (x + offset.x()), (float) (y + offset.y())) + sampler->next2D();
-            Point2f apertureSample = sampler->next2D();
+        NORI_STAT(TraversalStatistics before = TraversalStatistics::local());
+        integrator->LiBatch(scene, sampler, rays, pixels, radiance);
+        NORI_STAT(TraversalStatistics work = TraversalStatistics::local() - before);
 
-            /* Sample a ray from the camera */
-            Ray3f ray;
-            Color3f value = camera->sampleRay(ray, pixelSample, apertureSample);
+        for (size_t i=0; i<rays.size(); ++i) {
+            block.put(pixelSamples[i], values[i] * radiance[i]);
+            NORI_STAT(addCost(cost, pixels[i], work, 1.f / rays.size()));
+        }
+        sampler->advance();
+        return;
+    }
 
-            /* Compute the incident radiance */
-            value *= integrator->Li(scene, sampler, ray);
+    /* Camera rays of neighboring pixels are traced together as a packet */
+    bool usePackets = integrator->usesPrimaryHits();
+    RayPacket packet;
+    HitPacket hits;
+    Point2i pixels[NORI_PACKET_SIZE];
+    Point2f pixelSamples[NORI_PACKET_SIZE];
+    Color3f values[NORI_PACKET_SIZE];
+
+    for (int py=0; py<size.y(); py += NORI_PACKET_WIDTH) {
+        for (int px=0; px<size.x(); px += NORI_PACKET_WIDTH) {
+            packet.clear();
+
+            /* For each pixel in the packet, sample a ray from the camera */
+            for (int y=py; y<std::min(py + NORI_PACKET_WIDTH, size.y()); ++y) {
+                for (int x=px; x<std::min(px + NORI_PACKET_WIDTH, size.x()); ++x) {
+                    Point2i pixel(x + offset.x(), y + offset.y());
+                    sampler->generate(pixel);
+
+                    Point2f pixelSample = Point2f((float) (x + offset.x()), (float) (y + offset.y())) + sampler->next2D();
+                    Point2f apertureSample = sampler->next2D();
+
+                    Ray3f ray;
+                    values[packet.size] = camera->sampleRay(ray, pixelSample, apertureSample);
+                    pixels[packet.size] = pixel;
+                    pixelSamples[packet.size] = pixelSample;
+                    packet.append(ray);
+                }
+            }
 
-            /* Store in the image block */
-            block.put(pixelSample, value);
+            NORI_STAT(TraversalStatistics before = TraversalStatistics::local());
+            if (usePackets)
+                scene->rayIntersect(packet, hits);
+            NORI_STAT(TraversalStatistics packetWork = TraversalStatistics::local() - before);
+
+            for (uint32_t i=0; i<packet.size; ++i) {
+                /* Compute the incident radiance (resuming the sample after the camera dimensions) */
+                const Ray3f &ray = packet.rays[i];
+                NORI_STAT(before = TraversalStatistics::local());
+                sampler->generate(pixels[i], NORI_CAMERA_DIMENSIONS);
+                if (usePackets)
+                    values[i] *= integrator->LiFromHit(scene, sampler, ray, hits.hit(i) ? &hits.its[i] : nullptr);
+                else if (splats)
+                    values[i] *= integrator->LiSplat(scene, sampler, ray, *splats);
+                else
+                    values[i] *= integrator->Li(scene, sampler, ray);
+
+                /* Store in the image block */
+                block.put(pixelSamples[i], values[i]);
+                NORI_STAT(addCost(cost, pixels[i], TraversalStatistics::local() - before));
+                NORI_STAT(addCost(cost, pixels[i], packetWork, 1.f / packet.size));
+            }
         }
     }
+
+    sampler->advance();
 }
 
-void RenderThread::renderScene(const std::string & filename) {
+bool RenderThread::renderScene(const std::string & filename) {
 
     filesystem::path path(filename);
 
@@ -114,6 +207,26 @@ void RenderThread::renderScene(const std::string & filename) {
         m_scene = static_cast<Scene *>(root);
 
         const Camera *camera_ = m_scene->getCamera();
+        if (!m_samplerType.empty()) {
+            PropertyList props;
+            props.setInteger("sampleCount", (int) m_scene->getSampler()->getSampleCount());
+            Sampler *sampler = static_cast<Sampler *>(
+                NoriObjectFactory::createInstance(m_samplerType, props));
+            if (sampler->getClassType() != NoriObject::ESampler) {
+                delete sampler;
+                throw NoriException("\"%s\" is not a sampler!", m_samplerType);
+            }
+            sampler->activate();
+            m_scene->setSampler(sampler);
+        }
+        if (m_sampleCount > 0)
+            m_scene->getSampler()->setSampleCount(m_sampleCount);
+        if (m_samplesPerPass > 0)
+            m_scene->setSamplesPerPass(m_samplesPerPass);
+        if (m_targetError >= 0)
+            m_scene->setTargetError(m_targetError);
+        if (m_timeBudget >= 0)
+            m_scene->setTimeBudget(m_timeBudget);
         m_scene->getIntegrator()->preprocess(m_scene);
 
         /* Allocate memory for the entire output image and clear it */
@@ -121,7 +234,8 @@ void RenderThread::renderScene(const std::string & filename) {
         m_block.clear();
 
         /* Determine the filename of the output bitmap */
-        std::string outputName = filename;
+        std::string outputName = m_outputName.empty() ? filename : m_outputName;
+        bool saveLDR = endsWith(toLower(outputName), ".png");
         size_t lastdot = outputName.find_last_of(".");
         if (lastdot != std::string::npos)
             outputName.erase(lastdot, std::string::npos);
@@ -129,13 +243,32 @@ void RenderThread::renderScene(const std::string & filename) {
 
         /* Do the following in parallel and asynchronously */
         m_render_status = 1;
-        m_render_thread = std::thread([this,outputName] {
+        m_progress = 0.f;
+        m_render_thread = std::thread([this,outputName,saveLDR] {
             const Camera *camera = m_scene->getCamera();
             Vector2i outputSize = camera->getOutputSize();
 
             /* Create a block generator (i.e. a work scheduler) */
             BlockGenerator blockGenerator(outputSize, NORI_BLOCK_SIZE);
 
+#if defined(NORI_STATISTICS)
+            /* Traversal work per pixel (blocks don't overlap, so no locking is needed) */
+            Bitmap cost(outputSize);
+            cost.setConstant(Color3f(0.f));
+            Bitmap *costImage = &cost;
+            TraversalStatistics::reset();
+#else
+            Bitmap *costImage = nullptr;
+#endif
+
+            /* Contributions of light paths connected to the camera */
+            SplatBuffer splatBuffer;
+            SplatBuffer *splats = nullptr;
+            if (m_scene->getIntegrator()->usesSplats()) {
+                splatBuffer.init(outputSize);
+                splats = &splatBuffer;
+            }
+
             cout << "Rendering .. ";
             cout.flush();
             Timer timer;
@@ -146,21 +279,57 @@ void RenderThread::renderScene(const std::string & filename) {
             tbb::concurrent_vector< std::unique_ptr<Sampler> > samplers;
             samplers.resize(numBlocks);
 
-            // VARIANCE ACQUISITION
-            ImageBlock curBlock(camera->getOutputSize(), camera->getReconstructionFilter());
-            Bitmap sBitmap(camera->getOutputSize());
-            Bitmap ssBitmap(camera->getOutputSize());
-
-
-            for (uint32_t k = 0; k < numSamples ; ++k) {
+            /* Each pass renders 'samplesPerPass' samples per pixel of a block
+               before moving on to the next block, which keeps the block's data
+               in cache and amortizes the scheduling and the barrier at the end
+               of the pass. The image is merged (and can be previewed) after
+               every pass. */
+            uint32_t samplesPerPass = std::max(1u, m_scene->getSamplesPerPass());
+
+            /* Adaptive sampling: blocks whose relative error drops below the
+               target are retired, and the sample budget of numSamples samples
+               for all blocks is spent on the remaining ones instead (up to
+               ADAPTIVE_MAX_FACTOR * numSamples samples per block). With a time
+               budget, passes continue until the time is up. */
+            const uint32_t ADAPTIVE_MIN_PASSES = 8, ADAPTIVE_MAX_FACTOR = 4;
+            float targetError = m_scene->getTargetError();
+            float timeBudget = m_scene->getTimeBudget();
+            bool adaptive = targetError > 0;
+            uint64_t budget = (uint64_t) numSamples * numBlocks, used = 0;
+            uint64_t maxSamples = (uint64_t) numSamples;
+            if (timeBudget > 0)
+                maxSamples = std::numeric_limits<uint64_t>::max();
+            else if (adaptive)
+                maxSamples = (uint64_t) numSamples * ADAPTIVE_MAX_FACTOR;
+            uint32_t minPasses = std::max(2u, std::min(ADAPTIVE_MIN_PASSES,
+                (uint32_t) (numSamples + samplesPerPass - 1) / samplesPerPass));
+
+            std::vector<uint32_t> blockPasses(numBlocks, 0), blockSampleCount(numBlocks, 0);
+            std::vector<uint8_t> blockActive(numBlocks, 1);
+            std::vector<Point2i> blockOffset(numBlocks);
+            std::vector<Vector2i> blockSize(numBlocks);
+            std::atomic<uint32_t> activeBlocks(numBlocks);
+
+            /* Per-pixel statistics of the passes (for adaptive sampling and the variance output) */
+            m_block.initMoments();
+
+            /* All active blocks have received the same number of samples so far */
+            for (uint64_t k = 0; k < maxSamples && activeBlocks > 0; k += samplesPerPass) {
+                if (timeBudget > 0) {
+                    if (k > 0 && timer.elapsed() >= timeBudget * 1000)
+                        break;
+                    m_progress = std::min(1.f, (float) timer.elapsed() / (timeBudget * 1000));
+                } else {
+                    if (used >= budget)
+                        break;
+                    m_progress = used / (float) budget;
+                }
 
-            	// VARIANCE ACQUISITION
-            	curBlock.clear();
-
-                m_progress = k/float(numSamples);
                 if(m_render_status == 2)
                     break;
 
+                uint32_t passSamples = (uint32_t) std::min((uint64_t) samplesPerPass, maxSamples - k);
+                used += (uint64_t) activeBlocks * passSamples;
                 tbb::blocked_range<int> range(0, numBlocks);
 
                 auto map = [&](const tbb::blocked_range<int> &range) {
@@ -178,15 +347,35 @@ void RenderThread::renderScene(const std::string & filename) {
                             std::unique_ptr<Sampler> sampler(m_scene->getSampler()->clone());
                             sampler->prepare(block);
                             samplers.at(blockId) = std::move(sampler);
+                            blockOffset[blockId] = block.getOffset();
+                            blockSize[blockId] = block.getSize();
                         }
 
-                        // Render all contained pixels
-                        renderBlock(m_scene, samplers.at(blockId).get(), block);
+                        // Skip blocks that have already converged
+                        if (!blockActive[blockId])
+                            continue;
+
+                        // Render all contained pixels, several times (stop early when aborting)
+                        block.clear();
+                        uint32_t j = 0;
+                        for (; j < passSamples && (j == 0 || m_render_status != 2); ++j)
+                            renderBlock(m_scene, samplers.at(blockId).get(), block, splats, costImage);
+                        blockSampleCount[blockId] += j;
 
                         // The image block has been processed. Now add it to the "big" block that represents the entire image
+                        // (only the borders shared with neighboring blocks are locked)
                         m_block.put(block);
-                        // VARIANCE ACQUISITION
-                        curBlock.put(block);
+
+                        // Update the pixel statistics (blocks don't overlap, so no locking is needed)
+                        m_block.putMoments(block, j);
+                        uint32_t n = ++blockPasses[blockId];
+
+                        // Retire the block once its relative error is below the target
+                        if (adaptive && n >= minPasses &&
+                            m_block.getRelativeError(block.getOffset(), block.getSize()) < targetError) {
+                            blockActive[blockId] = 0;
+                            activeBlocks--;
+                        }
                     }
                 };
 
@@ -196,40 +385,62 @@ void RenderThread::renderScene(const std::string & filename) {
                 /// Default: parallel rendering
                 tbb::parallel_for(range, map);
 
-                // VARIANCE ACQUISITION
-                curBlock.lock();
-                Bitmap curBitmap(*curBlock.toBitmap());
-                curBlock.unlock();
-				for (int i = 0; i < curBitmap.rows(); ++ i) {
-					for (int j = 0; j < curBitmap.cols(); ++ j) {
-						ssBitmap(i,j) += curBitmap(i,j) * curBitmap(i,j);
-						sBitmap(i,j) += curBitmap(i,j);
-					}
-				}
-
                 blockGenerator.reset();
             }
 
             cout << "done. (took " << timer.elapsedString() << ")" << endl;
+            cout << "Merge contention: " << timeString(m_block.getContentionTime())
+                 << " waiting for locks (" << m_block.getContentionCount()
+                 << " contended acquisitions)" << endl;
+
+            if (adaptive || timeBudget > 0) {
+                uint32_t minCount = *std::min_element(blockSampleCount.begin(), blockSampleCount.end());
+                uint32_t maxCount = *std::max_element(blockSampleCount.begin(), blockSampleCount.end());
+                uint64_t pixelSamples = 0;
+                for (int id = 0; id < numBlocks; ++id)
+                    pixelSamples += (uint64_t) blockSampleCount[id] * blockSize[id].prod();
+                cout << tfm::format("Adaptive sampling: %.1f samples/pixel on average (%i-%i), "
+                    "%i/%i blocks converged", pixelSamples / (float) outputSize.prod(),
+                    minCount, maxCount, numBlocks - (int) activeBlocks.load(), numBlocks) << endl;
+            }
+
+#if defined(NORI_STATISTICS)
+            uint64_t sampleTotal = 0;
+            for (int id = 0; id < numBlocks; ++id)
+                sampleTotal += (uint64_t) blockSampleCount[id] * blockSize[id].prod();
+            cout << TraversalStatistics::aggregate().toString(timer.elapsed(), sampleTotal) << endl;
+
+            /* Normalize the cost image to the work per sample */
+            for (int id = 0; id < numBlocks; ++id) {
+                float scale = 1.f / std::max(blockSampleCount[id], 1u);
+                for (int y = 0; y < blockSize[id].y(); ++y)
+                    for (int x = 0; x < blockSize[id].x(); ++x)
+                        cost(blockOffset[id].y() + y, blockOffset[id].x() + x) *= scale;
+            }
+            cost.save(outputName.substr(0, outputName.size() - 4) + "_cost.exr");
+#endif
 
             /* Now turn the rendered image block into
                a properly normalized bitmap */
             m_block.lock();
+            if (splats) {
+                /* The splats of each sample cover the entire image, so they are
+                   divided by the average number of samples per pixel */
+                uint64_t sampleTotal = 0;
+                for (int id = 0; id < numBlocks; ++id)
+                    sampleTotal += (uint64_t) blockSampleCount[id] * blockSize[id].prod();
+                if (sampleTotal > 0)
+                    m_block.putSplats(*splats, outputSize.prod() / (float) sampleTotal);
+            }
             std::unique_ptr<Bitmap> bitmap(m_block.toBitmap());
+            std::unique_ptr<Bitmap> varBitmap(m_block.toVarianceBitmap());
             m_block.unlock();
 
             /* Save using the OpenEXR format */
             bitmap->save(outputName);
-
-            // VARIANCE ACQUISITION
-            Bitmap varBitmap(camera->getOutputSize());
-            for (int i = 0; i < varBitmap.rows(); ++ i) {
-				for (int j = 0; j < varBitmap.cols(); ++ j) {
-					// extra numsamples division was proposed on forum and significantly improves denoising
-					varBitmap(i,j) = (ssBitmap(i,j) - sBitmap(i,j) * sBitmap(i,j) / numSamples) / ((numSamples - 1) * numSamples);
-				}
-            }
-            varBitmap.save(outputName.substr(0, outputName.size() - 4) + "_var.exr");
+            if (saveLDR)
+                bitmap->saveToLDR(outputName.substr(0, outputName.size() - 4) + ".png");
+            varBitmap->save(outputName.substr(0, outputName.size() - 4) + "_var.exr");
 
             delete m_scene;
             m_scene = nullptr;
@@ -239,11 +450,12 @@ void RenderThread::renderScene(const std::string & filename) {
             cout << "All Done! \n";
         });
 
+        return true;
     }
     else {
         delete root;
+        return false;
     }
-
 }
 
 
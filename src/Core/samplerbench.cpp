@@ -0,0 +1,166 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob, Romain Prévost
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* =======================================================================
+     Sampler convergence benchmark: renders a scene with each sampler at
+     1, 2, 4, .. samples per pixel and reports the RMSE with respect to
+     a high sample count reference.
+ * ======================================================================= */
+
+#include <nori/block.h>
+#include <nori/bitmap.h>
+#include <nori/render.h>
+#include <nori/timer.h>
+#include <filesystem/path.h>
+#include <tbb/task_scheduler_init.h>
+#include <chrono>
+#include <cstdio>
+#include <iomanip>
+
+static void printUsage(const char *name) {
+    std::cerr << "Syntax: " << name << " [options] <scene.xml>" << std::endl
+              << "Options:" << std::endl
+              << "   -t <count>   Number of rendering threads (default: all cores)" << std::endl
+              << "   -n <count>   Highest number of samples per pixel (default: 64)" << std::endl
+              << "   -r <file>    Reference image (default: render one with 16x the samples)" << std::endl
+              << "   -p <types>   Comma-separated list of samplers (default: independent,sobol,halton,cmj)" << std::endl;
+}
+
+using namespace nori;
+
+/// Render the scene with the given sampler and return the image
+static Bitmap *render(const std::string &filename, const std::string &samplerType,
+                      uint32_t sampleCount, const std::string &outputName) {
+    ImageBlock block(Vector2i(1, 1), nullptr);
+    RenderThread renderThread(block);
+    renderThread.setSamplerType(samplerType);
+    renderThread.setSampleCount(sampleCount);
+    renderThread.setTargetError(0);
+    renderThread.setTimeBudget(0);
+    renderThread.setOutputName(outputName);
+
+    if (!renderThread.renderScene(filename))
+        throw NoriException("\"%s\" does not describe a scene!", filename);
+    while (renderThread.isBusy())
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    return block.toBitmap();
+}
+
+/// Root mean square error over all pixels and channels
+static float rmse(const Bitmap &image, const Bitmap &reference) {
+    if (image.rows() != reference.rows() || image.cols() != reference.cols())
+        throw NoriException("The reference image has the wrong resolution!");
+
+    double sum = 0;
+    for (int y = 0; y < image.rows(); ++y) {
+        for (int x = 0; x < image.cols(); ++x) {
+            Color3f diff = image.coeff(y, x) - reference.coeff(y, x);
+            sum += diff.matrix().squaredNorm();
+        }
+    }
+    return (float) std::sqrt(sum / (3.0 * image.rows() * image.cols()));
+}
+
+int main(int argc, char **argv) {
+    int threadCount = tbb::task_scheduler_init::automatic;
+    uint32_t maxSamples = 64;
+    std::string referenceName, filename;
+    std::vector<std::string> samplers = { "independent", "sobol", "halton", "cmj" };
+
+    try {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if ((arg == "-t" || arg == "-n" || arg == "-r" || arg == "-p") && i + 1 < argc) {
+                std::string value = argv[++i];
+                if (arg == "-t")
+                    threadCount = toInt(value);
+                else if (arg == "-n")
+                    maxSamples = toUInt(value);
+                else if (arg == "-r")
+                    referenceName = value;
+                else
+                    samplers = tokenize(value, ",");
+            } else if (arg[0] != '-' && filename.empty()) {
+                filename = arg;
+            } else {
+                printUsage(argv[0]);
+                return -1;
+            }
+        }
+
+        if (filename.empty() || filesystem::path(filename).extension() != "xml" || samplers.empty()) {
+            printUsage(argv[0]);
+            return -1;
+        }
+        if (maxSamples == 0)
+            throw NoriException("The sample count must be positive");
+
+        tbb::task_scheduler_init init(threadCount);
+        const std::string tempName = "samplerbench_tmp.exr";
+
+        std::unique_ptr<Bitmap> reference;
+        if (!referenceName.empty()) {
+            reference.reset(new Bitmap(referenceName));
+        } else {
+            cout << "Rendering the reference with " << 16 * maxSamples << " samples/pixel .." << endl;
+            reference.reset(render(filename, "independent", 16 * maxSamples, tempName));
+        }
+
+        /* Rows: sample counts, columns: RMSE of each sampler */
+        std::vector<uint32_t> sampleCounts;
+        for (uint32_t spp = 1; spp <= maxSamples; spp *= 2)
+            sampleCounts.push_back(spp);
+        std::vector<std::vector<float>> errors(sampleCounts.size());
+
+        for (size_t i = 0; i < sampleCounts.size(); ++i) {
+            for (const std::string &sampler : samplers) {
+                Timer timer;
+                std::unique_ptr<Bitmap> image(render(filename, sampler, sampleCounts[i], tempName));
+                errors[i].push_back(rmse(*image, *reference));
+                cout << tfm::format("%s, %i samples/pixel: RMSE %.6f (took %s)", sampler,
+                    sampleCounts[i], errors[i].back(), timer.elapsedString()) << endl;
+            }
+        }
+        std::remove(tempName.c_str());
+        std::remove("samplerbench_tmp_var.exr");
+
+        cout << endl << std::setw(6) << "spp";
+        for (const std::string &sampler : samplers)
+            cout << std::setw(14) << sampler;
+        cout << endl;
+        for (size_t i = 0; i < sampleCounts.size(); ++i) {
+            cout << std::setw(6) << sampleCounts[i];
+            for (float error : errors[i])
+                cout << std::setw(14) << std::fixed << std::setprecision(6) << error;
+            cout << endl;
+        }
+
+        /* Summarize: how many more samples would the first sampler need? (RMSE ~ 1/sqrt(spp)) */
+        cout << endl << "Relative efficiency at " << sampleCounts.back() << " samples/pixel "
+             << "(samples saved compared to " << samplers[0] << "):" << endl;
+        for (size_t j = 1; j < samplers.size(); ++j) {
+            float ratio = errors.back()[0] / errors.back()[j];
+            cout << tfm::format("  %s: %.2fx", samplers[j], ratio * ratio) << endl;
+        }
+    } catch (const std::exception &e) {
+        cerr << "Fatal error: " << e.what() << endl;
+        return -1;
+    }
+    return 0;
+}
@@ -25,12 +25,41 @@
 
 NORI_NAMESPACE_BEGIN
 
-Scene::Scene(const PropertyList &) {
+Scene::Scene(const PropertyList &props) {
     m_bvh = new BVH();
+
+    /* Branching factor of the BVH (2: binary, 4/8: collapsed SIMD-friendly nodes, optionally quantized) */
+    m_bvh->setWidth(props.getInteger("bvhWidth", 2));
+    m_bvh->setCompressed(props.getBoolean("bvhCompressed", false));
+    m_bvh->setRebuildThreshold(props.getFloat("bvhRebuildThreshold", 1.5f));
+
+    /* Tree builder ("sah", the faster "hlbvh" or "sbvh" with spatial splits), optionally timing both */
+    m_bvh->setBuilder(props.getString("bvhBuilder", "sah"));
+    m_bvh->setSplitBudget(props.getFloat("bvhSplitBudget", 0.3f));
+    m_bvh->setCompareBuilders(props.getBoolean("bvhCompareBuilders", false));
+
+    /* Test the block that occluded the previous shadow ray first */
+    m_bvh->setOccluderCache(props.getBoolean("occluderCache", true));
+
+    /* Emitter selection for next event estimation (see LightSampler) */
+    m_lightSamplerStrategy = props.getString("lightSampler", "auto");
+
+    /* Scheduling, adaptive sampling and time budget (see RenderThread::renderScene()) */
+    int samplesPerPass = props.getInteger("samplesPerPass", 1);
+    m_targetError = props.getFloat("targetError", 0.0f);
+    m_timeBudget = props.getFloat("timeBudget", 0.0f);
+    if (samplesPerPass < 1)
+        throw NoriException("Scene: the number of samples per pass must be positive!");
+    if (m_targetError < 0 || m_timeBudget < 0)
+        throw NoriException("Scene: the target error and time budget must be nonnegative!");
+    m_samplesPerPass = (uint32_t) samplesPerPass;
 }
 
 Scene::~Scene() {
     delete m_bvh;
+    delete m_lightSampler;
+    for (auto group : m_groups)
+        delete group;
     delete m_sampler;
     delete m_camera;
     delete m_integrator;
@@ -40,8 +69,36 @@ Scene::~Scene() {
 
 }
 
+void Scene::setSampler(Sampler *sampler) {
+    delete m_sampler;
+    m_sampler = sampler;
+}
+
+void Scene::updateGeometry() {
+    /* The bounds of the instances depend on their group's BVH */
+    for (Shape *shape : m_shapes) {
+        Instance *instance = dynamic_cast<Instance *>(shape);
+        if (instance)
+            instance->setTransform(instance->getTransform());
+    }
+    m_bvh->refit();
+
+    /* Area emitters may have moved as well */
+    delete m_lightSampler;
+    m_lightSampler = new LightSampler(m_emitters, m_lightSamplerStrategy);
+}
+
 void Scene::activate() {
     m_bvh->build();
+    m_lightSampler = new LightSampler(m_emitters, m_lightSamplerStrategy);
+
+    /* Look up the environment emitter once, the integrators query it per bounce */
+    for (const Emitter *emitter : m_emitters) {
+        if (emitter->toString().find("EnvironmentLight") != std::string::npos) {
+            m_envLight = emitter;
+            break;
+        }
+    }
 
     if (!m_integrator)
         throw NoriException("No integrator was specified!");
@@ -71,6 +128,11 @@ void Scene::addChild(NoriObject *obj) {
             }
             break;
         
+        case EShapeGroup:
+            /* Only rendered through instances, see Instance */
+            m_groups.push_back(static_cast<ShapeGroup *>(obj));
+            break;
+
         case EEmitter:
             m_emitters.push_back(static_cast<Emitter *>(obj));
             break;
@@ -131,12 +193,14 @@ std::string Scene::toString() const {
         "  %s  }\n"
         "  emitters = {\n"
         "  %s  }\n"
+        "  lightSampler = %s\n"
         "]",
         indent(m_integrator->toString()),
         indent(m_sampler->toString()),
         indent(m_camera->toString()),
         indent(shapes, 2),
-        indent(lights,2)
+        indent(lights,2),
+        m_lightSampler ? m_lightSampler->toString() : std::string("null")
     );
 }
 
@@ -38,44 +38,40 @@ public:
 
     virtual Point3f getCentroid(uint32_t index) const override { return m_position; }
 
-	virtual bool rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const override {
-
-		/* to be implemented */
-
-		Point3f C = m_position;
-		Point3f O = ray.o;
-		Vector3f D = ray.d;
-
-		
-		float a = pow(D.x(), 2) + pow(D.y(), 2) + pow(D.z(), 2);
-		float b = 2 * (D.x() * (O.x() - C.x()) + D.y() * (O.y() - C.y()) + D.z() * (O.z() - C.z()));
-		float c = pow(O.x() - C.x(), 2) + pow(O.y() - C.y(), 2) + pow(O.z() - C.z(), 2) - pow(m_radius, 2);
-
-		float delta = pow(b,2) - 4 * a*c;
-
-		if (delta > 0)
-		{
-			//a is positive so t1 is always the smaller value
-			float t1 = (-b - sqrt(delta)) / 2 * a;
-			float t2 = (-b + sqrt(delta)) / 2 * a;
-
-			if (t1 > ray.mint && t1 < ray.maxt)
-			{
-				t = t1;
-				return true;
-			}
-
-			if (t2 > ray.mint && t2 < ray.maxt)
-			{
-				t = t2;
-				return true;
-			}
-		}
-
-		return false;
+	virtual bool rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t, uint32_t &inner) const override {
+		/* Same sequence of operations as the packed version in the BVH */
+		float ocx = ray.o.x() - m_position.x();
+		float ocy = ray.o.y() - m_position.y();
+		float ocz = ray.o.z() - m_position.z();
+
+		/* Coefficients of the quadratic qa * t^2 + qb * t + qc = 0 */
+		float qa = ray.d.x() * ray.d.x() + (ray.d.y() * ray.d.y() + ray.d.z() * ray.d.z());
+		float qb = 2.f * (ray.d.x() * ocx + (ray.d.y() * ocy + ray.d.z() * ocz));
+		float qc = ocx * ocx + (ocy * ocy + ocz * ocz) - m_radius * m_radius;
+		float delta = qb * qb - 4.f * qa * qc;
+		if (!(delta > 0))
+			return false;
+
+		/* Use the smaller root unless it lies before the segment */
+		float sqrtDelta = std::sqrt(delta);
+		float t1 = (-qb - sqrtDelta) / (2.f * qa);
+		float t2 = (-qb + sqrtDelta) / (2.f * qa);
+		float tHit = t1 > ray.mint ? t1 : t2;
+		if (!(tHit > ray.mint) || !(tHit < ray.maxt))
+			return false;
+
+		u = v = 0;
+		t = tHit;
+		return true;
 	}
 
-    virtual void setHitInformation(uint32_t index, const Ray3f &ray, Intersection & its) const override {
+    virtual bool getSphere(uint32_t index, Point3f &center, float &radius) const override {
+        center = m_position;
+        radius = m_radius;
+        return true;
+    }
+
+    virtual void setHitInformation(uint32_t index, uint32_t inner, const Ray3f &ray, Intersection & its) const override {
 		its.p = ray.o + ray.d*its.t;
 		its.geoFrame = its.shFrame = Frame((its.p - m_position).normalized());
 
@@ -0,0 +1,116 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/stats.h>
+#include <memory>
+#include <mutex>
+
+NORI_NAMESPACE_BEGIN
+
+namespace {
+    /// Counters of all threads that have traced rays so far
+    struct Registry {
+        std::mutex mutex;
+        std::vector<std::unique_ptr<TraversalStatistics> > threads;
+    };
+
+    Registry &registry() {
+        static Registry registry;
+        return registry;
+    }
+
+    TraversalStatistics *registerThread() {
+        Registry &reg = registry();
+        std::lock_guard<std::mutex> guard(reg.mutex);
+        reg.threads.push_back(std::unique_ptr<TraversalStatistics>(new TraversalStatistics()));
+        return reg.threads.back().get();
+    }
+}
+
+void TraversalStatistics::clear() {
+    for (int i = 0; i < ERayKindCount; ++i)
+        rays[i] = 0;
+    nodes = primitives = hits = occluderHits = 0;
+}
+
+uint64_t TraversalStatistics::getRayCount() const {
+    return rays[EClosestHit] + rays[EShadow] + rays[EPacket] + rays[EPacketShadow];
+}
+
+TraversalStatistics TraversalStatistics::operator-(const TraversalStatistics &other) const {
+    TraversalStatistics result;
+    for (int i = 0; i < ERayKindCount; ++i)
+        result.rays[i] = rays[i] - other.rays[i];
+    result.nodes = nodes - other.nodes;
+    result.primitives = primitives - other.primitives;
+    result.hits = hits - other.hits;
+    result.occluderHits = occluderHits - other.occluderHits;
+    return result;
+}
+
+TraversalStatistics &TraversalStatistics::operator+=(const TraversalStatistics &other) {
+    for (int i = 0; i < ERayKindCount; ++i)
+        rays[i] += other.rays[i];
+    nodes += other.nodes;
+    primitives += other.primitives;
+    hits += other.hits;
+    occluderHits += other.occluderHits;
+    return *this;
+}
+
+TraversalStatistics &TraversalStatistics::local() {
+    /* The counters are owned by the registry, so they outlive the thread */
+    static thread_local TraversalStatistics *stats = registerThread();
+    return *stats;
+}
+
+TraversalStatistics TraversalStatistics::aggregate() {
+    Registry &reg = registry();
+    std::lock_guard<std::mutex> guard(reg.mutex);
+    TraversalStatistics result;
+    for (const auto &stats : reg.threads)
+        result += *stats;
+    return result;
+}
+
+void TraversalStatistics::reset() {
+    Registry &reg = registry();
+    std::lock_guard<std::mutex> guard(reg.mutex);
+    for (const auto &stats : reg.threads)
+        stats->clear();
+}
+
+std::string TraversalStatistics::toString(double time, uint64_t sampleCount) const {
+    uint64_t rayCount = getRayCount();
+    double perRay = 1.0 / std::max(rayCount, (uint64_t) 1);
+    double seconds = std::max(time, 1.0) / 1000;
+
+    return tfm::format(
+        "Traversal statistics: %.2f M rays (%.2f Mrays/s, %.2f rays/sample)\n"
+        "  closest hit: %i, shadow: %i, packet: %i, packet shadow: %i, instance: %i\n"
+        "  %.1f nodes visited, %.1f primitive tests per ray, %.1f%% hits\n"
+        "  %.1f%% of the shadow rays were blocked by the last occluder",
+        rayCount * 1e-6, rayCount * 1e-6 / seconds,
+        rayCount / (double) std::max(sampleCount, (uint64_t) 1),
+        rays[EClosestHit], rays[EShadow], rays[EPacket], rays[EPacketShadow], rays[EInstance],
+        nodes * perRay, primitives * perRay, 100.0 * hits * perRay,
+        100.0 * occluderHits / std::max(rays[EShadow], (uint64_t) 1)
+    );
+}
+
+NORI_NAMESPACE_END
@@ -19,6 +19,9 @@
 #include <nori/emitter.h>
 #include <nori/warp.h>
 #include <nori/shape.h>
+#include <nori/mesh.h>
+#include <nori/lightsampler.h>
+#include <Eigen/Geometry>
 
 NORI_NAMESPACE_BEGIN
 
@@ -79,7 +82,8 @@ public:
 		return  m_shape->pdfSurface(sRec) * (lRec.p - lRec.ref).squaredNorm() / cosTheta;
     }
 
-    virtual Color3f samplePhoton(Ray3f &ray, const Point2f &sample1, const Point2f &sample2) const override {
+    virtual Color3f samplePhoton(Ray3f &ray, const Point2f &sample1, const Point2f &sample2,
+                                 Normal3f *n) const override {
 		
 		ShapeQueryRecord sRec(Point3f(0.0f));
 		m_shape->sampleSurface(sRec, sample1);
@@ -89,6 +93,8 @@ public:
 
 		//photon ray
 		ray = Ray3f(sRec.p, d);
+		if (n)
+			*n = sRec.n;
 
 		EmitterQueryRecord lRec(sRec.p + d, sRec.p, sRec.n);
 
@@ -98,6 +104,63 @@ public:
 		return eval(lRec) * M_PI / sRec.pdf;
     }
 
+    virtual void pdfPhoton(const Point3f &p, const Normal3f &n, const Vector3f &d,
+                           float &pdfPos, float &pdfDir) const override {
+		ShapeQueryRecord sRec(p, p);
+		sRec.n = n;
+		pdfPos = m_shape->pdfSurface(sRec);
+
+		// cosine-weighted directions around the normal
+		pdfDir = std::max(0.0f, n.dot(d)) * INV_PI;
+    }
+
+
+    virtual bool getLightBounds(LightBounds &bounds) const override {
+        if(!m_shape)
+            throw NoriException("There is no shape attached to this Area light!");
+
+        /* Surfaces are sampled uniformly, so the density is one over the area */
+        ShapeQueryRecord sRec(m_shape->getBoundingBox().getCenter());
+        bounds.bbox = m_shape->getBoundingBox();
+        bounds.power = m_radiance.getLuminance() * M_PI / m_shape->pdfSurface(sRec);
+
+        /* Normals of the triangles and (if any) of the vertices, since eval()
+           tests the interpolated normal */
+        std::vector<Vector3f> normals;
+        Point3f p0, p1, p2;
+        for (uint32_t i = 0; i < m_shape->getPrimitiveCount(); ++i) {
+            if (!m_shape->getTriangle(i, p0, p1, p2)) {
+                normals.clear();
+                break;
+            }
+            Vector3f n = (p1 - p0).cross(p2 - p0);
+            if (n.squaredNorm() > 0)
+                normals.push_back(n.normalized());
+        }
+        const Mesh *mesh = dynamic_cast<const Mesh *>(m_shape);
+        if (!normals.empty() && mesh) {
+            const MatrixXf &N = mesh->getVertexNormals();
+            for (int i = 0; i < N.cols(); ++i)
+                normals.push_back(Vector3f(N.col(i)).normalized());
+        }
+
+        /* Light leaves the front side (cosThetaE = 0) of normals within a
+           cone around their average, other shapes may face anywhere */
+        Vector3f axis(0.0f);
+        for (const Vector3f &n : normals)
+            axis += n;
+        bounds.axis = Vector3f(0.0f, 0.0f, 1.0f);
+        bounds.cosThetaO = -1.0f;
+        bounds.cosThetaE = 0.0f;
+        if (axis.norm() > 1e-3f * normals.size()) {
+            bounds.axis = axis.normalized();
+            bounds.cosThetaO = 1.0f;
+            for (const Vector3f &n : normals)
+                bounds.cosThetaO = std::min(bounds.cosThetaO, bounds.axis.dot(n));
+            bounds.cosThetaO = std::max(bounds.cosThetaO - 1e-3f, -1.0f);
+        }
+        return true;
+    }
 
 protected:
     Color3f m_radiance;
@@ -1,4 +1,6 @@
 #include <nori/emitter.h>
+#include <nori/lightsampler.h>
+#include <nori/warp.h>
 
 NORI_NAMESPACE_BEGIN
 
@@ -19,13 +21,38 @@ public:
 	}
 
 	virtual Color3f eval(const EmitterQueryRecord &lRec) const {
-		return m_power;
+		// intensity falls off with the squared distance (same value as sample())
+		return m_power / (4 * M_PI * (lRec.ref - lRec.p).squaredNorm());
 	}
 
 	virtual float pdf(const EmitterQueryRecord &lRec) const {
 		return 1;
 	}
 
+	virtual Color3f samplePhoton(Ray3f &ray, const Point2f &sample1, const Point2f &sample2,
+	                             Normal3f *n) const {
+		// uniformly distributed directions, every photon carries the total power
+		ray = Ray3f(m_position, Warp::squareToUniformSphere(sample2));
+		if (n)
+			*n = Normal3f(0.0f);
+		return m_power;
+	}
+
+	virtual void pdfPhoton(const Point3f &p, const Normal3f &n, const Vector3f &d,
+	                       float &pdfPos, float &pdfDir) const {
+		pdfPos = 1;
+		pdfDir = Warp::squareToUniformSpherePdf(d);
+	}
+
+	virtual bool getLightBounds(LightBounds &bounds) const {
+		// emits the power uniformly into all directions
+		bounds.bbox = BoundingBox3f(m_position);
+		bounds.cosThetaO = -1;
+		bounds.cosThetaE = 0;
+		bounds.power = m_power.getLuminance();
+		return true;
+	}
+
 	virtual std::string toString() const {
 		return "PointLight[]";
 	}
@@ -0,0 +1,129 @@
+#include <nori/sampler.h>
+#include <nori/block.h>
+#include <nori/lowdiscrepancy.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * Correlated multi-jittered sampling
+ *
+ * Implements Kensler, "Correlated Multi-Jittered Sampling" (2013): the
+ * samples of a pixel are stratified in both 1D projections as well as on
+ * a (roughly square) 2D grid. The pattern has \c sampleCount samples and
+ * is randomized for every pixel and dimension. When more samples than
+ * that are requested (adaptive sampling, time budget), a fresh pattern
+ * is used for each further group of \c sampleCount samples.
+ */
+class CMJ : public Sampler {
+public:
+    CMJ(const PropertyList &propList) {
+        m_sampleCount = (size_t) propList.getInteger("sampleCount", 1);
+        m_seed = (uint32_t) propList.getInteger("seed", 0);
+    }
+
+    virtual ~CMJ() { }
+
+    std::unique_ptr<Sampler> clone() const {
+        std::unique_ptr<CMJ> cloned(new CMJ());
+        cloned->m_sampleCount = m_sampleCount;
+        cloned->m_seed = m_seed;
+        return cloned;
+    }
+
+    void prepare(const ImageBlock &) {
+        m_sampleIndex = 0;
+        m_pixel = Point2i(0, 0);
+        m_dimension = 0;
+    }
+
+    void generate(const Point2i &pixel, uint32_t dimension) {
+        m_pixel = pixel;
+        m_dimension = dimension;
+    }
+
+    void advance() {
+        ++m_sampleIndex;
+    }
+
+    float next1D() {
+        uint32_t n = patternSize(), s = m_sampleIndex % n;
+        uint32_t p = patternSeed(m_dimension++);
+        /* Jittered 1D stratification */
+        return LowDiscrepancy::clampUnit(
+            (permute(s, n, p * 0x68bc21ebu) + randFloat(s, p * 0x967a889bu)) / n);
+    }
+
+    Point2f next2D() {
+        uint32_t n = patternSize(), s = m_sampleIndex % n;
+        uint32_t p = patternSeed(m_dimension);
+        m_dimension += 2;
+
+        uint32_t m = std::max(1u, (uint32_t) std::sqrt((float) n));
+        uint32_t k = (n + m - 1) / m;
+        s = permute(s, n, p * 0x51633e2du);
+        uint32_t sx = permute(s % m, m, p * 0x68bc21ebu);
+        uint32_t sy = permute(s / m, k, p * 0x02e5be93u);
+        float jx = randFloat(s, p * 0x967a889bu);
+        float jy = randFloat(s, p * 0x368cc8b7u);
+
+        return Point2f(
+            LowDiscrepancy::clampUnit((sx + (sy + jx) / k) / m),
+            LowDiscrepancy::clampUnit((s + jy) / n)
+        );
+    }
+
+    virtual std::string toString() const override {
+        return tfm::format("CMJ[sampleCount=%i, seed=%i]", m_sampleCount, m_seed);
+    }
+protected:
+    CMJ() { }
+
+    uint32_t patternSize() const {
+        return (uint32_t) std::max(m_sampleCount, (size_t) 1);
+    }
+
+    /// Seed of the pattern used for the current pixel, dimension and group of samples
+    uint32_t patternSeed(uint32_t dimension) const {
+        return LowDiscrepancy::hash(m_pixel, dimension,
+            m_seed ^ LowDiscrepancy::mixBits(m_sampleIndex / patternSize()));
+    }
+
+    /// Element \c i of a random permutation of <tt>[0, l)</tt> selected by \c p (Kensler 2013)
+    static uint32_t permute(uint32_t i, uint32_t l, uint32_t p) {
+        uint32_t w = l - 1;
+        w |= w >> 1; w |= w >> 2; w |= w >> 4; w |= w >> 8; w |= w >> 16;
+        do {
+            i ^= p; i *= 0xe170893du;
+            i ^= p >> 16;
+            i ^= (i & w) >> 4;
+            i ^= p >> 8; i *= 0x0929eb3fu;
+            i ^= p >> 23;
+            i ^= (i & w) >> 1; i *= 1 | p >> 27;
+            i *= 0x6935fa69u;
+            i ^= (i & w) >> 11; i *= 0x74dcb303u;
+            i ^= (i & w) >> 2; i *= 0x9e501cc3u;
+            i ^= (i & w) >> 2; i *= 0xc860a3dfu;
+            i &= w;
+            i ^= i >> 5;
+        } while (i >= l);
+        return (i + p) % l;
+    }
+
+    /// Random float in <tt>[0, 1)</tt> for sample \c i and seed \c p (Kensler 2013)
+    static float randFloat(uint32_t i, uint32_t p) {
+        i ^= p;
+        i ^= i >> 17; i ^= i >> 10; i *= 0xb36534e5u;
+        i ^= i >> 12; i ^= i >> 21; i *= 0x93fc4795u;
+        i ^= 0xdf6e307fu; i ^= i >> 17; i *= 1 | p >> 18;
+        return i * (1.0f / 4294967808.0f);
+    }
+
+private:
+    uint32_t m_seed;
+    uint32_t m_sampleIndex = 0;
+    uint32_t m_dimension = 0;
+    Point2i m_pixel = Point2i(0, 0);
+};
+
+NORI_REGISTER_CLASS(CMJ, "cmj");
+NORI_NAMESPACE_END
@@ -0,0 +1,101 @@
+#include <nori/sampler.h>
+#include <nori/block.h>
+#include <nori/lowdiscrepancy.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * Owen-scrambled Halton sampling
+ *
+ * Dimension \c i of the sample with index \c n is the radical inverse of
+ * \c n in the base of the i-th prime number. Every pixel uses its own
+ * randomization of the digits, so that neighboring pixels are uncorrelated.
+ * Since the quality of the Halton sequence degrades in very high bases,
+ * the primes are reused (with a different randomization) after
+ * \ref PrimeCount dimensions.
+ */
+class Halton : public Sampler {
+public:
+    enum { PrimeCount = 256 };
+
+    Halton(const PropertyList &propList) {
+        m_sampleCount = (size_t) propList.getInteger("sampleCount", 1);
+        m_seed = (uint32_t) propList.getInteger("seed", 0);
+    }
+
+    virtual ~Halton() { }
+
+    std::unique_ptr<Sampler> clone() const {
+        std::unique_ptr<Halton> cloned(new Halton());
+        cloned->m_sampleCount = m_sampleCount;
+        cloned->m_seed = m_seed;
+        return cloned;
+    }
+
+    void prepare(const ImageBlock &) {
+        m_sampleIndex = 0;
+        m_pixel = Point2i(0, 0);
+        m_dimension = 0;
+    }
+
+    void generate(const Point2i &pixel, uint32_t dimension) {
+        m_pixel = pixel;
+        m_dimension = dimension;
+    }
+
+    void advance() {
+        ++m_sampleIndex;
+    }
+
+    float next1D() {
+        return sample(m_dimension++);
+    }
+
+    Point2f next2D() {
+        float x = sample(m_dimension++);
+        float y = sample(m_dimension++);
+        return Point2f(x, y);
+    }
+
+    virtual std::string toString() const override {
+        return tfm::format("Halton[sampleCount=%i, seed=%i]", m_sampleCount, m_seed);
+    }
+protected:
+    Halton() { }
+
+    float sample(uint32_t dimension) const {
+        return LowDiscrepancy::scrambledRadicalInverse(getPrimes()[dimension % PrimeCount],
+            m_sampleIndex, LowDiscrepancy::hash(m_pixel, dimension, m_seed));
+    }
+
+    /// Return a table with the first \ref PrimeCount prime numbers
+    static const std::vector<uint32_t> &getPrimes() {
+        static const std::vector<uint32_t> primes = [] {
+            std::vector<uint32_t> result;
+            for (uint32_t n = 2; result.size() < PrimeCount; ++n) {
+                bool isPrime = true;
+                for (uint32_t p : result) {
+                    if (p * p > n)
+                        break;
+                    if (n % p == 0) {
+                        isPrime = false;
+                        break;
+                    }
+                }
+                if (isPrime)
+                    result.push_back(n);
+            }
+            return result;
+        }();
+        return primes;
+    }
+
+private:
+    uint32_t m_seed;
+    uint32_t m_sampleIndex = 0;
+    uint32_t m_dimension = 0;
+    Point2i m_pixel = Point2i(0, 0);
+};
+
+NORI_REGISTER_CLASS(Halton, "halton");
+NORI_NAMESPACE_END
@@ -52,7 +52,7 @@ public:
         );
     }
 
-    void generate() { /* No-op for this sampler */ }
+    void generate(const Point2i &, uint32_t) { /* No-op for this sampler */ }
     void advance()  { /* No-op for this sampler */ }
 
     float next1D() {
@@ -0,0 +1,82 @@
+#include <nori/sampler.h>
+#include <nori/block.h>
+#include <nori/lowdiscrepancy.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * Owen-scrambled Sobol sampling
+ *
+ * Every call to \ref next1D() or \ref next2D() draws from the first one or
+ * two dimensions of the Sobol sequence, which form a (0, 2)-sequence. The
+ * sample index is shuffled and the result is Owen-scrambled with seeds
+ * that depend on the pixel and the dimension, so that the dimensions are
+ * decorrelated from each other ("padding", see Burley, "Practical Hash-based
+ * Owen Scrambling", 2020). Each 2D projection of the samples of a pixel is
+ * therefore well stratified, especially for power-of-two sample counts.
+ */
+class Sobol : public Sampler {
+public:
+    Sobol(const PropertyList &propList) {
+        m_sampleCount = (size_t) propList.getInteger("sampleCount", 1);
+        m_seed = (uint32_t) propList.getInteger("seed", 0);
+    }
+
+    virtual ~Sobol() { }
+
+    std::unique_ptr<Sampler> clone() const {
+        std::unique_ptr<Sobol> cloned(new Sobol());
+        cloned->m_sampleCount = m_sampleCount;
+        cloned->m_seed = m_seed;
+        return cloned;
+    }
+
+    void prepare(const ImageBlock &) {
+        m_sampleIndex = 0;
+        m_pixel = Point2i(0, 0);
+        m_dimension = 0;
+    }
+
+    void generate(const Point2i &pixel, uint32_t dimension) {
+        m_pixel = pixel;
+        m_dimension = dimension;
+    }
+
+    void advance() {
+        ++m_sampleIndex;
+    }
+
+    float next1D() {
+        uint32_t seed = LowDiscrepancy::hash(m_pixel, m_dimension++, m_seed);
+        uint32_t index = LowDiscrepancy::owenScramble(m_sampleIndex, seed);
+        return LowDiscrepancy::toUnitFloat(LowDiscrepancy::owenScramble(
+            LowDiscrepancy::sobol(index, 0), LowDiscrepancy::mixBits(seed ^ 0x5bd1e995u)));
+    }
+
+    Point2f next2D() {
+        uint32_t seed = LowDiscrepancy::hash(m_pixel, m_dimension, m_seed);
+        uint32_t index = LowDiscrepancy::owenScramble(m_sampleIndex, seed);
+        m_dimension += 2;
+        return Point2f(
+            LowDiscrepancy::toUnitFloat(LowDiscrepancy::owenScramble(
+                LowDiscrepancy::sobol(index, 0), LowDiscrepancy::mixBits(seed ^ 0x5bd1e995u))),
+            LowDiscrepancy::toUnitFloat(LowDiscrepancy::owenScramble(
+                LowDiscrepancy::sobol(index, 1), LowDiscrepancy::mixBits(seed ^ 0x68e31da4u)))
+        );
+    }
+
+    virtual std::string toString() const override {
+        return tfm::format("Sobol[sampleCount=%i, seed=%i]", m_sampleCount, m_seed);
+    }
+protected:
+    Sobol() { }
+
+private:
+    uint32_t m_seed;
+    uint32_t m_sampleIndex = 0;
+    uint32_t m_dimension = 0;
+    Point2i m_pixel = Point2i(0, 0);
+};
+
+NORI_REGISTER_CLASS(Sobol, "sobol");
+NORI_NAMESPACE_END
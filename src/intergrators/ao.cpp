@@ -6,7 +6,7 @@ NORI_NAMESPACE_BEGIN
 
 class AoIntegrator : public Integrator {
 public:
-	AvIntegrator(const PropertyList &props) {
+	AoIntegrator(const PropertyList &props) {
 		m_length = (float)props.getFloat("length", 1);
 	}
 
@@ -16,18 +16,18 @@ public:
 			return Color3f(1.0f);
 
 		Ray3f m_ray(its.p, Warp::sampleUniformHemisphere(sampler, its.shFrame.n), Epsilon, m_length);
-		if (!scene->rayIntersect(m_ray, its))
+		if (!scene->occluded(m_ray))
 			return Color3f(1.0f);
 
 		return Color3f(0.0f);
 	}
 
 	std::string toString() const {
-		return "AvIntegrator[]";
+		return "AoIntegrator[]";
 	}
 protected:
 	float m_length;
 };
 
-NORI_REGISTER_CLASS(AvIntegrator, "ao");
+NORI_REGISTER_CLASS(AoIntegrator, "ao");
 NORI_NAMESPACE_END
\ No newline at end of file
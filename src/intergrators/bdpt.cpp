@@ -0,0 +1,472 @@
+#include <nori/integrator.h>
+#include <nori/scene.h>
+#include <nori/camera.h>
+#include <nori/emitter.h>
+#include <nori/bsdf.h>
+#include <nori/sampler.h>
+#include <nori/block.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Bidirectional path tracing
+ *
+ * Every sample traces a subpath from the camera and one from an emitter
+ * (chosen proportionally to its power, see \ref Emitter::samplePhoton()),
+ * and connects each prefix of the first one with each prefix of the
+ * second one. All of these sampling techniques are combined with the power
+ * heuristic (Veach, "Robust Monte Carlo Methods for Light Transport
+ * Simulation", 1997). The implementation follows the one in pbrt-v3:
+ *
+ * - \c t camera vertices and no light vertex: the camera path hits an
+ *   emitter (like \c path_mis without emitter sampling)
+ * - one light vertex: next event estimation, i.e. the emitter is chosen at
+ *   the shading point (see \ref Scene::sampleEmitter())
+ * - one camera vertex: the light path is connected to the camera (light
+ *   tracing). These samples land in arbitrary pixels and are splatted
+ *   (see \ref SplatBuffer), which makes caustics seen on diffuse surfaces
+ *   converge quickly.
+ *
+ * Since next event estimation and the light paths choose emitters
+ * differently, the probability of the first light vertex depends on the
+ * technique, which the MIS weights take into account. Paths are terminated
+ * by Russian roulette or after \c maxDepth bounces (-1: no limit).
+ * Environment emitters and participating media are not supported.
+ */
+class BDPTIntegrator : public Integrator {
+public:
+    BDPTIntegrator(const PropertyList &props) {
+        m_maxDepth = props.getInteger("maxDepth", -1);
+    }
+
+    void preprocess(const Scene *scene) {
+        if (scene->getEnvLight())
+            throw NoriException("BDPTIntegrator: environment emitters are not supported!");
+        if (scene->getLights().empty())
+            throw NoriException("BDPTIntegrator: the scene contains no emitters!");
+    }
+
+    Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const {
+        return sample(scene, sampler, ray, nullptr);
+    }
+
+    Color3f LiSplat(const Scene *scene, Sampler *sampler, const Ray3f &ray,
+                    SplatBuffer &splats) const {
+        return sample(scene, sampler, ray, &splats);
+    }
+
+    bool usesSplats() const { return true; }
+
+    std::string toString() const {
+        return tfm::format("BDPTIntegrator[maxDepth = %i]", m_maxDepth);
+    }
+
+protected:
+    /// Vertex of a camera or light subpath
+    struct PathVertex {
+        enum EType {
+            ECamera = 0,
+            ELight,
+            ESurface
+        };
+
+        EType type;
+        Point3f p;
+        Normal3f n;                 ///< Shading normal (zero for cameras and point lights)
+        Intersection its;           ///< Surface vertices only
+        const Emitter *emitter;     ///< Emitter at this vertex (if any)
+        Color3f beta;               ///< Throughput of the subpath up to this vertex
+        bool delta;                 ///< Scattered by a discrete BSDF
+        float pdfFwd;               ///< Area density when sampled by its own subpath
+        float pdfRev;               ///< Area density when sampled from the other end
+
+        PathVertex() : type(ESurface), n(0.0f), emitter(nullptr), beta(0.0f),
+            delta(false), pdfFwd(0), pdfRev(0) { }
+
+        /// Emitters at a single point can't be hit by camera paths
+        bool isDeltaLight() const { return type == ELight && n.isZero(); }
+    };
+
+    Color3f sample(const Scene *scene, Sampler *sampler, const Ray3f &ray,
+                   SplatBuffer *splats) const {
+        const Camera *camera = scene->getCamera();
+        int maxVertices = m_maxDepth < 0 ? std::numeric_limits<int>::max() : m_maxDepth + 2;
+
+        /* Camera subpath */
+        std::vector<PathVertex> cameraPath;
+        PathVertex z0;
+        z0.type = PathVertex::ECamera;
+        z0.p = ray.o;
+        z0.beta = Color3f(1.0f);
+        z0.pdfFwd = 1.0f;
+        cameraPath.push_back(z0);
+        float pdfPos, pdfDir;
+        camera->pdfRay(ray, pdfPos, pdfDir);
+        randomWalk(scene, sampler, ray, Color3f(1.0f), pdfDir, false, maxVertices, cameraPath);
+
+        /* Light subpath, starting at an emitter chosen by power */
+        std::vector<PathVertex> lightPath;
+        float pmf;
+        const Emitter *emitter = scene->sampleEmitter(sampler->next1D(), pmf);
+        Point2f sample1 = sampler->next2D(), sample2 = sampler->next2D();
+        if (emitter && pmf > 0) {
+            Ray3f lightRay;
+            PathVertex y0;
+            y0.type = PathVertex::ELight;
+            y0.emitter = emitter;
+            Color3f power = emitter->samplePhoton(lightRay, sample1, sample2, &y0.n) / pmf;
+            emitter->pdfPhoton(lightRay.o, y0.n, lightRay.d, pdfPos, pdfDir);
+            y0.p = lightRay.o;
+            y0.beta = power;
+            y0.pdfFwd = pdfPos * pmf;
+            lightPath.push_back(y0);
+            if (pdfPos > 0 && pdfDir > 0 && !power.isZero())
+                randomWalk(scene, sampler, lightRay, power, pdfDir, true, maxVertices - 1, lightPath);
+        }
+
+        /* Connect all prefixes of both subpaths */
+        Color3f L(0.0f);
+        for (int t = 1; t <= (int) cameraPath.size(); ++t) {
+            for (int s = 0; s <= (int) lightPath.size(); ++s) {
+                int depth = s + t - 2;
+                if (depth < 0 || (m_maxDepth >= 0 && depth > m_maxDepth))
+                    continue;
+                if (t == 1 && (s < 2 || !splats))
+                    continue;
+
+                Point2f samplePosition;
+                Color3f value = connect(scene, sampler, lightPath, cameraPath, s, t, splats != nullptr,
+                    samplePosition);
+                if (value.isZero())
+                    continue;
+                if (t == 1)
+                    splats->splat(samplePosition, value);
+                else
+                    L += value;
+            }
+        }
+        return L;
+    }
+
+    /**
+     * \brief Extend a subpath from \c ray by sampling the BSDFs
+     *
+     * \param beta        Throughput of the subpath along \c ray
+     * \param pdfDir      Density of the direction of \c ray per solid angle
+     * \param importance  Is this a light subpath?
+     */
+    void randomWalk(const Scene *scene, Sampler *sampler, Ray3f ray, Color3f beta, float pdfDir,
+                    bool importance, int maxVertices, std::vector<PathVertex> &path) const {
+        Color3f t(1.0f);
+        while ((int) path.size() < maxVertices) {
+            PathVertex v;
+            if (!scene->rayIntersect(ray, v.its))
+                break;
+            const Intersection &its = v.its;
+            v.type = PathVertex::ESurface;
+            v.p = its.p;
+            v.n = its.shFrame.n;
+            v.emitter = its.mesh->isEmitter() ? its.mesh->getEmitter() : nullptr;
+            v.beta = beta;
+            v.pdfFwd = toArea(path.back(), pdfDir, v);
+            path.push_back(v);
+
+            // Russian roulette
+            float prob = std::min(t.maxCoeff(), .99f);
+            if (sampler->next1D() >= prob)
+                break;
+            t /= prob;
+            beta /= prob;
+
+            // BSDF sampling
+            const BSDF *bsdf = its.mesh->getBSDF();
+            BSDFQueryRecord bRec(its.toLocal(-ray.d));
+            bRec.uv = its.uv;
+            Color3f f = bsdf->sample(bRec, sampler->next2D());
+            if (f.isZero())
+                break;
+            Vector3f wo = its.toWorld(bRec.wo);
+            if (importance)
+                f *= shadingCorrection(its, -ray.d, wo);
+            t *= f;
+            beta *= f;
+
+            float pdfRev = 0.0f;
+            pdfDir = 0.0f;
+            if (bRec.measure == EDiscrete) {
+                path.back().delta = true;
+            } else {
+                pdfDir = bsdf->pdf(bRec);
+                BSDFQueryRecord rRec(bRec.wo, bRec.wi, ESolidAngle);
+                rRec.uv = its.uv;
+                pdfRev = bsdf->pdf(rRec);
+            }
+            path[path.size() - 2].pdfRev = toArea(path.back(), pdfRev, path[path.size() - 2]);
+
+            ray = Ray3f(its.p, wo);
+        }
+    }
+
+    /**
+     * \brief Evaluate the technique with \c s light and \c t camera vertices,
+     * weighted by MIS
+     *
+     * \param samplePosition  Set to the pixel of the sample if \c t == 1
+     */
+    Color3f connect(const Scene *scene, Sampler *sampler, std::vector<PathVertex> &lightPath,
+                    std::vector<PathVertex> &cameraPath, int s, int t, bool splats,
+                    Point2f &samplePosition) const {
+        Color3f L(0.0f);
+        PathVertex sampled;
+
+        if (s == 0) {
+            /* The camera path hit an emitter */
+            const PathVertex &pt = cameraPath[t - 1];
+            if (!pt.emitter)
+                return L;
+            EmitterQueryRecord lRec(cameraPath[t - 2].p, pt.p, pt.n);
+            L = pt.beta * pt.emitter->eval(lRec);
+        } else if (t == 1) {
+            /* Connect the light path to the camera */
+            const PathVertex &qs = lightPath[s - 1];
+            if (qs.delta)
+                return L;
+            float pdf;
+            Color3f We = scene->getCamera()->sampleImportance(qs.p, sampler->next2D(),
+                sampled.p, samplePosition, pdf);
+            if (We.isZero() || pdf == 0)
+                return L;
+            sampled.type = PathVertex::ECamera;
+            sampled.beta = We / pdf;
+            Vector3f d = sampled.p - qs.p;
+            float dist = d.norm();
+            d /= dist;
+            L = qs.beta * evalBSDF(qs, lightPath[s - 2].p, sampled.p, true) * sampled.beta
+                * std::abs(qs.n.dot(d));
+            if (L.isZero() || scene->occluded(Ray3f(qs.p, d, Epsilon, dist - Epsilon)))
+                return Color3f(0.0f);
+        } else if (s == 1) {
+            /* Next event estimation */
+            const PathVertex &pt = cameraPath[t - 1];
+            if (pt.delta)
+                return L;
+            float pmf;
+            const Emitter *emitter = scene->sampleEmitter(pt.p, pt.n, sampler->next1D(), pmf);
+            EmitterQueryRecord lRec(pt.p);
+            lRec.n = Normal3f(0.0f);
+            Point2f sample = sampler->next2D();
+            if (!emitter || pmf == 0)
+                return L;
+            Color3f Le = emitter->sample(lRec, sample) / pmf;
+            if (Le.isZero())
+                return L;
+            sampled.type = PathVertex::ELight;
+            sampled.p = lRec.p;
+            sampled.n = lRec.n;
+            sampled.emitter = emitter;
+            sampled.beta = Le;
+            sampled.pdfFwd = pdfLightOrigin(scene, sampled);
+            L = pt.beta * evalBSDF(pt, cameraPath[t - 2].p, sampled.p, false) * Le
+                * std::abs(pt.n.dot(lRec.wi));
+            if (L.isZero() || scene->occluded(lRec.shadowRay))
+                return Color3f(0.0f);
+        } else {
+            /* Connect two surface vertices */
+            const PathVertex &qs = lightPath[s - 1], &pt = cameraPath[t - 1];
+            if (qs.delta || pt.delta)
+                return L;
+            Vector3f d = pt.p - qs.p;
+            float dist2 = d.squaredNorm(), dist = std::sqrt(dist2);
+            d /= dist;
+            L = qs.beta * evalBSDF(qs, lightPath[s - 2].p, pt.p, true)
+                * evalBSDF(pt, cameraPath[t - 2].p, qs.p, false) * pt.beta
+                * (std::abs(qs.n.dot(d)) * std::abs(pt.n.dot(d)) / dist2);
+            if (L.isZero() || scene->occluded(Ray3f(qs.p, d, Epsilon, dist - Epsilon)))
+                return Color3f(0.0f);
+        }
+
+        if (L.isZero())
+            return L;
+        return L * misWeight(scene, lightPath, cameraPath, sampled, s, t, splats);
+    }
+
+    /**
+     * \brief Compute the power heuristic weight of the technique with \c s
+     * light and \c t camera vertices
+     *
+     * The densities of all other techniques that could have produced the
+     * same path follow from the ratios of the reverse and forward densities
+     * of the vertices (pbrt-v3, chapter 16.3.4). The vertices next to the
+     * connection are updated temporarily.
+     */
+    float misWeight(const Scene *scene, std::vector<PathVertex> &lightPath,
+                    std::vector<PathVertex> &cameraPath, const PathVertex &sampled,
+                    int s, int t, bool splats) const {
+        if (s + t == 2)
+            return 1.0f;
+
+        /* Swap in the sampled endpoint and remember what gets modified */
+        PathVertex endpoint = sampled;
+        if (s == 1)
+            std::swap(lightPath[0], endpoint);
+        else if (t == 1)
+            std::swap(cameraPath[0], endpoint);
+        PathVertex *qs = s > 0 ? &lightPath[s - 1] : nullptr,
+                   *pt = &cameraPath[t - 1],
+                   *qsMinus = s > 1 ? &lightPath[s - 2] : nullptr,
+                   *ptMinus = t > 1 ? &cameraPath[t - 2] : nullptr;
+        PathVertex *modified[4] = { qs, pt, qsMinus, ptMinus };
+        float savedPdfRev[4] = { };
+        bool savedDelta[4] = { };
+        for (int i = 0; i < 4; ++i) {
+            if (modified[i]) {
+                savedPdfRev[i] = modified[i]->pdfRev;
+                savedDelta[i] = modified[i]->delta;
+            }
+        }
+
+        /* The connected vertices don't scatter discretely */
+        pt->delta = false;
+        if (qs)
+            qs->delta = false;
+
+        pt->pdfRev = s > 0 ? pdf(scene, *qs, qsMinus, *pt) : pdfLightOrigin(scene, *pt);
+        if (ptMinus)
+            ptMinus->pdfRev = s > 0 ? pdf(scene, *pt, qs, *ptMinus) : pdfLight(*pt, *ptMinus);
+        if (qs)
+            qs->pdfRev = pdf(scene, *pt, ptMinus, *qs);
+        if (qsMinus)
+            qsMinus->pdfRev = pdf(scene, *qs, pt, *qsMinus);
+
+        /* The vertex densities above assume that the first light vertex is
+           chosen by power. Next event estimation (one light vertex) chooses
+           it at the next vertex instead, its density is scaled by 'ratio'. */
+        const PathVertex &y0 = s > 0 ? lightPath[0] : cameraPath[t - 1];
+        const PathVertex &x1 = s > 1 ? lightPath[1] : (s == 1 ? cameraPath[t - 1] : cameraPath[t - 2]);
+        float origin = pdfLightOrigin(scene, y0);
+        float ratio = origin > 0 ? pdfLightNee(scene, y0, x1) / origin : 1.0f;
+
+        /* Density of technique (s', t') relative to the one of (s, t) */
+        auto relative = [&](float r, int sp, int tp) -> float {
+            if (tp == 1 && (sp < 2 || !splats))
+                return 0.0f;
+            if (sp == 1)
+                r *= ratio;
+            if (s == 1 && ratio > 0)
+                r /= ratio;
+            return r * r;
+        };
+
+        float sumRi = 0.0f, ri = 1.0f;
+        /* Move the camera vertices to the light subpath, one at a time */
+        for (int i = t - 1; i > 0; --i) {
+            ri *= remap0(cameraPath[i].pdfRev) / remap0(cameraPath[i].pdfFwd);
+            if (!cameraPath[i].delta && !cameraPath[i - 1].delta)
+                sumRi += relative(ri, s + t - i, i);
+        }
+
+        /* Move the light vertices to the camera subpath */
+        ri = 1.0f;
+        for (int i = s - 1; i >= 0; --i) {
+            ri *= remap0(lightPath[i].pdfRev) / remap0(lightPath[i].pdfFwd);
+            bool deltaLightVertex = i > 0 ? lightPath[i - 1].delta : lightPath[0].isDeltaLight();
+            if (!lightPath[i].delta && !deltaLightVertex)
+                sumRi += relative(ri, i, s + t - i);
+        }
+
+        for (int i = 0; i < 4; ++i) {
+            if (modified[i]) {
+                modified[i]->pdfRev = savedPdfRev[i];
+                modified[i]->delta = savedDelta[i];
+            }
+        }
+        if (s == 1)
+            std::swap(lightPath[0], endpoint);
+        else if (t == 1)
+            std::swap(cameraPath[0], endpoint);
+
+        return 1.0f / (1.0f + sumRi);
+    }
+
+    static float remap0(float pdf) { return pdf != 0 ? pdf : 1.0f; }
+
+    /// Convert a density per solid angle at \c from into one per unit area at \c to
+    static float toArea(const PathVertex &from, float pdf, const PathVertex &to) {
+        Vector3f d = to.p - from.p;
+        float dist2 = d.squaredNorm();
+        if (dist2 == 0)
+            return 0.0f;
+        pdf /= dist2;
+        if (!to.n.isZero())
+            pdf *= std::abs(to.n.dot(d)) / std::sqrt(dist2);
+        return pdf;
+    }
+
+    /**
+     * \brief Correct for the asymmetry of shading normals when transporting
+     * importance (Veach, chapter 5.3)
+     *
+     * \param wi  Direction towards the previous vertex of the light subpath
+     * \param wo  Direction towards the next one
+     */
+    static float shadingCorrection(const Intersection &its, const Vector3f &wi, const Vector3f &wo) {
+        float num = std::abs(wi.dot(its.shFrame.n)) * std::abs(wo.dot(its.geoFrame.n));
+        float denom = std::abs(wi.dot(its.geoFrame.n)) * std::abs(wo.dot(its.shFrame.n));
+        return denom != 0 ? num / denom : 0.0f;
+    }
+
+    /// Evaluate the BSDF of a surface vertex between two points
+    static Color3f evalBSDF(const PathVertex &v, const Point3f &prev, const Point3f &next, bool importance) {
+        Vector3f wi = (prev - v.p).normalized(), wo = (next - v.p).normalized();
+        BSDFQueryRecord bRec(v.its.toLocal(wi), v.its.toLocal(wo), ESolidAngle);
+        bRec.uv = v.its.uv;
+        Color3f f = v.its.mesh->getBSDF()->eval(bRec);
+        if (importance)
+            f *= shadingCorrection(v.its, wi, wo);
+        return f;
+    }
+
+    /// Return the area density of sampling \c next from \c v (coming from \c prev)
+    float pdf(const Scene *scene, const PathVertex &v, const PathVertex *prev, const PathVertex &next) const {
+        if (v.type == PathVertex::ELight)
+            return pdfLight(v, next);
+        if (v.type == PathVertex::ECamera) {
+            float pdfPos, pdfDir;
+            scene->getCamera()->pdfRay(Ray3f(v.p, (next.p - v.p).normalized()), pdfPos, pdfDir);
+            return toArea(v, pdfDir, next);
+        }
+
+        BSDFQueryRecord bRec(v.its.toLocal((prev->p - v.p).normalized()),
+            v.its.toLocal((next.p - v.p).normalized()), ESolidAngle);
+        bRec.uv = v.its.uv;
+        return toArea(v, v.its.mesh->getBSDF()->pdf(bRec), next);
+    }
+
+    /// Return the area density of emitting light from the emitter at \c v towards \c next
+    static float pdfLight(const PathVertex &v, const PathVertex &next) {
+        float pdfPos, pdfDir;
+        v.emitter->pdfPhoton(v.p, v.n, (next.p - v.p).normalized(), pdfPos, pdfDir);
+        return toArea(v, pdfDir, next);
+    }
+
+    /// Return the area density of starting a light subpath at \c v
+    static float pdfLightOrigin(const Scene *scene, const PathVertex &v) {
+        float pdfPos, pdfDir;
+        v.emitter->pdfPhoton(v.p, v.n, v.n, pdfPos, pdfDir);
+        return pdfPos * scene->pmfEmitter(v.emitter);
+    }
+
+    /// Return the area density of choosing \c v by next event estimation at \c ref
+    static float pdfLightNee(const Scene *scene, const PathVertex &v, const PathVertex &ref) {
+        EmitterQueryRecord lRec(ref.p, v.p, v.n);
+        float pdf = v.emitter->pdf(lRec) * scene->pmfEmitter(ref.p, ref.n, v.emitter);
+        if (v.n.isZero())
+            return pdf;
+        return pdf * std::abs(v.n.dot(lRec.wi)) / (v.p - ref.p).squaredNorm();
+    }
+
+    int m_maxDepth;
+};
+
+NORI_REGISTER_CLASS(BDPTIntegrator, "bdpt");
+NORI_NAMESPACE_END
@@ -15,14 +15,24 @@ public:
 
 	Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const {
 		Intersection its;
-		if (!scene->rayIntersect(ray, its))
+		bool hit = scene->rayIntersect(ray, its);
+		return LiFromHit(scene, sampler, ray, hit ? &its : nullptr);
+	}
+
+	bool usesPrimaryHits() const { return true; }
+
+	Color3f LiFromHit(const Scene *scene, Sampler *sampler, const Ray3f &ray,
+	                  const Intersection *primaryHit) const {
+		if (!primaryHit)
 			return Color3f(0.0f);
+		const Intersection &its = *primaryHit;
 
-		const Emitter * emitter = scene->getRandomEmitter(sampler->next1D());
+		float pmf;
+		const Emitter * emitter = scene->sampleEmitter(its.p, its.shFrame.n, sampler->next1D(), pmf);
 
 		EmitterQueryRecord lRecR;
 		lRecR.ref = its.p;
-		Color3f Li = emitter->sample(lRecR, sampler->next2D())*scene->getLights().size();
+		Color3f Li = emitter->sample(lRecR, sampler->next2D()) / pmf;
 
 		float cosTheta = Frame::cosTheta(its.shFrame.toLocal(lRecR.wi));
 
@@ -38,7 +48,7 @@ public:
 		}
 
 		// check if shadow ray is occluded
-		if (scene->rayIntersect(lRecR.shadowRay, its))
+		if (scene->occluded(lRecR.shadowRay))
 			Li = 0;
 
 		return Le + Li * f * std::max(0.f, cosTheta);
@@ -14,9 +14,17 @@ public:
 	}
 
 	Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const {
-		//Find the surface that is visible in the requested direction 
 		Intersection its;
-		if (!scene->rayIntersect(ray, its)){
+		bool hit = scene->rayIntersect(ray, its);
+		return LiFromHit(scene, sampler, ray, hit ? &its : nullptr);
+	}
+
+	bool usesPrimaryHits() const { return true; }
+
+	Color3f LiFromHit(const Scene *scene, Sampler *sampler, const Ray3f &ray,
+	                  const Intersection *primaryHit) const {
+		//Find the surface that is visible in the requested direction 
+		if (!primaryHit){
 			if (scene->getEnvLight() == nullptr) {
 				return Color3f(0,0,0);
 			} else {
@@ -25,6 +33,7 @@ public:
 				return scene->getEnvLight()->eval(lRec);
 			}
 		}
+		const Intersection &its = *primaryHit;
 
 		// emitted
 		Color3f Le(0,0,0);
@@ -15,8 +15,17 @@ public:
 
 	Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const {
 		Intersection its;
-		if (!scene->rayIntersect(ray, its))
+		bool hit = scene->rayIntersect(ray, its);
+		return LiFromHit(scene, sampler, ray, hit ? &its : nullptr);
+	}
+
+	bool usesPrimaryHits() const { return true; }
+
+	Color3f LiFromHit(const Scene *scene, Sampler *sampler, const Ray3f &ray,
+	                  const Intersection *primaryHit) const {
+		if (!primaryHit)
 			return Color3f(0.0f);
+		const Intersection &its = *primaryHit;
 
 		//emitted
 		Color3f Le = 0;
@@ -28,14 +37,15 @@ public:
 		// em sample
 		Color3f L_ems = 0;
 
-		// random em
-		const Emitter * emitter = scene->getRandomEmitter(sampler->next1D());
+		// choose an emitter
+		float pmf;
+		const Emitter * emitter = scene->sampleEmitter(its.p, its.shFrame.n, sampler->next1D(), pmf);
 
 		// reflected
 		EmitterQueryRecord lRec_ems;
 		lRec_ems.ref = its.p;
-		Color3f Li_ems = emitter->sample(lRec_ems, sampler->next2D())*scene->getLights().size();
-		float w_ems = emitter->pdf(lRec_ems);
+		Color3f Li_ems = emitter->sample(lRec_ems, sampler->next2D()) / pmf;
+		float w_ems = emitter->pdf(lRec_ems) * pmf;
 
 		// BSDF
 		BSDFQueryRecord bRec_ems(its.shFrame.toLocal(-ray.d), its.shFrame.toLocal(lRec_ems.wi), ESolidAngle);
@@ -45,8 +55,7 @@ public:
 			w_ems /= (w_ems + its.mesh->getBSDF()->pdf(bRec_ems));
 
 		// check if shadow
-		Intersection its_ems;
-		if (!scene->rayIntersect(lRec_ems.shadowRay, its_ems))
+		if (!scene->occluded(lRec_ems.shadowRay))
 			L_ems = f_ems * Li_ems * std::max(0.f, Frame::cosTheta(its.shFrame.toLocal(lRec_ems.wi)));
 
 	
@@ -63,10 +72,12 @@ public:
 		Intersection itsR;
 		if (scene->rayIntersect(rayR, itsR)) {
 			if (itsR.mesh->isEmitter()) {
+				const Emitter * hitEmitter = itsR.mesh->getEmitter();
 				EmitterQueryRecord lRec_mats = EmitterQueryRecord(its.p, itsR.p, itsR.shFrame.n);
-				Color3f Li_mats = itsR.mesh->getEmitter()->eval(lRec_mats);
-				if (w_mats + itsR.mesh->getEmitter()->pdf(lRec_mats) != 0)
-					w_mats /= (w_mats + itsR.mesh->getEmitter()->pdf(lRec_mats));
+				Color3f Li_mats = hitEmitter->eval(lRec_mats);
+				float pdf_light = hitEmitter->pdf(lRec_mats) * scene->pmfEmitter(its.p, its.shFrame.n, hitEmitter);
+				if (w_mats + pdf_light != 0)
+					w_mats /= (w_mats + pdf_light);
 				L_mats = Li_mats * f_mats /** std::max(0.f, Frame::cosTheta(its.shFrame.toLocal(lRec_mats.wi)))*/;
 			}
 		}
@@ -0,0 +1,333 @@
+#include <nori/integrator.h>
+#include <nori/scene.h>
+#include <nori/bsdf.h>
+#include <nori/sampler.h>
+#include <nori/packet.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Direct illumination with resampled importance sampling (RIS)
+ *
+ * Instead of tracing a shadow ray for every emitter sample, each pixel
+ * draws \c candidates cheap light samples (see \ref Scene::sampleEmitter())
+ * and keeps one of them in a weighted reservoir, with the unshadowed
+ * contribution as target function. Only the survivor is tested for
+ * visibility (Talbot et al., "Importance Resampling for Global
+ * Illumination", 2005).
+ *
+ * With \c neighbors > 0, every pixel also merges the reservoirs of that
+ * many random pixels within \c radius of the same image block that have a
+ * similar normal and depth, which shares the candidates of the neighbors
+ * at the cost of a few target evaluations (spatial reuse as in Bitterli et
+ * al., "Spatiotemporal reservoir resampling for real-time ray tracing with
+ * dynamic direct lighting", 2020). The normalization only counts pixels
+ * that could have produced the chosen sample, so the estimate stays
+ * unbiased.
+ *
+ * Light samples live in the sampling domain of their emitter: points on
+ * area lights (area measure), point lights (counting measure) and
+ * directions of the environment map (solid angle), so that samples of one
+ * pixel can be evaluated at another one.
+ */
+class DirectRisIntegrator : public Integrator {
+public:
+    DirectRisIntegrator(const PropertyList &props) {
+        /* Light samples per pixel that are resampled */
+        m_candidates = props.getInteger("candidates", 8);
+        /* Spatial reuse: number of neighbors (0: disabled) and their distance in pixels */
+        m_neighbors = props.getInteger("neighbors", 0);
+        m_radius = props.getInteger("radius", 4);
+        if (m_candidates < 1 || m_neighbors < 0 || m_radius < 1)
+            throw NoriException("DirectRisIntegrator: invalid parameters "
+                "(candidates and radius must be positive)!");
+    }
+
+    Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const {
+        std::vector<Ray3f> rays(1, ray);
+        std::vector<Color3f> result;
+        LiBatch(scene, sampler, rays, std::vector<Point2i>(), result);
+        return result[0];
+    }
+
+    bool isWavefront() const { return true; }
+
+    void LiBatch(const Scene *scene, Sampler *sampler, const std::vector<Ray3f> &rays,
+                 const std::vector<Point2i> &pixels, std::vector<Color3f> &result) const {
+        const Emitter *envLight = scene->getEnvLight();
+        size_t count = rays.size();
+        result.assign(count, Color3f(0.0f));
+
+        /* Stage 1: camera rays and directly visible emitters */
+        std::vector<Intersection> its(count);
+        std::vector<uint8_t> hit(count, 0);
+        RayPacket packet;
+        HitPacket hits;
+        for (size_t start = 0; start < count; start += NORI_PACKET_SIZE) {
+            size_t end = std::min(count, start + NORI_PACKET_SIZE);
+            packet.clear();
+            for (size_t i = start; i < end; ++i)
+                packet.append(rays[i]);
+
+            scene->rayIntersect(packet, hits);
+
+            for (size_t i = start; i < end; ++i) {
+                if (hits.hit((uint32_t) (i - start))) {
+                    its[i] = hits.its[i - start];
+                    hit[i] = 1;
+                    if (its[i].mesh->isEmitter()) {
+                        EmitterQueryRecord lRecE(rays[i].o, its[i].p, its[i].shFrame.n);
+                        result[i] += its[i].mesh->getEmitter()->eval(lRecE);
+                    }
+                } else if (envLight) {
+                    EmitterQueryRecord lRec;
+                    lRec.wi = rays[i].d;
+                    result[i] += envLight->eval(lRec);
+                }
+            }
+        }
+
+        /* Stage 2: resample the candidates of every pixel */
+        std::vector<Reservoir> reservoirs(count);
+        uint32_t dimension = NORI_CAMERA_DIMENSIONS;
+        for (size_t i = 0; i < count; ++i) {
+            if (!hit[i])
+                continue;
+            if (!pixels.empty())
+                sampler->generate(pixels[i], dimension);
+
+            Reservoir &r = reservoirs[i];
+            for (int m = 0; m < m_candidates; ++m) {
+                float rndEmitter = sampler->next1D();
+                Point2f rndSample = sampler->next2D();
+                float rndChoice = sampler->next1D();
+                r.M += 1;
+
+                float pmf;
+                const Emitter *emitter = scene->sampleEmitter(its[i].p, its[i].shFrame.n, rndEmitter, pmf);
+                EmitterQueryRecord lRec(its[i].p);
+                if (!emitter || emitter->sample(lRec, rndSample).isZero())
+                    continue;
+
+                LightSample y(emitter, lRec);
+                float g;
+                float target = evalTarget(scene, its[i], -rays[i].d, y, &g);
+                float pdf = pmf * emitter->pdf(lRec) * g;
+                if (target > 0 && pdf > 0)
+                    r.update(y, target / pdf, rndChoice);
+            }
+            r.finalize(evalTarget(scene, its[i], -rays[i].d, r.y));
+        }
+        dimension += 4 * m_candidates;
+
+        /* Stage 3 (optional): merge the reservoirs of neighboring pixels */
+        if (m_neighbors > 0 && !pixels.empty())
+            spatialReuse(scene, sampler, rays, pixels, its, hit, reservoirs, dimension);
+
+        /* Stage 4: one shadow ray per pixel for the surviving sample */
+        std::vector<Ray3f> shadowRays;
+        std::vector<Color3f> shadowValues;
+        std::vector<uint32_t> shadowPixels;
+        for (size_t i = 0; i < count; ++i) {
+            const Reservoir &r = reservoirs[i];
+            if (!hit[i] || r.W == 0)
+                continue;
+            Ray3f shadowRay;
+            Color3f value = evalContribution(scene, its[i], -rays[i].d, r.y, nullptr, &shadowRay) * r.W;
+            if (value.isZero())
+                continue;
+            shadowRays.push_back(shadowRay);
+            shadowValues.push_back(value);
+            shadowPixels.push_back((uint32_t) i);
+        }
+
+        for (size_t start = 0; start < shadowRays.size(); start += NORI_PACKET_SIZE) {
+            size_t end = std::min(shadowRays.size(), start + NORI_PACKET_SIZE);
+            packet.clear();
+            for (size_t i = start; i < end; ++i)
+                packet.append(shadowRays[i]);
+
+            RayPacket::Mask occluded = scene->occluded(packet);
+            for (size_t i = start; i < end; ++i) {
+                if (!((occluded >> (i - start)) & 1))
+                    result[shadowPixels[i]] += shadowValues[i];
+            }
+        }
+    }
+
+    std::string toString() const {
+        return tfm::format("DirectRisIntegrator[candidates=%i, neighbors=%i, radius=%i]",
+            m_candidates, m_neighbors, m_radius);
+    }
+
+protected:
+    /// A point on an emitter (or a direction, for the environment map)
+    struct LightSample {
+        const Emitter *emitter;
+        Point3f p;
+        Normal3f n;   ///< Zero for point lights
+        Vector3f wi;  ///< Direction (environment map only)
+
+        LightSample() : emitter(nullptr) { }
+
+        LightSample(const Emitter *emitter, const EmitterQueryRecord &lRec)
+            : emitter(emitter), p(lRec.p), n(lRec.n), wi(lRec.wi) { }
+    };
+
+    /// Weighted reservoir that keeps one light sample
+    struct Reservoir {
+        LightSample y;
+        float wSum;  ///< Sum of the resampling weights
+        float M;     ///< Number of candidates that were seen
+        float W;     ///< Contribution weight of \c y (an estimate of one over its density)
+
+        Reservoir() : wSum(0.0f), M(0.0f), W(0.0f) { }
+
+        /// Add a candidate with resampling weight \c w, \c rnd decides whether it replaces \c y
+        void update(const LightSample &sample, float w, float rnd) {
+            wSum += w;
+            if (w > 0 && rnd * wSum < w)
+                y = sample;
+        }
+
+        /// Compute \c W once all candidates were added (\c target: target function of \c y)
+        void finalize(float target) {
+            W = (target > 0 && M > 0) ? wSum / (M * target) : 0.0f;
+        }
+    };
+
+    /**
+     * \brief Return the unshadowed contribution of the light sample \c y at
+     * the surface point \c its seen from direction \c wo, with respect to
+     * the sampling domain of the emitter
+     *
+     * \param g
+     *    Optional: receives the factor that converts the solid angle
+     *    density of \c y at \c its to that domain
+     * \param shadowRay
+     *    Optional: receives the shadow ray towards \c y
+     */
+    Color3f evalContribution(const Scene *scene, const Intersection &its, const Vector3f &wo,
+                             const LightSample &y, float *g = nullptr, Ray3f *shadowRay = nullptr) const {
+        EmitterQueryRecord lRec(its.p);
+        float factor = 1.0f;
+        if (y.emitter == scene->getEnvLight()) {
+            lRec.wi = y.wi;
+            if (shadowRay)
+                *shadowRay = Ray3f(its.p, y.wi);
+        } else {
+            Vector3f d = y.p - its.p;
+            float dist2 = d.squaredNorm(), dist = std::sqrt(dist2);
+            lRec.p = y.p;
+            lRec.n = y.n;
+            lRec.wi = d / dist;
+            /* Points on area lights: convert from solid angle to area */
+            if (!y.n.isZero())
+                factor = std::max(0.0f, -lRec.wi.dot(y.n)) / dist2;
+            if (shadowRay)
+                *shadowRay = Ray3f(its.p, lRec.wi, Epsilon, dist - Epsilon);
+        }
+        if (g)
+            *g = factor;
+
+        BSDFQueryRecord bRec(its.toLocal(wo), its.toLocal(lRec.wi), ESolidAngle);
+        bRec.uv = its.uv;
+        float cosTheta = Frame::cosTheta(bRec.wo);
+        if (cosTheta <= 0 || factor == 0)
+            return Color3f(0.0f);
+
+        return its.mesh->getBSDF()->eval(bRec) * y.emitter->eval(lRec) * (cosTheta * factor);
+    }
+
+    /// Return the target function (luminance of the unshadowed contribution)
+    float evalTarget(const Scene *scene, const Intersection &its, const Vector3f &wo,
+                     const LightSample &y, float *g = nullptr) const {
+        if (!y.emitter)
+            return 0.0f;
+        return std::max(0.0f, evalContribution(scene, its, wo, y, g).getLuminance());
+    }
+
+    /**
+     * \brief Merge the reservoir of every pixel with those of random
+     * neighbors in the same batch
+     *
+     * All pixels read the reservoirs of the previous stage, the results
+     * replace them afterwards.
+     */
+    void spatialReuse(const Scene *scene, Sampler *sampler, const std::vector<Ray3f> &rays,
+                      const std::vector<Point2i> &pixels, const std::vector<Intersection> &its,
+                      const std::vector<uint8_t> &hit, std::vector<Reservoir> &reservoirs,
+                      uint32_t dimension) const {
+        /* Find the batch index of a pixel */
+        Point2i min = pixels[0], max = pixels[0];
+        for (const Point2i &pixel : pixels) {
+            min = min.cwiseMin(pixel);
+            max = max.cwiseMax(pixel);
+        }
+        int width = max.x() - min.x() + 1, height = max.y() - min.y() + 1;
+        std::vector<int> grid(width * height, -1);
+        for (size_t i = 0; i < pixels.size(); ++i)
+            grid[(pixels[i].y() - min.y()) * width + (pixels[i].x() - min.x())] = (int) i;
+
+        std::vector<Reservoir> merged(reservoirs.size());
+        std::vector<int> sources;
+        for (size_t i = 0; i < pixels.size(); ++i) {
+            if (!hit[i])
+                continue;
+            sampler->generate(pixels[i], dimension);
+            const Intersection &its_i = its[i];
+            Vector3f wo = -rays[i].d;
+
+            /* The pixel's own reservoir: its weight is p_i(y) * W * M = wSum */
+            Reservoir &s = merged[i];
+            const Reservoir &own = reservoirs[i];
+            s.update(own.y, own.W > 0 ? own.wSum : 0.0f, sampler->next1D());
+            s.M = own.M;
+
+            sources.clear();
+            sources.push_back((int) i);
+            for (int k = 0; k < m_neighbors; ++k) {
+                Point2f offset = sampler->next2D();
+                float rndChoice = sampler->next1D();
+                int x = pixels[i].x() + (int) std::floor((2 * offset.x() - 1) * m_radius + 0.5f);
+                int y = pixels[i].y() + (int) std::floor((2 * offset.y() - 1) * m_radius + 0.5f);
+                if (x < min.x() || x > max.x() || y < min.y() || y > max.y())
+                    continue;
+                int q = grid[(y - min.y()) * width + (x - min.x())];
+                if (q < 0 || q == (int) i || !hit[q])
+                    continue;
+
+                /* Only reuse samples of similar surfaces, others rarely help */
+                const Intersection &its_q = its[q];
+                if (its_q.shFrame.n.dot(its_i.shFrame.n) < 0.9f ||
+                    std::abs(its_q.t - its_i.t) > 0.1f * its_i.t)
+                    continue;
+
+                const Reservoir &r = reservoirs[q];
+                float w = r.W > 0 ? evalTarget(scene, its_i, wo, r.y) * r.W * r.M : 0.0f;
+                s.update(r.y, w, rndChoice);
+                s.M += r.M;
+                sources.push_back(q);
+            }
+
+            /* Normalize by the candidates of the pixels that could have
+               produced the chosen sample (the target is nonzero there) */
+            float target = evalTarget(scene, its_i, wo, s.y);
+            float Z = 0.0f;
+            for (int j : sources) {
+                if (j == (int) i ? target > 0 : evalTarget(scene, its[j], -rays[j].d, s.y) > 0)
+                    Z += reservoirs[j].M;
+            }
+            s.W = (target > 0 && Z > 0) ? s.wSum / (Z * target) : 0.0f;
+        }
+        reservoirs.swap(merged);
+    }
+
+private:
+    int m_candidates;
+    int m_neighbors;
+    int m_radius;
+};
+
+NORI_REGISTER_CLASS(DirectRisIntegrator, "direct_ris");
+NORI_NAMESPACE_END
@@ -13,11 +13,20 @@ public:
         Intersection its;
         if (!scene->rayIntersect(ray, its))
             return Color3f(0.0f);
+        return LiFromHit(scene, sampler, ray, &its);
+    }
+
+    Color3f LiFromHit(const Scene *scene, Sampler *sampler, const Ray3f &ray,
+                      const Intersection *its) const {
+        if (!its)
+            return Color3f(0.0f);
 
-        Normal3f n = its.shFrame.n.cwiseAbs();
+        Normal3f n = its->shFrame.n.cwiseAbs();
         return Color3f(n.x(), n.y(), n.z());
     }
 
+    bool usesPrimaryHits() const { return true; }
+
     std::string toString() const {
         return "NormalIntegrator[]";
     }
@@ -15,17 +15,30 @@ public:
 	}
 
 	Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const {
+		Intersection its;
+		bool hit = scene->rayIntersect(ray, its);
+		return LiFromHit(scene, sampler, ray, hit ? &its : nullptr);
+	}
+
+	bool usesPrimaryHits() const { return true; }
+
+	Color3f LiFromHit(const Scene *scene, Sampler *sampler, const Ray3f &ray,
+	                  const Intersection *primaryHit) const {
 		// Initial radiance and throughput
 		Color3f Li = 0, t = 1;
 		Ray3f rayR = ray;
 		float prob = 1, w_mats = 1, w_ems = 1;
 		Color3f f(1,1,1);
 
-		while (true) {
-			Intersection its;
+		// the first intersection is provided by the caller
+		Intersection its;
+		bool hit = primaryHit != nullptr;
+		if (hit)
+			its = *primaryHit;
 
+		while (true) {
 			//if intersect
-			if (!scene->rayIntersect(rayR, its)) {
+			if (!hit) {
 				if (scene->getEnvLight() == nullptr) {
 					return Li;
 				} else {
@@ -53,14 +66,15 @@ public:
 			//emiter sampling
 			Color3f L_ems = 0;
 
-			// get a random emitter
-			const Emitter * emitter = scene->getRandomEmitter(sampler->next1D());
+			// choose an emitter (importance based)
+			float pmf;
+			const Emitter * emitter = scene->sampleEmitter(its.p, its.shFrame.n, sampler->next1D(), pmf);
 
 			// reflected
 			EmitterQueryRecord lRec_ems;
 			lRec_ems.ref = its.p;
-			Color3f Li_ems = emitter->sample(lRec_ems, sampler->next2D())*scene->getLights().size();
-			float pdf_ems = emitter->pdf(lRec_ems);
+			Color3f Li_ems = emitter->sample(lRec_ems, sampler->next2D()) / pmf;
+			float pdf_ems = emitter->pdf(lRec_ems) * pmf;
 
 			// BSDF 
 			BSDFQueryRecord bRec_ems(its.shFrame.toLocal(-rayR.d), its.shFrame.toLocal(lRec_ems.wi), ESolidAngle);
@@ -70,8 +84,7 @@ public:
 				w_ems = pdf_ems / (pdf_ems + its.mesh->getBSDF()->pdf(bRec_ems));
 
 			// check if shadow ray is occluded
-			Intersection its_ems;
-			if (!scene->rayIntersect(lRec_ems.shadowRay, its_ems))
+			if (!scene->occluded(lRec_ems.shadowRay))
 				L_ems = f_ems * Li_ems * std::max(0.f, Frame::cosTheta(its.shFrame.toLocal(lRec_ems.wi)));
 
 			Li += t * w_ems * L_ems;
@@ -80,24 +93,29 @@ public:
 			BSDFQueryRecord bRec(its.shFrame.toLocal(-rayR.d));
 			Color3f f = its.mesh->getBSDF()->sample(bRec, sampler->next2D());
 			t *= f;
-			// shoot next ray
-			rayR = Ray3f(its.p, its.toWorld(bRec.wo));
-
 			//next Le
 			float pdf_mats = its.mesh->getBSDF()->pdf(bRec);
 
-			Intersection itsR;
-			if (scene->rayIntersect(rayR, itsR)) {
-				if (itsR.mesh->isEmitter()) {
-					EmitterQueryRecord lRec_mats = EmitterQueryRecord(its.p, itsR.p, itsR.shFrame.n);
-					if (pdf_mats + itsR.mesh->getEmitter()->pdf(lRec_mats) != 0)
-						w_mats = pdf_mats / (pdf_mats + itsR.mesh->getEmitter()->pdf(lRec_mats));
+			// shoot next ray: its hit is used for the MIS weight below and
+			// is carried over to the next bounce (no second query)
+			Normal3f n = its.shFrame.n;
+			rayR = Ray3f(its.p, its.toWorld(bRec.wo));
+			hit = scene->rayIntersect(rayR, its);
+
+			if (hit) {
+				if (its.mesh->isEmitter()) {
+					const Emitter * hitEmitter = its.mesh->getEmitter();
+					EmitterQueryRecord lRec_mats = EmitterQueryRecord(rayR.o, its.p, its.shFrame.n);
+					float pdf_light = hitEmitter->pdf(lRec_mats) * scene->pmfEmitter(rayR.o, n, hitEmitter);
+					if (pdf_mats + pdf_light != 0)
+						w_mats = pdf_mats / (pdf_mats + pdf_light);
 				}
 			} else if (scene->getEnvLight() != nullptr) {
 				EmitterQueryRecord lRec_mats;
 				lRec_mats.wi = rayR.d;
-				if (pdf_mats + scene->getEnvLight()->pdf(lRec_mats) != 0)
-					w_mats = pdf_mats / (pdf_mats + scene->getEnvLight()->pdf(lRec_mats));
+				float pdf_light = scene->getEnvLight()->pdf(lRec_mats) * scene->pmfEmitter(rayR.o, n, scene->getEnvLight());
+				if (pdf_mats + pdf_light != 0)
+					w_mats = pdf_mats / (pdf_mats + pdf_light);
 			}
 
 			if (bRec.measure == EDiscrete) {
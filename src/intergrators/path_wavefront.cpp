@@ -0,0 +1,273 @@
+#include <nori/integrator.h>
+#include <nori/scene.h>
+#include <nori/bsdf.h>
+#include <nori/sampler.h>
+#include <nori/packet.h>
+#include <algorithm>
+#include <unordered_map>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Wavefront version of the MIS path tracer (\c path_mis)
+ *
+ * Instead of following one path at a time, all paths of an image block
+ * are advanced together, one stage at a time:
+ *
+ *  1. Intersect: the rays of all active paths are sorted by direction
+ *     octant and origin (Morton order) and traced as coherent packets.
+ *  2. Shade: the hit points are sorted by material and processed in that
+ *     order (emission, Russian roulette, emitter and BSDF sampling).
+ *  3. Shadow: the shadow rays created while shading are sorted in the
+ *     same way and traced as packets.
+ *  4. Accumulate: unoccluded emitter samples are added to their paths.
+ *
+ * The path state is stored in SoA form, so that each stage only touches
+ * the data it needs. The estimator is the same as in \c path_mis.
+ */
+class PathWavefrontIntegrator : public Integrator {
+public:
+    PathWavefrontIntegrator(const PropertyList &props) {
+        /* Sort the rays before tracing them? (can be disabled for comparisons) */
+        m_sortRays = props.getBoolean("sortRays", true);
+    }
+
+    void preprocess(const Scene *scene) {
+        /* Number the materials in order of appearance so that batching by
+           material doesn't depend on memory addresses */
+        m_materialIds.clear();
+        std::vector<const Shape *> shapes(scene->getShapes().begin(), scene->getShapes().end());
+        for (const ShapeGroup *group : scene->getShapeGroups())
+            shapes.insert(shapes.end(), group->getShapes().begin(), group->getShapes().end());
+        for (const Shape *shape : shapes) {
+            const BSDF *bsdf = shape->getBSDF();
+            if (bsdf && m_materialIds.find(bsdf) == m_materialIds.end())
+                m_materialIds[bsdf] = (uint32_t) m_materialIds.size();
+        }
+    }
+
+    Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const {
+        std::vector<Ray3f> rays(1, ray);
+        std::vector<Color3f> result;
+        LiBatch(scene, sampler, rays, std::vector<Point2i>(), result);
+        return result[0];
+    }
+
+    bool isWavefront() const { return true; }
+
+    void LiBatch(const Scene *scene, Sampler *sampler, const std::vector<Ray3f> &rays,
+                 const std::vector<Point2i> &pixels, std::vector<Color3f> &result) const {
+        const Emitter *envLight = scene->getEnvLight();
+        size_t pathCount = rays.size();
+
+        /* Path state (SoA) */
+        std::vector<Ray3f> ray(rays);
+        std::vector<Color3f> throughput(pathCount, Color3f(1.0f));
+        result.assign(pathCount, Color3f(0.0f));
+        std::vector<float> pdfMats(pathCount, 0.0f);
+        std::vector<Normal3f> normal(pathCount); /* At the origin of the ray (for the emitter pmf) */
+        std::vector<uint8_t> discrete(pathCount, 1); /* No MIS for the camera ray */
+        std::vector<Intersection> its(pathCount);
+
+        /* Work queues */
+        std::vector<uint32_t> rayQueue(pathCount), nextQueue;
+        std::vector<std::pair<uint32_t, uint32_t> > shadeQueue;
+        std::vector<Ray3f> shadowRays;
+        std::vector<Color3f> shadowValues;
+        std::vector<uint32_t> shadowPaths, shadowQueue;
+        for (uint32_t i = 0; i < pathCount; ++i)
+            rayQueue[i] = i;
+
+        RayPacket packet;
+        HitPacket hits;
+
+        /* All active paths are at the same depth, and each bounce consumes
+           the same number of sample dimensions (see stage 2) */
+        uint32_t dimension = NORI_CAMERA_DIMENSIONS;
+
+        while (!rayQueue.empty()) {
+            /* Stage 1: find the next vertex of all active paths */
+            if (m_sortRays)
+                sortRays(scene, ray, rayQueue);
+
+            shadeQueue.clear();
+            for (size_t start = 0; start < rayQueue.size(); start += NORI_PACKET_SIZE) {
+                size_t end = std::min(rayQueue.size(), start + NORI_PACKET_SIZE);
+                packet.clear();
+                for (size_t i = start; i < end; ++i)
+                    packet.append(ray[rayQueue[i]]);
+
+                scene->rayIntersect(packet, hits);
+
+                for (size_t i = start; i < end; ++i) {
+                    uint32_t p = rayQueue[i];
+                    if (hits.hit((uint32_t) (i - start))) {
+                        its[p] = hits.its[i - start];
+                        shadeQueue.push_back(std::make_pair(
+                            m_materialIds.at(its[p].mesh->getBSDF()), p));
+                    } else if (envLight) {
+                        /* The path escaped: add the environment light */
+                        EmitterQueryRecord lRec;
+                        lRec.wi = ray[p].d;
+                        float pdfEms = envLight->pdf(lRec) * scene->pmfEmitter(ray[p].o, normal[p], envLight);
+                        result[p] += misWeight(pdfMats[p], pdfEms, discrete[p])
+                            * throughput[p] * envLight->eval(lRec);
+                    }
+                }
+            }
+
+            /* Stage 2: shade the hit points, batched by material */
+            std::sort(shadeQueue.begin(), shadeQueue.end());
+
+            nextQueue.clear();
+            shadowRays.clear();
+            shadowValues.clear();
+            shadowPaths.clear();
+
+            for (const auto &item : shadeQueue) {
+                uint32_t p = item.second;
+                const Intersection &hit = its[p];
+                const BSDF *bsdf = hit.mesh->getBSDF();
+                Color3f &t = throughput[p];
+
+                if (!pixels.empty())
+                    sampler->generate(pixels[p], dimension);
+
+                // emitted
+                if (hit.mesh->isEmitter()) {
+                    const Emitter *emitter = hit.mesh->getEmitter();
+                    EmitterQueryRecord lRecE(ray[p].o, hit.p, hit.shFrame.n);
+                    float pdfEms = emitter->pdf(lRecE) * scene->pmfEmitter(ray[p].o, normal[p], emitter);
+                    result[p] += misWeight(pdfMats[p], pdfEms, discrete[p])
+                        * t * emitter->eval(lRecE);
+                }
+
+                // russian roulette
+                float prob = std::min(t.maxCoeff(), .99f);
+                if (sampler->next1D() >= prob)
+                    continue;
+                t /= prob;
+
+                // emitter sampling: queue a shadow ray
+                float pmf;
+                const Emitter *emitter = scene->sampleEmitter(hit.p, hit.shFrame.n, sampler->next1D(), pmf);
+                EmitterQueryRecord lRec(hit.p);
+                Color3f Li_ems = emitter->sample(lRec, sampler->next2D()) / pmf;
+                float pdf_ems = emitter->pdf(lRec) * pmf;
+
+                BSDFQueryRecord bRec_ems(hit.toLocal(-ray[p].d), hit.toLocal(lRec.wi), ESolidAngle);
+                bRec_ems.uv = hit.uv;
+                Color3f f_ems = bsdf->eval(bRec_ems);
+                float pdfSum = pdf_ems + bsdf->pdf(bRec_ems);
+                float w_ems = pdfSum != 0 ? pdf_ems / pdfSum : 0.0f;
+
+                Color3f value = t * w_ems * f_ems * Li_ems
+                    * std::max(0.f, Frame::cosTheta(hit.toLocal(lRec.wi)));
+                if (!value.isZero()) {
+                    shadowRays.push_back(lRec.shadowRay);
+                    shadowValues.push_back(value);
+                    shadowPaths.push_back(p);
+                }
+
+                // BSDF sampling: continue the path
+                BSDFQueryRecord bRec(hit.toLocal(-ray[p].d));
+                bRec.uv = hit.uv;
+                t *= bsdf->sample(bRec, sampler->next2D());
+                if (t.isZero())
+                    continue;
+
+                ray[p] = Ray3f(hit.p, hit.toWorld(bRec.wo));
+                normal[p] = hit.shFrame.n;
+                pdfMats[p] = bsdf->pdf(bRec);
+                discrete[p] = bRec.measure == EDiscrete;
+                nextQueue.push_back(p);
+            }
+
+            /* Stage 3: trace the shadow rays */
+            shadowQueue.resize(shadowRays.size());
+            for (uint32_t i = 0; i < (uint32_t) shadowRays.size(); ++i)
+                shadowQueue[i] = i;
+            if (m_sortRays)
+                sortRays(scene, shadowRays, shadowQueue);
+
+            for (size_t start = 0; start < shadowQueue.size(); start += NORI_PACKET_SIZE) {
+                size_t end = std::min(shadowQueue.size(), start + NORI_PACKET_SIZE);
+                packet.clear();
+                for (size_t i = start; i < end; ++i)
+                    packet.append(shadowRays[shadowQueue[i]]);
+
+                RayPacket::Mask occluded = scene->occluded(packet);
+
+                /* Stage 4: accumulate the unoccluded emitter samples */
+                for (size_t i = start; i < end; ++i) {
+                    if ((occluded >> (i - start)) & 1)
+                        continue;
+                    uint32_t s = shadowQueue[i];
+                    result[shadowPaths[s]] += shadowValues[s];
+                }
+            }
+
+            rayQueue.swap(nextQueue);
+            dimension += 6; /* Russian roulette, emitter choice, emitter and BSDF sample */
+        }
+    }
+
+    std::string toString() const {
+        return tfm::format("PathWavefrontIntegrator[sortRays=%s]", m_sortRays ? "true" : "false");
+    }
+
+protected:
+    /// MIS weight of a BSDF sample that hit an emitter (balance heuristic)
+    static float misWeight(float pdfMats, float pdfEms, bool discrete) {
+        if (discrete || pdfMats + pdfEms == 0)
+            return 1.0f;
+        return pdfMats / (pdfMats + pdfEms);
+    }
+
+    /// Spread the lower 10 bits of \c x so that there are two zero bits between each
+    static uint32_t expandBits(uint32_t x) {
+        x = (x | (x << 16)) & 0x030000FF;
+        x = (x | (x <<  8)) & 0x0300F00F;
+        x = (x | (x <<  4)) & 0x030C30C3;
+        x = (x | (x <<  2)) & 0x09249249;
+        return x;
+    }
+
+    /**
+     * \brief Sort a queue of ray indices so that similar rays are adjacent
+     *
+     * The key consists of the direction octant followed by the Morton code
+     * of the ray origin within the scene bounding box (9 bits per axis).
+     */
+    static void sortRays(const Scene *scene, const std::vector<Ray3f> &rays,
+                         std::vector<uint32_t> &queue) {
+        const BoundingBox3f &bbox = scene->getBoundingBox();
+        Vector3f scale = Vector3f::Constant(511.f).cwiseQuotient(
+            bbox.getExtents().cwiseMax(Vector3f::Constant(1e-6f)));
+
+        std::vector<std::pair<uint32_t, uint32_t> > keys(queue.size());
+        for (size_t i = 0; i < queue.size(); ++i) {
+            const Ray3f &ray = rays[queue[i]];
+            uint32_t octant = (ray.d.x() < 0 ? 4 : 0) | (ray.d.y() < 0 ? 2 : 0) | (ray.d.z() < 0 ? 1 : 0);
+
+            uint32_t morton = 0;
+            for (int axis = 0; axis < 3; ++axis) {
+                float pos = (ray.o[axis] - bbox.min[axis]) * scale[axis];
+                uint32_t cell = (uint32_t) std::min(std::max(pos, 0.f), 511.f);
+                morton |= expandBits(cell) << (2 - axis);
+            }
+            keys[i] = std::make_pair((octant << 27) | morton, queue[i]);
+        }
+
+        std::sort(keys.begin(), keys.end());
+        for (size_t i = 0; i < queue.size(); ++i)
+            queue[i] = keys[i].second;
+    }
+
+private:
+    bool m_sortRays;
+    std::unordered_map<const BSDF *, uint32_t> m_materialIds;
+};
+
+NORI_REGISTER_CLASS(PathWavefrontIntegrator, "path_wavefront");
+NORI_NAMESPACE_END
@@ -4,6 +4,9 @@
 #include <nori/bsdf.h>
 #include <nori/scene.h>
 #include <nori/photon.h>
+#include <nori/block.h>
+#include <nori/timer.h>
+#include <tbb/parallel_for.h>
 
 NORI_NAMESPACE_BEGIN
 
@@ -15,36 +18,69 @@ public:
         /* Lookup parameters */
 		m_photonCount = props.getInteger("photonCount", 1000000);
         m_photonRadius = props.getFloat("photonRadius", 0.0f /* Default: automatic */);
+        /* Seed of the random numbers of the photons */
+        m_seed = props.getInteger("seed", 0);
     }
 
     virtual void preprocess(const Scene *scene) override {
         cout << "Gathering " << m_photonCount << " photons .. ";
         cout.flush();
+        Timer timer;
 
         /* Create a sample generator for the preprocess step */
-        Sampler *sampler = static_cast<Sampler *>(
-            NoriObjectFactory::createInstance("independent", PropertyList()));
-
-        /* Allocate memory for the photon map */
-        m_photonMap = std::unique_ptr<PhotonMap>(new PhotonMap());
-        m_photonMap->reserve(m_photonCount);
+        std::unique_ptr<Sampler> sampler(static_cast<Sampler *>(
+            NoriObjectFactory::createInstance("independent", PropertyList())));
 
 		/* Estimate a default photon radius */
 		if (m_photonRadius == 0)
 			m_photonRadius = scene->getBoundingBox().getExtents().norm() / 500.0f;
 
-		for (int p = 0; p < m_photonCount; ++p) {
-			const Emitter* emitter = scene->getRandomEmitter(sampler->next1D());
-			
-			Ray3f ray;
-			Color3f power = emitter->samplePhoton(ray, sampler->next2D(), sampler->next2D()) * scene->getLights().size();
-			tracePhoton(scene, sampler, ray, power);
-		}
+		/* Photons are emitted in chunks of a fixed size in parallel. Every chunk
+		   has its own random sequence and photon buffer, and the buffers are
+		   concatenated in order, so the photon map doesn't depend on the number
+		   of threads. */
+		int chunkCount = (m_photonCount + PHOTON_CHUNK_SIZE - 1) / PHOTON_CHUNK_SIZE;
+		std::vector<std::vector<Photon>> chunks(chunkCount);
+
+		tbb::parallel_for(0, chunkCount, [&](int chunk) {
+			std::unique_ptr<Sampler> chunkSampler(sampler->clone());
+			ImageBlock seed(Vector2i(1), nullptr);
+			seed.setOffset(Point2i(m_seed, chunk));
+			chunkSampler->prepare(seed);
+
+			int end = std::min(m_photonCount, (chunk + 1) * PHOTON_CHUNK_SIZE);
+			for (int p = chunk * PHOTON_CHUNK_SIZE; p < end; ++p) {
+				float pmf;
+				const Emitter* emitter = scene->sampleEmitter(chunkSampler->next1D(), pmf);
+
+				Ray3f ray;
+				Color3f power = emitter->samplePhoton(ray, chunkSampler->next2D(), chunkSampler->next2D()) / pmf;
+				tracePhoton(scene, chunkSampler.get(), ray, power, chunks[chunk]);
+			}
+		});
 
-        m_photonMap->build();
+		/* Merge the buffers into the photon map */
+		std::vector<size_t> offsets(chunkCount + 1, 0);
+		for (int chunk = 0; chunk < chunkCount; ++chunk)
+			offsets[chunk + 1] = offsets[chunk] + chunks[chunk].size();
+
+        m_photonMap = std::unique_ptr<PhotonMap>(new PhotonMap());
+        m_photonMap->resize(offsets[chunkCount]);
+		tbb::parallel_for(0, chunkCount, [&](int chunk) {
+			/* Chunks without photons would index one past the end */
+			if (!chunks[chunk].empty())
+				std::copy(chunks[chunk].begin(), chunks[chunk].end(), &(*m_photonMap)[offsets[chunk]]);
+			std::vector<Photon>().swap(chunks[chunk]);
+		});
+
+		cout << "done (took " << timer.elapsedString() << ", " << m_photonMap->size()
+		     << " stored)." << endl;
+
+        m_photonMap->build(true);
     }
 
-	void tracePhoton(const Scene *scene, Sampler *sampler, Ray3f &ray, Color3f &power) {
+	void tracePhoton(const Scene *scene, Sampler *sampler, Ray3f &ray, Color3f &power,
+	                 std::vector<Photon> &photons) const {
 		float prob = 1;
 		
 		while (true) {
@@ -56,7 +92,7 @@ public:
 			Photon photon(its.p, -ray.d, power);
 
 			if (its.mesh->getBSDF()->isDiffuse())
-				m_photonMap->push_back(photon);
+				photons.push_back(photon);
 
 			// Russian roulette
 			prob = std::min(power[0], .99f);
@@ -131,15 +167,21 @@ public:
         return tfm::format(
             "PhotonMapper[\n"
             "  photonCount = %i,\n"
-            "  photonRadius = %f\n"
+            "  photonRadius = %f,\n"
+            "  seed = %i\n"
             "]",
             m_photonCount,
-            m_photonRadius
+            m_photonRadius,
+            m_seed
         );
     }
 private:
+    /// Number of photons that are emitted with the same random sequence
+    static const int PHOTON_CHUNK_SIZE = 1 << 14;
+
     int m_photonCount;
     float m_photonRadius;
+    int m_seed;
     std::unique_ptr<PhotonMap> m_photonMap;
 };
 
@@ -38,14 +38,14 @@ public:
 				rayR = Ray3f(rayR.o + td * rayR.d.normalized(), Warp::squareToUniformSphere(sampler->next2D()));
 
 				// reflected
-				const Emitter* emitter = scene->getRandomEmitter(sampler->next1D());
+				float pmf;
+				const Emitter* emitter = scene->sampleEmitter(rayR.o, Normal3f(0.0f), sampler->next1D(), pmf);
 				EmitterQueryRecord lRecE;
 				lRecE.ref = rayR.o;
-				Color3f Le = emitter->sample(lRecE, sampler->next2D())*scene->getLights().size();
+				Color3f Le = emitter->sample(lRecE, sampler->next2D()) / pmf;
 
 				// check if shadow ray is occluded
-				Intersection itsE;
-				if (scene->rayIntersect(lRecE.shadowRay, itsE))
+				if (scene->occluded(lRecE.shadowRay))
 					Le = Color3f(0, 0, 0);
 
 				t *= medium->getAlbedo();
@@ -58,14 +58,14 @@ public:
 					Li += t * medium->tr(rayR.o, its.p) * Le;
 				} else {
 					// reflected
-					const Emitter* emitter = scene->getRandomEmitter(sampler->next1D());
+					float pmf;
+					const Emitter* emitter = scene->sampleEmitter(its.p, its.shFrame.n, sampler->next1D(), pmf);
 					EmitterQueryRecord lRecE;
 					lRecE.ref = its.p;
-					Color3f Le = emitter->sample(lRecE, sampler->next2D())*scene->getLights().size();
+					Color3f Le = emitter->sample(lRecE, sampler->next2D()) / pmf;
 
 					// check if shadow ray is occluded
-					Intersection itsE;
-					if (scene->rayIntersect(lRecE.shadowRay, itsE))
+					if (scene->occluded(lRecE.shadowRay))
 						Le = Color3f(0, 0, 0);
 
 					// BSDF